@@ -0,0 +1,211 @@
+static Aabb
+emptyAabb() {
+    f32 inf = std::numeric_limits<f32>::max();
+    Aabb result = {vec3(inf, inf, inf), vec3(-inf, -inf, -inf)};
+    return result;
+}
+
+static Aabb
+unionAabb(const Aabb& a, const Aabb& b) {
+    Aabb result = {minVec3(a.min, b.min), maxVec3(a.max, b.max)};
+    return result;
+}
+
+static Aabb
+growAabb(const Aabb& box, const Vec3& point) {
+    Aabb result = {minVec3(box.min, point), maxVec3(box.max, point)};
+    return result;
+}
+
+static f32
+surfaceArea(const Aabb& box) {
+    Vec3 d = box.max - box.min;
+    if (d.x < 0 || d.y < 0 || d.z < 0) {
+        return 0;
+    }
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static Vec3
+sphereCenter(const Sphere& sphere, f32 time) {
+    return lerpVec3(sphere.center0, time, sphere.center1);
+}
+
+static Aabb
+sphereBounds(const Sphere& sphere, f32 time) {
+    Vec3 center = sphereCenter(sphere, time);
+    Vec3 r = vec3(sphere.radius, sphere.radius, sphere.radius);
+    Aabb result = {center - r, center + r};
+    return result;
+}
+
+struct BvhPrimitive {
+    Aabb bounds[2];
+    Vec3 centroid;
+    u32 index;
+};
+
+struct BvhBin {
+    Aabb bounds[2];
+    u32 count;
+};
+
+const int BVH_BIN_COUNT = 16;
+// Deepest a leaf may be, the traversals keep this many nodes on their stacks
+const i32 BVH_MAX_DEPTH = 64;
+// Nodes this deep are split at the median, which halves them and so ends in leaves within 32 more levels
+const i32 BVH_MEDIAN_SPLIT_DEPTH = BVH_MAX_DEPTH - 32;
+
+// Motion bounds are judged by their area at both ends of the shutter
+static f32
+motionArea(const Aabb bounds[2]) {
+    return 0.5f * (surfaceArea(bounds[0]) + surfaceArea(bounds[1]));
+}
+
+// Binned SAH along axis, returns where prims got partitioned, which is begin or end when it found no split
+static u32
+binnedSahSplit(BvhPrimitive* prims, u32 begin, u32 end, u16 axis, const Aabb& centroidBounds) {
+    u32 count = end - begin;
+    f32 axisMin = centroidBounds.min.Elements[axis];
+    f32 binScale = BVH_BIN_COUNT / (centroidBounds.max.Elements[axis] - axisMin);
+    auto binIndex = [&](const BvhPrimitive& prim) {
+        i32 bin = (i32)((prim.centroid.Elements[axis] - axisMin) * binScale);
+        return std::min(bin, BVH_BIN_COUNT - 1);
+    };
+
+    BvhBin bins[BVH_BIN_COUNT];
+    for (i32 i = 0; i < BVH_BIN_COUNT; i++) {
+        bins[i] = {{emptyAabb(), emptyAabb()}, 0};
+    }
+    for (u32 i = begin; i < end; i++) {
+        BvhBin& bin = bins[binIndex(prims[i])];
+        bin.bounds[0] = unionAabb(bin.bounds[0], prims[i].bounds[0]);
+        bin.bounds[1] = unionAabb(bin.bounds[1], prims[i].bounds[1]);
+        bin.count++;
+    }
+
+    f32 rightCost[BVH_BIN_COUNT];
+    Aabb right[2] = {emptyAabb(), emptyAabb()};
+    u32 rightCount = 0;
+    for (i32 i = BVH_BIN_COUNT - 1; i > 0; i--) {
+        right[0] = unionAabb(right[0], bins[i].bounds[0]);
+        right[1] = unionAabb(right[1], bins[i].bounds[1]);
+        rightCount += bins[i].count;
+        rightCost[i] = rightCount * motionArea(right);
+    }
+
+    f32 bestCost = std::numeric_limits<f32>::max();
+    i32 bestSplit = BVH_BIN_COUNT / 2;
+    Aabb left[2] = {emptyAabb(), emptyAabb()};
+    u32 leftCount = 0;
+    for (i32 i = 1; i < BVH_BIN_COUNT; i++) {
+        left[0] = unionAabb(left[0], bins[i - 1].bounds[0]);
+        left[1] = unionAabb(left[1], bins[i - 1].bounds[1]);
+        leftCount += bins[i - 1].count;
+        f32 cost = leftCount * motionArea(left) + rightCost[i];
+        if (leftCount > 0 && leftCount < count && cost < bestCost) {
+            bestCost = cost;
+            bestSplit = i;
+        }
+    }
+
+    BvhPrimitive* mid =
+        std::partition(prims + begin, prims + end, [&](const BvhPrimitive& prim) { return binIndex(prim) < bestSplit; });
+    return (u32)(mid - prims);
+}
+
+static u32
+buildBvhNode(std::vector<BvhNode>& nodes, BvhPrimitive* prims, u32 begin, u32 end, i32 depth) {
+    u32 nodeIndex = (u32)nodes.size();
+    nodes.emplace_back();
+
+    Aabb bounds[2] = {emptyAabb(), emptyAabb()};
+    Aabb centroidBounds = emptyAabb();
+    for (u32 i = begin; i < end; i++) {
+        bounds[0] = unionAabb(bounds[0], prims[i].bounds[0]);
+        bounds[1] = unionAabb(bounds[1], prims[i].bounds[1]);
+        centroidBounds = growAabb(centroidBounds, prims[i].centroid);
+    }
+    nodes[nodeIndex].bounds[0] = bounds[0];
+    nodes[nodeIndex].bounds[1] = bounds[1];
+
+    u32 count = end - begin;
+    if (count <= BVH_MAX_LEAF_SIZE) {
+        nodes[nodeIndex].offset = begin;
+        nodes[nodeIndex].count = (u16)count;
+        nodes[nodeIndex].axis = 0;
+        return nodeIndex;
+    }
+
+    Vec3 extent = centroidBounds.max - centroidBounds.min;
+    u16 axis = 0;
+    if (extent.y > extent.x) {
+        axis = 1;
+    }
+    if (extent.z > extent.Elements[axis]) {
+        axis = 2;
+    }
+
+    u32 split = begin;
+    if (extent.Elements[axis] > 0 && depth < BVH_MEDIAN_SPLIT_DEPTH) {
+        split = binnedSahSplit(prims, begin, end, axis, centroidBounds);
+    }
+    if (split == begin || split == end) {
+        // Also where all the centroids are in one spot, which splits them by index
+        split = begin + count / 2;
+        std::nth_element(prims + begin, prims + split, prims + end, [&](const BvhPrimitive& a, const BvhPrimitive& b) {
+            return a.centroid.Elements[axis] < b.centroid.Elements[axis];
+        });
+    }
+
+    buildBvhNode(nodes, prims, begin, split, depth + 1);
+    u32 second = buildBvhNode(nodes, prims, split, end, depth + 1);
+    nodes[nodeIndex].offset = second;
+    nodes[nodeIndex].count = 0;
+    nodes[nodeIndex].axis = axis;
+    return nodeIndex;
+}
+
+// Builds the BVH over world.spheres, reordering them and their ids so each leaf references a contiguous
+// range. order gets the previous index of every sphere in the new order, when given.
+static void
+buildBvh(World& world, std::vector<u32>* order = nullptr) {
+    Array<Sphere> spheres = world.spheres;
+    if (spheres.count == 0) {
+        world.bvh.nodes = {nullptr, 0};
+        return;
+    }
+
+    std::vector<BvhPrimitive> prims(spheres.count);
+    for (size_t i = 0; i < spheres.count; i++) {
+        const Sphere& sphere = spheres.members[i];
+        BvhPrimitive& prim = prims[i];
+        prim.bounds[0] = sphereBounds(sphere, SHUTTER_OPEN);
+        prim.bounds[1] = sphereBounds(sphere, SHUTTER_CLOSE);
+        prim.centroid = 0.5f * (sphereCenter(sphere, SHUTTER_OPEN) + sphereCenter(sphere, SHUTTER_CLOSE));
+        prim.index = (u32)i;
+    }
+
+    std::vector<BvhNode> nodes;
+    nodes.reserve(2 * spheres.count);
+    buildBvhNode(nodes, prims.data(), 0, (u32)prims.size(), 0);
+
+    std::vector<Sphere> ordered(spheres.count);
+    std::vector<u32> orderedIds(spheres.count);
+    for (size_t i = 0; i < prims.size(); i++) {
+        ordered[i] = spheres.members[prims[i].index];
+        orderedIds[i] = world.sphereIds.members[prims[i].index];
+    }
+    std::copy(ordered.begin(), ordered.end(), spheres.members);
+    std::copy(orderedIds.begin(), orderedIds.end(), world.sphereIds.members);
+    if (order) {
+        order->resize(prims.size());
+        for (size_t i = 0; i < prims.size(); i++) {
+            (*order)[i] = prims[i].index;
+        }
+    }
+
+    BvhNode* members = allocateLargeArray<BvhNode>(nodes.size());
+    std::copy(nodes.begin(), nodes.end(), members);
+    world.bvh.nodes = {members, nodes.size()};
+}
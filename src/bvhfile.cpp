@@ -0,0 +1,145 @@
+// Prebuilt BVHs on disk, so restarting on the same scene skips the build. Files are named after a hash of
+// the spheres and the build settings, hold nothing but offsets relative to the file start and are mapped
+// and used in place. Besides the nodes they store the order the build put the spheres in.
+
+const char BVH_FILE_MAGIC[8] = {'R', 'O', 'J', 'U', 'B', 'V', 'H', 0};
+// Bump when BvhNode or the build changes what it produces
+const u32 BVH_FILE_VERSION = 2;
+
+struct BvhFileHeader {
+    char magic[8];
+    u32 version;
+    u32 endianCheck;
+    u64 sceneHash;
+    u64 fileSize;
+    u64 sphereCount;
+    u64 nodesOffset;
+    u64 nodeCount;
+    u64 orderOffset; // u32 per sphere, its index before the build reordered them
+};
+
+static u64
+hashBvhInput(const World& world) {
+    u64 hash = hashBytes(HASH_SEED, &BVH_FILE_VERSION, sizeof(BVH_FILE_VERSION));
+    hash = hashBytes(hash, &BVH_MAX_LEAF_SIZE, sizeof(BVH_MAX_LEAF_SIZE));
+    hash = hashBytes(hash, &SHUTTER_OPEN, sizeof(SHUTTER_OPEN));
+    hash = hashBytes(hash, &SHUTTER_CLOSE, sizeof(SHUTTER_CLOSE));
+    return hashBytes(hash, world.spheres.members, world.spheres.count * sizeof(Sphere));
+}
+
+static std::string
+bvhFilePath(const char* directory, u64 hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long)hash);
+    return std::string(directory) + name;
+}
+
+static bool
+writeBvhFile(const char* path, const World& world, u64 hash, const std::vector<u32>& order) {
+    BvhFileHeader header = {};
+    memcpy(header.magic, BVH_FILE_MAGIC, sizeof(header.magic));
+    header.version = BVH_FILE_VERSION;
+    header.endianCheck = FILE_ENDIAN_CHECK;
+    header.sceneHash = hash;
+    header.sphereCount = world.spheres.count;
+    header.nodeCount = world.bvh.nodes.count;
+
+    std::vector<u8> data(sizeof(header));
+    header.nodesOffset = appendFileSection(data, world.bvh.nodes.members, sizeof(BvhNode) * world.bvh.nodes.count);
+    header.orderOffset = appendFileSection(data, order.data(), sizeof(u32) * order.size());
+    header.fileSize = data.size();
+    memcpy(data.data(), &header, sizeof(header));
+    return writeFileAtomically(path, data);
+}
+
+// Every node has to stay inside the arrays and within the traversal stack's depth, a damaged file must not
+// send traversal off into memory
+static bool
+bvhNodesValid(const BvhNode* nodes, u64 nodeCount, u64 sphereCount) {
+    // Children come after their parent, so one pass down the array finds every node's deepest path
+    std::vector<u8> depths(nodeCount, 0);
+    for (u64 i = 0; i < nodeCount; i++) {
+        const BvhNode& node = nodes[i];
+        if (node.count > 0 ? node.offset + (u64)node.count > sphereCount
+                           : node.offset <= i || node.offset >= nodeCount || i + 1 >= nodeCount ||
+                                 depths[i] >= BVH_MAX_DEPTH) {
+            return false;
+        }
+        if (node.count == 0) {
+            u8 childDepth = depths[i] + 1;
+            depths[i + 1] = std::max(depths[i + 1], childDepth);
+            depths[node.offset] = std::max(depths[node.offset], childDepth);
+        }
+    }
+    return true;
+}
+
+// Puts the spheres of world into the stored order and points the BVH at the mapped nodes
+static bool
+loadBvhFile(const char* path, u64 hash, World& world) {
+    size_t size = 0;
+    u8* data = mapFile(path, size);
+    if (!data) {
+        return false;
+    }
+    BvhFileHeader header;
+    bool valid = size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, data, sizeof(header));
+        valid = !memcmp(header.magic, BVH_FILE_MAGIC, sizeof(header.magic)) && header.version == BVH_FILE_VERSION &&
+                header.endianCheck == FILE_ENDIAN_CHECK && header.sceneHash == hash && header.fileSize == size &&
+                header.sphereCount == world.spheres.count && header.nodeCount > 0 &&
+                fileSectionFits(header.nodesOffset, header.nodeCount, sizeof(BvhNode), size) &&
+                fileSectionFits(header.orderOffset, header.sphereCount, sizeof(u32), size);
+    }
+    const BvhNode* nodes = valid ? (const BvhNode*)(data + header.nodesOffset) : nullptr;
+    const u32* order = valid ? (const u32*)(data + header.orderOffset) : nullptr;
+    valid = valid && bvhNodesValid(nodes, header.nodeCount, header.sphereCount);
+
+    std::vector<Sphere> ordered;
+    std::vector<u32> orderedIds;
+    std::vector<bool> used;
+    if (valid) {
+        ordered.resize(world.spheres.count);
+        orderedIds.resize(world.spheres.count);
+        used.resize(world.spheres.count, false);
+        for (size_t i = 0; i < world.spheres.count && valid; i++) {
+            valid = order[i] < world.spheres.count && !used[order[i]];
+            if (valid) {
+                used[order[i]] = true;
+                ordered[i] = world.spheres.members[order[i]];
+                orderedIds[i] = world.sphereIds.members[order[i]];
+            }
+        }
+    }
+    if (!valid) {
+        unmapFile(data, size);
+        return false;
+    }
+
+    std::copy(ordered.begin(), ordered.end(), world.spheres.members);
+    std::copy(orderedIds.begin(), orderedIds.end(), world.sphereIds.members);
+    world.bvh.nodes = {(BvhNode*)nodes, header.nodeCount};
+    return true;
+}
+
+// Loads the BVH from directory when it was built before, otherwise builds it and stores it there
+static void
+buildBvhCached(World& world, const char* directory) {
+    u64 hash = hashBvhInput(world);
+    std::string path = bvhFilePath(directory, hash);
+    auto start = std::chrono::high_resolution_clock::now();
+    if (loadBvhFile(path.c_str(), hash, world)) {
+        std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Loaded BVH from " << path << " in " << diff.count() << " s\n";
+        return;
+    }
+
+    std::vector<u32> order;
+    buildBvh(world, &order);
+    std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+    std::cout << "BVH build of " << world.spheres.count << " spheres: " << diff.count() << " s\n";
+    if (!writeBvhFile(path.c_str(), world, hash, order)) {
+        std::cout << "Could not write " << path << "\n";
+    }
+}
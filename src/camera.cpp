@@ -0,0 +1,105 @@
+struct Camera {
+    Vec3 lowerLeftCorner;
+    Vec3 horizontal;
+    Vec3 vertical;
+    Vec3 origin;
+    Vec3 u, v, w;
+    f32 lensRadius;
+};
+
+static Camera
+makeCamera(Vec3 lookFrom, Vec3 lookAt, Vec3 vup, f32 vfov, f32 aspect, f32 aperture, f32 focusDist) {
+    Camera result;
+
+    result.lensRadius = aperture / 2;
+    f32 theta = vfov * (f32)M_PI / 180;
+    f32 halfHeight = tan(theta / 2);
+    f32 halfWidth = aspect * halfHeight;
+    result.origin = lookFrom;
+    result.w = HMM_FastNormalize(lookFrom - lookAt);
+    result.u = HMM_FastNormalize(HMM_Cross(vup, result.w));
+    result.v = HMM_Cross(result.w, result.u);
+    result.lowerLeftCorner =
+        result.origin - halfWidth * focusDist * result.u - halfHeight * focusDist * result.v - focusDist * result.w;
+    result.horizontal = 2 * halfWidth * focusDist * result.u;
+    result.vertical = 2 * halfHeight * focusDist * result.v;
+
+    return result;
+}
+
+static Ray
+getScreenRay(const Camera& camera, f32 s, f32 t) {
+    Vec3 rd = camera.lensRadius * randomInUnitDisk();
+    Vec3 offset = camera.u * rd.x + camera.v * rd.y;
+    f32 time = SHUTTER_OPEN + Random.next() * (SHUTTER_CLOSE - SHUTTER_OPEN);
+    Ray ray = {camera.origin + offset,
+               camera.lowerLeftCorner + s * camera.horizontal + t * camera.vertical - camera.origin - offset, time};
+    return ray;
+}
+
+// Camera the window controls: it circles around target at distance, looking at it
+struct OrbitCamera {
+    Vec3 target;
+    f32 yaw; // around the world up axis, 0 looks down -z
+    f32 pitch;
+    f32 distance;
+    f32 focusDist;
+    f32 vfov;
+    f32 aperture;
+};
+
+const f32 ORBIT_MAX_PITCH = 1.55f;
+const f32 ORBIT_MIN_DISTANCE = 0.1f;
+// Input steps: radians per key press, radians per window height dragged, view heights per key press
+const f32 ORBIT_KEY_STEP = 0.05f;
+const f32 ORBIT_DRAG_SPEED = 3.0f;
+const f32 ORBIT_ZOOM_STEP = 1.1f;
+const f32 PAN_KEY_STEP = 0.05f;
+
+static OrbitCamera
+makeOrbitCamera(Vec3 lookFrom, Vec3 lookAt, f32 vfov, f32 aperture, f32 focusDist) {
+    OrbitCamera result;
+    Vec3 offset = lookFrom - lookAt;
+    result.target = lookAt;
+    result.distance = HMM_Length(offset);
+    result.yaw = atan2f(offset.x, offset.z);
+    result.pitch = asinf(offset.y / result.distance);
+    result.focusDist = focusDist;
+    result.vfov = vfov;
+    result.aperture = aperture;
+    return result;
+}
+
+static Vec3
+orbitPosition(const OrbitCamera& orbit) {
+    Vec3 direction = vec3(cosf(orbit.pitch) * sinf(orbit.yaw), sinf(orbit.pitch), cosf(orbit.pitch) * cosf(orbit.yaw));
+    return orbit.target + orbit.distance * direction;
+}
+
+static Camera
+cameraFromOrbit(const OrbitCamera& orbit, f32 aspect) {
+    return makeCamera(orbitPosition(orbit), orbit.target, vec3(0, 1, 0), orbit.vfov, aspect, orbit.aperture,
+                      orbit.focusDist);
+}
+
+static void
+orbitAround(OrbitCamera& orbit, f32 yaw, f32 pitch) {
+    orbit.yaw += yaw;
+    orbit.pitch = HMM_Clamp(-ORBIT_MAX_PITCH, orbit.pitch + pitch, ORBIT_MAX_PITCH);
+}
+
+// Moves the target in the view plane, x and y are in view heights at the target's distance
+static void
+panOrbit(OrbitCamera& orbit, f32 x, f32 y) {
+    Camera camera = cameraFromOrbit(orbit, 1.0f);
+    f32 viewHeight = 2 * orbit.distance * tanf(orbit.vfov * (f32)M_PI / 360);
+    orbit.target += viewHeight * (x * camera.u + y * camera.v);
+}
+
+// Focus moves along with the distance, so whatever was in focus stays in focus
+static void
+zoomOrbit(OrbitCamera& orbit, f32 factor) {
+    f32 distance = std::max(orbit.distance * factor, ORBIT_MIN_DISTANCE);
+    orbit.focusDist *= distance / orbit.distance;
+    orbit.distance = distance;
+}
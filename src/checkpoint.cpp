@@ -0,0 +1,135 @@
+// Checkpoints of a render in progress, so a crash or preemption only loses the passes since the last one.
+// They are written between passes, when every pixel has the same number of samples, and hold that count,
+// the camera and the float colors, plus the denoiser's features and the AOVs when there are any. Samples are
+// seeded per pixel (see samplerSeed()), so picking up from a checkpoint gives the same image as a render that
+// never stopped.
+
+const char CHECKPOINT_MAGIC[8] = {'R', 'O', 'J', 'U', 'C', 'K', 'P', 0};
+// Bump when the layout or the sampling changes
+const u32 CHECKPOINT_VERSION = 2;
+const f64 CHECKPOINT_INTERVAL = 60;
+
+struct CheckpointHeader {
+    char magic[8];
+    u32 version;
+    u32 endianCheck;
+    u64 sceneHash;
+    u64 samplerSeed;
+    i32 width, height;
+    i32 samples; // every pixel has this many
+    u32 extraBuffers; // CHECKPOINT_FEATURES and CHECKPOINT_AOVS bits
+    OrbitCamera camera;
+};
+
+enum {
+    CHECKPOINT_FEATURES = 1 << 0,
+    CHECKPOINT_AOVS = 1 << 1,
+};
+
+struct Checkpoint {
+    OrbitCamera camera;
+    i32 samples;
+    std::vector<u8> buffers; // checkpointBuffers() one after the other
+};
+
+struct CheckpointBuffer {
+    void* data;
+    size_t size;
+};
+
+// What of the framebuffer goes into checkpoints
+static std::vector<CheckpointBuffer>
+checkpointBuffers(const Framebuffer& framebuffer) {
+    size_t count = (size_t)framebuffer.width * framebuffer.height;
+    std::vector<CheckpointBuffer> buffers = {{framebuffer.color, count * sizeof(Color)}};
+    if (framebuffer.albedo) {
+        buffers.push_back({framebuffer.albedo, count * sizeof(Color)});
+        buffers.push_back({framebuffer.normal, count * sizeof(Vec3)});
+        buffers.push_back({framebuffer.luminanceSquared, count * sizeof(f32)});
+    }
+    if (framebuffer.depth) {
+        buffers.push_back({framebuffer.depth, count * sizeof(f32)});
+        buffers.push_back({framebuffer.materialId, count * sizeof(i32)});
+        buffers.push_back({framebuffer.primitiveId, count * sizeof(i32)});
+    }
+    return buffers;
+}
+
+static u32
+checkpointExtraBuffers(const Framebuffer& framebuffer) {
+    return (framebuffer.albedo ? CHECKPOINT_FEATURES : 0) | (framebuffer.depth ? CHECKPOINT_AOVS : 0);
+}
+
+// Everything the image depends on besides the camera
+static u64
+hashRenderInputs(const World& world, i32 firstSample) {
+    u64 hash = hashBytes(HASH_SEED, world.materialDescs.members, world.materialDescs.count * sizeof(MaterialDesc));
+    hash = hashBytes(hash, world.spheres.members, world.spheres.count * sizeof(Sphere));
+    i32 config[] = {TRACING_MAX_DEPTH, SAMPLES_PER_PASS, firstSample};
+    f32 shutter[] = {SHUTTER_OPEN, SHUTTER_CLOSE};
+    hash = hashBytes(hash, config, sizeof(config));
+    return hashBytes(hash, shutter, sizeof(shutter));
+}
+
+static bool
+writeCheckpoint(const char* path, u64 sceneHash, const OrbitCamera& camera, const Framebuffer& framebuffer,
+                i32 samples) {
+    CheckpointHeader header = {};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.endianCheck = FILE_ENDIAN_CHECK;
+    header.sceneHash = sceneHash;
+    header.samplerSeed = SAMPLER_SEED;
+    header.width = framebuffer.width;
+    header.height = framebuffer.height;
+    header.samples = samples;
+    header.extraBuffers = checkpointExtraBuffers(framebuffer);
+    header.camera = camera;
+
+    std::vector<u8> data(sizeof(header));
+    memcpy(data.data(), &header, sizeof(header));
+    for (const CheckpointBuffer& buffer : checkpointBuffers(framebuffer)) {
+        const u8* bytes = (const u8*)buffer.data;
+        data.insert(data.end(), bytes, bytes + buffer.size);
+    }
+    return writeFileAtomically(path, data);
+}
+
+// False when there's none or it's from another scene or build, or doesn't have the buffers framebuffer has
+static bool
+loadCheckpoint(const char* path, u64 sceneHash, const Framebuffer& framebuffer, Checkpoint& checkpoint) {
+    std::string contents;
+    if (!readFile(path, contents)) {
+        return false;
+    }
+    CheckpointHeader header;
+    size_t bufferBytes = 0;
+    for (const CheckpointBuffer& buffer : checkpointBuffers(framebuffer)) {
+        bufferBytes += buffer.size;
+    }
+    if (contents.size() != sizeof(header) + bufferBytes) {
+        return false;
+    }
+    memcpy(&header, contents.data(), sizeof(header));
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) || header.version != CHECKPOINT_VERSION ||
+        header.endianCheck != FILE_ENDIAN_CHECK || header.sceneHash != sceneHash ||
+        header.samplerSeed != SAMPLER_SEED || header.width != framebuffer.width ||
+        header.height != framebuffer.height || header.extraBuffers != checkpointExtraBuffers(framebuffer) ||
+        header.samples <= 0) {
+        return false;
+    }
+    checkpoint.camera = header.camera;
+    checkpoint.samples = header.samples;
+    checkpoint.buffers.assign(contents.begin() + sizeof(header), contents.end());
+    return true;
+}
+
+// Puts what loadCheckpoint() read back into the framebuffer
+static void
+restoreCheckpoint(const Checkpoint& checkpoint, Framebuffer& framebuffer) {
+    const u8* data = checkpoint.buffers.data();
+    for (const CheckpointBuffer& buffer : checkpointBuffers(framebuffer)) {
+        memcpy(buffer.data, data, buffer.size);
+        data += buffer.size;
+    }
+}
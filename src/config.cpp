@@ -1,8 +1,25 @@
 const int WIDTH = 400;
 const int HEIGHT = 200;
-const int TILE_WIDTH = 80;
-const int TILE_HEIGHT = 60;
+// 0 picks the tile size from the image size and thread count
+const int TILE_WIDTH = 0;
+const int TILE_HEIGHT = 0;
 
 const int WINDOW_SCALE = 1;
+// Upper limit for presenting the window, 0 follows the display refresh rate
+const int DISPLAY_FPS = 0;
 const int SUBSTEPS = 10;
+// Progressive rendering starts with one sample per PREVIEW_BLOCK_SIZE^2 pixels and halves the block until
+// full resolution, which then adds SAMPLES_PER_PASS samples per pass
+const int PREVIEW_BLOCK_SIZE = 8;
+const int SAMPLES_PER_PASS = 2;
 const int TRACING_MAX_DEPTH = 10;
+const int BVH_MAX_LEAF_SIZE = 4;
+// Count rays, BVH nodes and primitives per tile for --stats, false takes the counting out of the build
+const bool RENDER_STATS = true;
+
+// Sphere motion is defined over time [0, 1], the camera only sees this part of it
+const float SHUTTER_OPEN = 0.0f;
+const float SHUTTER_CLOSE = 1.0f;
+
+// 0 stores the image uncompressed, 1 is the fast mode, up to 9 for the smallest files
+const int PNG_COMPRESSION_LEVEL = 6;
@@ -82,4 +82,31 @@ SafeQueue<T>::pop(T* out) {
     }
     m_Queue.pop();
     return true;
-}
\ No newline at end of file
+}
+
+// Calls fn(index) for every index in [0, count), spread over all hardware threads
+template <typename F>
+static void
+parallelFor(int count, F fn) {
+    std::atomic<int> nextIndex(0);
+    auto worker = [&]() {
+        for (;;) {
+            int index = nextIndex++;
+            if (index >= count) {
+                break;
+            }
+            fn(index);
+        }
+    };
+
+    unsigned nThreads = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), (unsigned)count);
+    auto threads = std::vector<std::thread>();
+    threads.reserve(nThreads);
+    for (unsigned i = 1; i < nThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
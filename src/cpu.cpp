@@ -0,0 +1,75 @@
+// Runtime choice of the hot kernels by what the CPU supports, so one binary runs at the widest vector width
+// every machine has. The level is read with cpuid once at startup and selectCpuKernels() fills gKernels with
+// that level's versions, everything else calls through it. The wider versions do the same operations in the
+// same order as the baseline ones, so the image doesn't depend on the machine that rendered it.
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CPU_X86 1
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512vl,avx512bw")))
+#else
+#define CPU_X86 0
+#endif
+
+enum CpuLevel {
+    CPU_BASELINE, // whatever the build targets, SSE2 on x86-64
+    CPU_AVX2,
+    CPU_AVX512, // F, VL and BW, which Skylake-X and everything after has
+    CPU_LEVEL_COUNT,
+};
+
+static const char* CPU_LEVEL_NAMES[CPU_LEVEL_COUNT] = {"baseline", "avx2", "avx512"};
+
+struct World;
+struct Ray;
+struct ClosestHit;
+struct RayPacket;
+struct TonemapSettings;
+struct DenoisePass;
+
+struct CpuKernels {
+    CpuLevel level;
+    bool (*closestHitBvh)(const World& world, const Ray& ray, f32 tMin, f32 tMax, ClosestHit& closest);
+    bool (*occludedBvh)(const World& world, const Ray& ray, f32 tMin, f32 tMax);
+    // Null where there's no SIMD version
+    void (*closestHitPacket)(const World& world, const RayPacket& packet, f32 tMin, f32 tMax, ClosestHit* hits);
+    void (*tonemapSpan)(const Color* in, Color32* out, i32 count, const TonemapSettings& settings);
+    void (*denoisePixels)(const DenoisePass& pass, i32 y, i32 x0, i32 x1);
+};
+
+// Set by selectCpuKernels() before anything renders
+static CpuKernels gKernels;
+
+// Widest level this CPU and OS can run
+static CpuLevel
+detectCpuLevel() {
+#if CPU_X86
+    static const CpuLevel level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+            __builtin_cpu_supports("avx512bw")) {
+            return CPU_AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return CPU_AVX2;
+        }
+        return CPU_BASELINE;
+    }();
+    return level;
+#else
+    return CPU_BASELINE;
+#endif
+}
+
+// False for unknown names
+static bool
+parseCpuLevel(const char* name, CpuLevel& level) {
+    for (i32 i = 0; i < CPU_LEVEL_COUNT; i++) {
+        if (!strcmp(name, CPU_LEVEL_NAMES[i])) {
+            level = (CpuLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
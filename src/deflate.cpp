@@ -0,0 +1,286 @@
+// Minimal deflate encoder: stored blocks for level 0, greedy LZ77 with fixed Huffman codes above that.
+// Streams are ended with an empty stored block, so independently compressed pieces are byte aligned and
+// can be concatenated into one deflate stream.
+
+const u32 DEFLATE_WINDOW_SIZE = 32768;
+const i32 DEFLATE_HASH_BITS = 15;
+const i32 DEFLATE_MAX_LEVEL = 9;
+
+struct DeflateStream {
+    std::vector<u8> bytes;
+    u64 bitBuffer = 0;
+    u32 bitCount = 0;
+};
+
+struct DeflateTables {
+    u16 lengthCode[259];
+    u8 distanceCodeLow[256];
+    u8 distanceCodeHigh[256];
+    u32 crc[256];
+};
+
+static const u16 DEFLATE_LENGTH_BASE[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                            31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const u8 DEFLATE_LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                            2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const u16 DEFLATE_DISTANCE_BASE[30] = {1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+                                              33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+                                              1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const u8 DEFLATE_DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                              6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Hash chain probes per position, by level
+static const i32 DEFLATE_CHAIN_LENGTH[DEFLATE_MAX_LEVEL + 1] = {0, 1, 4, 8, 16, 32, 64, 128, 256, 1024};
+
+static const DeflateTables&
+deflateTables() {
+    static const DeflateTables tables = []() {
+        DeflateTables result;
+        for (i32 code = 0; code < 29; code++) {
+            i32 end = code == 28 ? 259 : DEFLATE_LENGTH_BASE[code + 1];
+            for (i32 length = DEFLATE_LENGTH_BASE[code]; length < end; length++) {
+                result.lengthCode[length] = (u16)code;
+            }
+        }
+        // Distances up to 256 are looked up directly, larger ones by (distance - 1) >> 7
+        for (i32 code = 0; code < 30; code++) {
+            i32 end = code == 29 ? 32769 : DEFLATE_DISTANCE_BASE[code + 1];
+            for (i32 distance = DEFLATE_DISTANCE_BASE[code]; distance < end; distance++) {
+                if (distance <= 256) {
+                    result.distanceCodeLow[distance - 1] = (u8)code;
+                } else {
+                    result.distanceCodeHigh[(distance - 1) >> 7] = (u8)code;
+                }
+            }
+        }
+        for (u32 i = 0; i < 256; i++) {
+            u32 c = i;
+            for (i32 k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            result.crc[i] = c;
+        }
+        return result;
+    }();
+    return tables;
+}
+
+static u32
+crc32Update(u32 crc, const u8* data, size_t size) {
+    const DeflateTables& tables = deflateTables();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = tables.crc[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+const u32 ADLER_MOD = 65521;
+
+static u32
+adler32Update(u32 adler, const u8* data, size_t size) {
+    u32 a = adler & 0xFFFF;
+    u32 b = adler >> 16;
+    while (size > 0) {
+        // 5552 is the largest block that can't overflow b before the modulo
+        size_t block = std::min<size_t>(size, 5552);
+        for (size_t i = 0; i < block; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+        data += block;
+        size -= block;
+    }
+    return (b << 16) | a;
+}
+
+// Checksum of two concatenated pieces from their own checksums, like zlib's adler32_combine
+static u32
+adler32Combine(u32 adler1, u32 adler2, size_t size2) {
+    u64 rem = size2 % ADLER_MOD;
+    u64 sum1 = adler1 & 0xFFFF;
+    u64 sum2 = (rem * sum1) % ADLER_MOD;
+    sum1 += (adler2 & 0xFFFF) + ADLER_MOD - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_MOD - rem;
+    sum1 %= ADLER_MOD;
+    sum2 %= ADLER_MOD;
+    return (u32)((sum2 << 16) | sum1);
+}
+
+static void
+putBits(DeflateStream& stream, u32 value, u32 count) {
+    stream.bitBuffer |= (u64)value << stream.bitCount;
+    stream.bitCount += count;
+    while (stream.bitCount >= 8) {
+        stream.bytes.push_back((u8)stream.bitBuffer);
+        stream.bitBuffer >>= 8;
+        stream.bitCount -= 8;
+    }
+}
+
+// Huffman codes are defined MSB first but the stream is packed LSB first
+static void
+putHuffman(DeflateStream& stream, u32 code, u32 count) {
+    u32 reversed = 0;
+    for (u32 i = 0; i < count; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    putBits(stream, reversed, count);
+}
+
+static void
+putLiteral(DeflateStream& stream, u32 symbol) {
+    if (symbol < 144) {
+        putHuffman(stream, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        putHuffman(stream, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        putHuffman(stream, symbol - 256, 7);
+    } else {
+        putHuffman(stream, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void
+putMatch(DeflateStream& stream, u32 length, u32 distance) {
+    const DeflateTables& tables = deflateTables();
+    u32 lengthCode = tables.lengthCode[length];
+    putLiteral(stream, 257 + lengthCode);
+    putBits(stream, length - DEFLATE_LENGTH_BASE[lengthCode], DEFLATE_LENGTH_EXTRA[lengthCode]);
+
+    u32 distanceCode =
+        distance <= 256 ? tables.distanceCodeLow[distance - 1] : tables.distanceCodeHigh[(distance - 1) >> 7];
+    putHuffman(stream, distanceCode, 5);
+    putBits(stream, distance - DEFLATE_DISTANCE_BASE[distanceCode], DEFLATE_DISTANCE_EXTRA[distanceCode]);
+}
+
+// Empty stored block, which also pads the stream to a byte boundary
+static void
+endDeflateStream(DeflateStream& stream, bool final) {
+    putBits(stream, final ? 1 : 0, 1);
+    putBits(stream, 0, 2);
+    if (stream.bitCount > 0) {
+        putBits(stream, 0, 8 - stream.bitCount);
+    }
+    putBits(stream, 0x0000, 16);
+    putBits(stream, 0xFFFF, 16);
+}
+
+static void
+deflateStored(DeflateStream& stream, const u8* data, size_t size) {
+    while (size > 0) {
+        u32 block = (u32)std::min<size_t>(size, 65535);
+        putBits(stream, 0, 3);
+        if (stream.bitCount > 0) {
+            putBits(stream, 0, 8 - stream.bitCount);
+        }
+        putBits(stream, block, 16);
+        putBits(stream, ~block & 0xFFFF, 16);
+        stream.bytes.insert(stream.bytes.end(), data, data + block);
+        data += block;
+        size -= block;
+    }
+}
+
+static u32
+deflateHash(const u8* p) {
+    u32 v = ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static void
+deflateFixed(DeflateStream& stream, const u8* data, size_t size, i32 level) {
+    std::vector<i32> head(1 << DEFLATE_HASH_BITS, -1);
+    std::vector<i32> prev(DEFLATE_WINDOW_SIZE, -1);
+    i32 maxChain = DEFLATE_CHAIN_LENGTH[level];
+
+    auto insert = [&](size_t pos) {
+        u32 h = deflateHash(data + pos);
+        prev[pos & (DEFLATE_WINDOW_SIZE - 1)] = head[h];
+        head[h] = (i32)pos;
+    };
+
+    putBits(stream, 0, 1);
+    putBits(stream, 1, 2);
+
+    size_t i = 0;
+    while (i + 3 <= size) {
+        size_t maxLength = std::min<size_t>(258, size - i);
+        u32 bestLength = 0;
+        u32 bestDistance = 0;
+        i32 candidate = head[deflateHash(data + i)];
+        for (i32 chain = maxChain; chain > 0 && candidate >= 0; chain--) {
+            size_t distance = i - (size_t)candidate;
+            if (distance > DEFLATE_WINDOW_SIZE) {
+                break;
+            }
+            u32 length = 0;
+            while (length < maxLength && data[candidate + length] == data[i + length]) {
+                length++;
+            }
+            if (length > bestLength) {
+                bestLength = length;
+                bestDistance = (u32)distance;
+                if (length == maxLength) {
+                    break;
+                }
+            }
+            // The window slot may have been reused, so only follow links that go backwards
+            i32 next = prev[candidate & (DEFLATE_WINDOW_SIZE - 1)];
+            if (next >= candidate) {
+                break;
+            }
+            candidate = next;
+        }
+
+        insert(i);
+        if (bestLength >= 3) {
+            putMatch(stream, bestLength, bestDistance);
+            // The fastest level skips indexing inside matches
+            if (level > 1) {
+                for (size_t k = i + 1; k < i + bestLength && k + 3 <= size; k++) {
+                    insert(k);
+                }
+            }
+            i += bestLength;
+        } else {
+            putLiteral(stream, data[i]);
+            i++;
+        }
+    }
+    for (; i < size; i++) {
+        putLiteral(stream, data[i]);
+    }
+    putLiteral(stream, 256);
+}
+
+// Appends the deflate blocks for data, ended so the next piece can follow directly.
+// Only the last piece of a stream should have final set.
+static void
+deflatePiece(DeflateStream& stream, const u8* data, size_t size, i32 level, bool final) {
+    level = std::max(0, std::min(level, DEFLATE_MAX_LEVEL));
+    if (level == 0) {
+        deflateStored(stream, data, size);
+    } else if (size > 0) {
+        deflateFixed(stream, data, size, level);
+    }
+    endDeflateStream(stream, final);
+}
+
+// Complete zlib stream with header and adler32, what zlib's compress() would produce
+static void
+zlibCompress(std::vector<u8>& out, const u8* data, size_t size, i32 level) {
+    DeflateStream stream;
+    stream.bytes.swap(out);
+    stream.bytes.clear();
+    stream.bytes.push_back(0x78);
+    stream.bytes.push_back(0x01);
+    deflatePiece(stream, data, size, level, true);
+    u32 adler = adler32Update(1, data, size);
+    stream.bytes.push_back((u8)(adler >> 24));
+    stream.bytes.push_back((u8)(adler >> 16));
+    stream.bytes.push_back((u8)(adler >> 8));
+    stream.bytes.push_back((u8)(adler));
+    out.swap(stream.bytes);
+}
@@ -0,0 +1,346 @@
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010) for the finished float framebuffer. Each
+// pass is a 5x5 B3 spline kernel with its taps spread twice as far apart as in the pass before, and every
+// tap counts less the more its color, normal and albedo differ from the center pixel. Colors are divided by
+// the albedo first and multiplied back after, so only the lighting gets smoothed and not the surfaces.
+// Like SVGF, color differences are measured against the pixel's own noise, the variance of its samples,
+// which gets filtered along with the color. That keeps sharp reflections while flat areas are smoothed.
+// Buffers are split into planes for the AVX2 and AVX-512 kernels, which do 8 or 16 pixels of a row at a time
+// with the same operations as the scalar one.
+
+const i32 DENOISE_PASSES = 5;
+const i32 DENOISE_TILE_SIZE = 64;
+// How strongly differences stop the filter, as inverse squared spreads. Colors are relative to the variance.
+const f32 DENOISE_COLOR_WEIGHT = 1.0f / 32.0f;
+const f32 DENOISE_NORMAL_WEIGHT = 4.0f;
+const f32 DENOISE_ALBEDO_WEIGHT = 4.0f;
+// Keeps noiseless pixels like the sky from dividing by zero
+const f32 DENOISE_MIN_VARIANCE = 1e-5f;
+// Black surfaces would divide by zero
+const f32 DENOISE_MIN_ALBEDO = 0.01f;
+// Taps weighted less than e^-this are dropped. Multiplying with tinier weights gives denormals, which are slow.
+const f32 DENOISE_MAX_EXPONENT = 16.0f;
+
+struct DenoisePass {
+    i32 width, height;
+    i32 step; // between taps
+    const f32* color[3];
+    const f32* variance;
+    const f32* normal[3];
+    const f32* albedo[3];
+    f32* outColor[3];
+    f32* outVariance;
+    f32 normalWeight;
+    f32 kernel[25];
+};
+
+// e^-x for x >= 0 from a polynomial for 2^fraction and the exponent bits for the rest, 0 past
+// DENOISE_MAX_EXPONENT
+static f32
+expNegative(f32 x) {
+    if (!(x <= DENOISE_MAX_EXPONENT)) {
+        return 0;
+    }
+    f32 t = x * -1.442695041f;
+    f32 whole = floorf(t);
+    f32 f = t - whole;
+    f32 p = 1.0f + f * (0.693147182f + f * (0.240226507f + f * (0.0555041087f + f * (0.00961812911f +
+                                                                                      f * 0.00133335581f))));
+    i32 bits = ((i32)whole + 127) << 23;
+    f32 scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+static void
+denoisePixelsScalar(const DenoisePass& pass, i32 y, i32 x0, i32 x1) {
+    for (i32 x = x0; x < x1; x++) {
+        size_t center = (size_t)y * pass.width + x;
+        f32 colorWeight = DENOISE_COLOR_WEIGHT / (pass.variance[center] + DENOISE_MIN_VARIANCE);
+        f32 sum[3] = {};
+        f32 varianceSum = 0;
+        f32 weightSum = 0;
+        for (i32 j = 0; j < 5; j++) {
+            i32 tapY = y + (j - 2) * pass.step;
+            if (tapY < 0 || tapY >= pass.height) {
+                continue;
+            }
+            for (i32 i = 0; i < 5; i++) {
+                i32 tapX = x + (i - 2) * pass.step;
+                if (tapX < 0 || tapX >= pass.width) {
+                    continue;
+                }
+                size_t tap = (size_t)tapY * pass.width + tapX;
+                f32 colorDistance = 0, normalDistance = 0, albedoDistance = 0;
+                for (i32 k = 0; k < 3; k++) {
+                    f32 dc = pass.color[k][tap] - pass.color[k][center];
+                    f32 dn = pass.normal[k][tap] - pass.normal[k][center];
+                    f32 da = pass.albedo[k][tap] - pass.albedo[k][center];
+                    colorDistance = colorDistance + dc * dc;
+                    normalDistance = normalDistance + dn * dn;
+                    albedoDistance = albedoDistance + da * da;
+                }
+                f32 exponent = colorDistance * colorWeight + normalDistance * pass.normalWeight +
+                               albedoDistance * DENOISE_ALBEDO_WEIGHT;
+                f32 weight = pass.kernel[j * 5 + i] * expNegative(exponent);
+                for (i32 k = 0; k < 3; k++) {
+                    sum[k] = sum[k] + weight * pass.color[k][tap];
+                }
+                varianceSum = varianceSum + weight * weight * pass.variance[tap];
+                weightSum = weightSum + weight;
+            }
+        }
+        // The center tap always counts, weightSum isn't 0
+        for (i32 k = 0; k < 3; k++) {
+            pass.outColor[k][center] = sum[k] / weightSum;
+        }
+        pass.outVariance[center] = varianceSum / (weightSum * weightSum);
+    }
+}
+
+#if CPU_X86
+CPU_TARGET_AVX2 static __m256
+expNegativeAvx2(__m256 x) {
+    __m256 inRange = _mm256_cmp_ps(x, _mm256_set1_ps(DENOISE_MAX_EXPONENT), _CMP_LE_OQ);
+    __m256 t = _mm256_mul_ps(_mm256_min_ps(x, _mm256_set1_ps(DENOISE_MAX_EXPONENT)), _mm256_set1_ps(-1.442695041f));
+    __m256 whole = _mm256_floor_ps(t);
+    __m256 f = _mm256_sub_ps(t, whole);
+    __m256 p = _mm256_mul_ps(f, _mm256_set1_ps(0.00133335581f));
+    p = _mm256_mul_ps(f, _mm256_add_ps(_mm256_set1_ps(0.00961812911f), p));
+    p = _mm256_mul_ps(f, _mm256_add_ps(_mm256_set1_ps(0.0555041087f), p));
+    p = _mm256_mul_ps(f, _mm256_add_ps(_mm256_set1_ps(0.240226507f), p));
+    p = _mm256_mul_ps(f, _mm256_add_ps(_mm256_set1_ps(0.693147182f), p));
+    p = _mm256_add_ps(_mm256_set1_ps(1.0f), p);
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(whole), _mm256_set1_epi32(127)), 23);
+    return _mm256_and_ps(_mm256_mul_ps(p, _mm256_castsi256_ps(bits)), inRange);
+}
+
+// Pixels whose taps all fall inside the row go 8 at a time, the ones near the left and right edges don't
+CPU_TARGET_AVX2 static void
+denoisePixelsAvx2(const DenoisePass& pass, i32 y, i32 x0, i32 x1) {
+    i32 reach = 2 * pass.step;
+    i32 start = std::min(std::max(x0, reach), x1);
+    i32 end = std::max(std::min(x1, pass.width - reach), start);
+    denoisePixelsScalar(pass, y, x0, start);
+    i32 x = start;
+    for (; x + 8 <= end; x += 8) {
+        size_t center = (size_t)y * pass.width + x;
+        __m256 color[3], normal[3], albedo[3], sum[3];
+        for (i32 k = 0; k < 3; k++) {
+            color[k] = _mm256_loadu_ps(pass.color[k] + center);
+            normal[k] = _mm256_loadu_ps(pass.normal[k] + center);
+            albedo[k] = _mm256_loadu_ps(pass.albedo[k] + center);
+            sum[k] = _mm256_setzero_ps();
+        }
+        __m256 colorWeight = _mm256_div_ps(
+            _mm256_set1_ps(DENOISE_COLOR_WEIGHT),
+            _mm256_add_ps(_mm256_loadu_ps(pass.variance + center), _mm256_set1_ps(DENOISE_MIN_VARIANCE)));
+        __m256 varianceSum = _mm256_setzero_ps();
+        __m256 weightSum = _mm256_setzero_ps();
+        for (i32 j = 0; j < 5; j++) {
+            i32 tapY = y + (j - 2) * pass.step;
+            if (tapY < 0 || tapY >= pass.height) {
+                continue;
+            }
+            for (i32 i = 0; i < 5; i++) {
+                size_t tap = (size_t)tapY * pass.width + x + (i - 2) * pass.step;
+                __m256 tapColor[3];
+                __m256 colorDistance = _mm256_setzero_ps();
+                __m256 normalDistance = _mm256_setzero_ps();
+                __m256 albedoDistance = _mm256_setzero_ps();
+                for (i32 k = 0; k < 3; k++) {
+                    tapColor[k] = _mm256_loadu_ps(pass.color[k] + tap);
+                    __m256 dc = _mm256_sub_ps(tapColor[k], color[k]);
+                    __m256 dn = _mm256_sub_ps(_mm256_loadu_ps(pass.normal[k] + tap), normal[k]);
+                    __m256 da = _mm256_sub_ps(_mm256_loadu_ps(pass.albedo[k] + tap), albedo[k]);
+                    colorDistance = _mm256_add_ps(colorDistance, _mm256_mul_ps(dc, dc));
+                    normalDistance = _mm256_add_ps(normalDistance, _mm256_mul_ps(dn, dn));
+                    albedoDistance = _mm256_add_ps(albedoDistance, _mm256_mul_ps(da, da));
+                }
+                __m256 exponent = _mm256_add_ps(
+                    _mm256_add_ps(_mm256_mul_ps(colorDistance, colorWeight),
+                                  _mm256_mul_ps(normalDistance, _mm256_set1_ps(pass.normalWeight))),
+                    _mm256_mul_ps(albedoDistance, _mm256_set1_ps(DENOISE_ALBEDO_WEIGHT)));
+                __m256 weight = _mm256_mul_ps(_mm256_set1_ps(pass.kernel[j * 5 + i]), expNegativeAvx2(exponent));
+                for (i32 k = 0; k < 3; k++) {
+                    sum[k] = _mm256_add_ps(sum[k], _mm256_mul_ps(weight, tapColor[k]));
+                }
+                varianceSum = _mm256_add_ps(
+                    varianceSum, _mm256_mul_ps(_mm256_mul_ps(weight, weight), _mm256_loadu_ps(pass.variance + tap)));
+                weightSum = _mm256_add_ps(weightSum, weight);
+            }
+        }
+        for (i32 k = 0; k < 3; k++) {
+            _mm256_storeu_ps(pass.outColor[k] + center, _mm256_div_ps(sum[k], weightSum));
+        }
+        _mm256_storeu_ps(pass.outVariance + center, _mm256_div_ps(varianceSum, _mm256_mul_ps(weightSum, weightSum)));
+    }
+    denoisePixelsScalar(pass, y, x, x1);
+}
+CPU_TARGET_AVX512 static __m512
+expNegativeAvx512(__m512 x) {
+    __mmask16 inRange = _mm512_cmp_ps_mask(x, _mm512_set1_ps(DENOISE_MAX_EXPONENT), _CMP_LE_OQ);
+    __m512 t = _mm512_mul_ps(_mm512_min_ps(x, _mm512_set1_ps(DENOISE_MAX_EXPONENT)), _mm512_set1_ps(-1.442695041f));
+    __m512 whole = _mm512_roundscale_ps(t, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 f = _mm512_sub_ps(t, whole);
+    __m512 p = _mm512_mul_ps(f, _mm512_set1_ps(0.00133335581f));
+    p = _mm512_mul_ps(f, _mm512_add_ps(_mm512_set1_ps(0.00961812911f), p));
+    p = _mm512_mul_ps(f, _mm512_add_ps(_mm512_set1_ps(0.0555041087f), p));
+    p = _mm512_mul_ps(f, _mm512_add_ps(_mm512_set1_ps(0.240226507f), p));
+    p = _mm512_mul_ps(f, _mm512_add_ps(_mm512_set1_ps(0.693147182f), p));
+    p = _mm512_add_ps(_mm512_set1_ps(1.0f), p);
+    __m512i bits = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(whole), _mm512_set1_epi32(127)), 23);
+    return _mm512_maskz_mov_ps(inRange, _mm512_mul_ps(p, _mm512_castsi512_ps(bits)));
+}
+
+// Like the AVX2 kernel with 16 pixels at a time, what's left on the right goes to that one
+CPU_TARGET_AVX512 static void
+denoisePixelsAvx512(const DenoisePass& pass, i32 y, i32 x0, i32 x1) {
+    i32 reach = 2 * pass.step;
+    i32 start = std::min(std::max(x0, reach), x1);
+    i32 end = std::max(std::min(x1, pass.width - reach), start);
+    denoisePixelsScalar(pass, y, x0, start);
+    i32 x = start;
+    for (; x + 16 <= end; x += 16) {
+        size_t center = (size_t)y * pass.width + x;
+        __m512 color[3], normal[3], albedo[3], sum[3];
+        for (i32 k = 0; k < 3; k++) {
+            color[k] = _mm512_loadu_ps(pass.color[k] + center);
+            normal[k] = _mm512_loadu_ps(pass.normal[k] + center);
+            albedo[k] = _mm512_loadu_ps(pass.albedo[k] + center);
+            sum[k] = _mm512_setzero_ps();
+        }
+        __m512 colorWeight = _mm512_div_ps(
+            _mm512_set1_ps(DENOISE_COLOR_WEIGHT),
+            _mm512_add_ps(_mm512_loadu_ps(pass.variance + center), _mm512_set1_ps(DENOISE_MIN_VARIANCE)));
+        __m512 varianceSum = _mm512_setzero_ps();
+        __m512 weightSum = _mm512_setzero_ps();
+        for (i32 j = 0; j < 5; j++) {
+            i32 tapY = y + (j - 2) * pass.step;
+            if (tapY < 0 || tapY >= pass.height) {
+                continue;
+            }
+            for (i32 i = 0; i < 5; i++) {
+                size_t tap = (size_t)tapY * pass.width + x + (i - 2) * pass.step;
+                __m512 tapColor[3];
+                __m512 colorDistance = _mm512_setzero_ps();
+                __m512 normalDistance = _mm512_setzero_ps();
+                __m512 albedoDistance = _mm512_setzero_ps();
+                for (i32 k = 0; k < 3; k++) {
+                    tapColor[k] = _mm512_loadu_ps(pass.color[k] + tap);
+                    __m512 dc = _mm512_sub_ps(tapColor[k], color[k]);
+                    __m512 dn = _mm512_sub_ps(_mm512_loadu_ps(pass.normal[k] + tap), normal[k]);
+                    __m512 da = _mm512_sub_ps(_mm512_loadu_ps(pass.albedo[k] + tap), albedo[k]);
+                    colorDistance = _mm512_add_ps(colorDistance, _mm512_mul_ps(dc, dc));
+                    normalDistance = _mm512_add_ps(normalDistance, _mm512_mul_ps(dn, dn));
+                    albedoDistance = _mm512_add_ps(albedoDistance, _mm512_mul_ps(da, da));
+                }
+                __m512 exponent = _mm512_add_ps(
+                    _mm512_add_ps(_mm512_mul_ps(colorDistance, colorWeight),
+                                  _mm512_mul_ps(normalDistance, _mm512_set1_ps(pass.normalWeight))),
+                    _mm512_mul_ps(albedoDistance, _mm512_set1_ps(DENOISE_ALBEDO_WEIGHT)));
+                __m512 weight = _mm512_mul_ps(_mm512_set1_ps(pass.kernel[j * 5 + i]), expNegativeAvx512(exponent));
+                for (i32 k = 0; k < 3; k++) {
+                    sum[k] = _mm512_add_ps(sum[k], _mm512_mul_ps(weight, tapColor[k]));
+                }
+                varianceSum = _mm512_add_ps(
+                    varianceSum, _mm512_mul_ps(_mm512_mul_ps(weight, weight), _mm512_loadu_ps(pass.variance + tap)));
+                weightSum = _mm512_add_ps(weightSum, weight);
+            }
+        }
+        for (i32 k = 0; k < 3; k++) {
+            _mm512_storeu_ps(pass.outColor[k] + center, _mm512_div_ps(sum[k], weightSum));
+        }
+        _mm512_storeu_ps(pass.outVariance + center, _mm512_div_ps(varianceSum, _mm512_mul_ps(weightSum, weightSum)));
+    }
+    denoisePixelsAvx2(pass, y, x, x1);
+}
+#endif
+
+static void
+denoisePixels(const DenoisePass& pass, i32 y, i32 x0, i32 x1) {
+    gKernels.denoisePixels(pass, y, x0, x1);
+}
+
+// Filters framebuffer.color in place, guided by its features. samples is how many each pixel has.
+static void
+denoiseFramebuffer(Framebuffer& framebuffer, i32 samples) {
+    i32 width = framebuffer.width;
+    i32 height = framebuffer.height;
+    size_t count = (size_t)width * height;
+    std::vector<f32> color[3], filteredColor[3], normal[3], albedo[3];
+    std::vector<f32> variance(count), filteredVariance(count);
+    for (i32 k = 0; k < 3; k++) {
+        color[k].resize(count);
+        filteredColor[k].resize(count);
+        normal[k].resize(count);
+        albedo[k].resize(count);
+    }
+
+    i32 tilesX = (width + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+    i32 tilesY = (height + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+    parallelFor(tilesY, [&](int tileY) {
+        size_t begin = (size_t)tileY * DENOISE_TILE_SIZE * width;
+        size_t end = std::min(count, begin + (size_t)DENOISE_TILE_SIZE * width);
+        for (size_t i = begin; i < end; i++) {
+            Color surface;
+            for (i32 k = 0; k < 3; k++) {
+                surface.Elements[k] = std::max(framebuffer.albedo[i].Elements[k], DENOISE_MIN_ALBEDO);
+                color[k][i] = framebuffer.color[i].Elements[k] / surface.Elements[k];
+                normal[k][i] = framebuffer.normal[i].Elements[k];
+                albedo[k][i] = framebuffer.albedo[i].Elements[k];
+            }
+            // Of the pixel's mean luminance, roughly carried over to the demodulated colors
+            f32 mean = luminance(framebuffer.color[i]);
+            f32 surfaceLuminance = luminance(surface);
+            variance[i] = std::max(0.0f, framebuffer.luminanceSquared[i] - mean * mean) /
+                          (surfaceLuminance * surfaceLuminance * (f32)samples);
+        }
+    });
+
+    const f32 B3[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    for (i32 passIndex = 0; passIndex < DENOISE_PASSES; passIndex++) {
+        DenoisePass pass;
+        pass.width = width;
+        pass.height = height;
+        pass.step = 1 << passIndex;
+        for (i32 k = 0; k < 3; k++) {
+            pass.color[k] = color[k].data();
+            pass.normal[k] = normal[k].data();
+            pass.albedo[k] = albedo[k].data();
+            pass.outColor[k] = filteredColor[k].data();
+        }
+        pass.variance = variance.data();
+        pass.outVariance = filteredVariance.data();
+        // Normals change over a distance, the further apart the taps the more they may differ
+        pass.normalWeight = DENOISE_NORMAL_WEIGHT / (f32)(pass.step * pass.step);
+        for (i32 j = 0; j < 5; j++) {
+            for (i32 i = 0; i < 5; i++) {
+                pass.kernel[j * 5 + i] = B3[j] * B3[i];
+            }
+        }
+        parallelFor(tilesX * tilesY, [&](int tile) {
+            i32 x0 = (tile % tilesX) * DENOISE_TILE_SIZE;
+            i32 y0 = (tile / tilesX) * DENOISE_TILE_SIZE;
+            i32 x1 = std::min(width, x0 + DENOISE_TILE_SIZE);
+            i32 y1 = std::min(height, y0 + DENOISE_TILE_SIZE);
+            for (i32 y = y0; y < y1; y++) {
+                denoisePixels(pass, y, x0, x1);
+            }
+        });
+        for (i32 k = 0; k < 3; k++) {
+            color[k].swap(filteredColor[k]);
+        }
+        variance.swap(filteredVariance);
+    }
+
+    parallelFor(tilesY, [&](int tileY) {
+        size_t begin = (size_t)tileY * DENOISE_TILE_SIZE * width;
+        size_t end = std::min(count, begin + (size_t)DENOISE_TILE_SIZE * width);
+        for (size_t i = begin; i < end; i++) {
+            for (i32 k = 0; k < 3; k++) {
+                f32 surface = std::max(framebuffer.albedo[i].Elements[k], DENOISE_MIN_ALBEDO);
+                framebuffer.color[i].Elements[k] = color[k][i] * surface;
+            }
+        }
+    });
+}
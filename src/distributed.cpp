@@ -0,0 +1,655 @@
+// Rendering one frame on several processes or machines. A coordinator listens on a TCP port, sends every
+// worker that connects the scene (in the scene cache format, BVH included) and then hands out tiles. Workers
+// render each tile at the full sample count, in the same passes a local render takes so the frame is the same
+// image, and send the float colors back. Tiles of a worker that
+// disconnects go back in the queue, and once the queue is empty, tiles that take much longer than usual are
+// handed out a second time with the first result winning, so a hung or slow machine doesn't hold up the frame.
+// The coordinator's sockets are non-blocking and what doesn't fit goes out when poll says there's room, so a
+// worker that stops reading, even halfway through the scene, doesn't hold up the others either.
+//
+// Messages are a NetMessageHeader followed by the payload, in the machine's own byte order. Coordinator and
+// workers have to agree on that, which the scene cache already checks, and on the image size.
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+const u32 NET_PROTOCOL_VERSION = 2;
+
+// Square tiles, the coordinator can't know how many threads the farm has when it cuts the frame up
+const i32 DISTRIBUTED_TILE_SIZE = 32;
+// Tiles in flight per worker thread, so workers don't sit idle while results and new tiles are on the wire
+const i32 DISTRIBUTED_TILES_PER_THREAD = 2;
+// Once nothing is left in the queue, tiles out for this many times the median tile time get handed out again
+const f64 DISTRIBUTED_STRAGGLER_FACTOR = 4.0;
+const i32 DISTRIBUTED_CONNECT_ATTEMPTS = 30;
+
+enum NetMessageType {
+    NET_HELLO = 1,   // worker -> coordinator: NetHello
+    NET_SCENE,       // coordinator -> worker: scene cache contents
+    NET_TILE,        // coordinator -> worker: NetTile
+    NET_TILE_RESULT, // worker -> coordinator: NetTile and width * height Colors
+    NET_DONE,        // coordinator -> worker: frame is done, disconnect
+};
+
+struct NetMessageHeader {
+    u32 type;
+    u32 reserved;
+    u64 size; // of the payload
+};
+
+struct NetHello {
+    u32 version;
+    u32 threads;
+    i32 width, height;
+};
+
+struct NetTile {
+    u32 id;
+    i32 x, y;
+    i32 width, height;
+    i32 samples;
+    i32 firstSample;
+};
+
+// Biggest message a worker sends, the colors of a whole tile are more than a hello
+const u64 NET_MAX_WORKER_MESSAGE_SIZE = sizeof(NetTile) + DISTRIBUTED_TILE_SIZE * DISTRIBUTED_TILE_SIZE * sizeof(Color);
+
+// Renders a tile of the framebuffer with its samples
+typedef void (*TileRenderFunction)(Framebuffer* framebuffer, Camera* camera, World* world, const NetTile& tile);
+
+#ifndef _WIN32
+// Buffers what arrived on a socket until whole messages are there
+struct NetConnection {
+    int fd = -1;
+    // Biggest message the other side can send, anything bigger is a broken or foreign connection
+    u64 maxMessageSize = 0;
+    std::vector<u8> received;
+    size_t readOffset = 0;
+    bool broken = false; // sent something that isn't a message
+    // Messages waiting to go out, on the coordinator's non-blocking sockets
+    std::vector<u8> sending;
+    size_t sendOffset = 0;
+};
+
+static bool
+sendAll(int fd, const void* data, size_t size) {
+    const u8* bytes = (const u8*)data;
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool
+sendMessage(int fd, u32 type, const void* data, size_t size, const void* extra = nullptr, size_t extraSize = 0) {
+    NetMessageHeader header = {type, 0, size + extraSize};
+    return sendAll(fd, &header, sizeof(header)) && sendAll(fd, data, size) && sendAll(fd, extra, extraSize);
+}
+
+// Adds a message to bytes that go out on a non-blocking socket, see sendAvailable()
+static void
+appendMessage(std::vector<u8>& bytes, u32 type, const void* data, size_t size) {
+    NetMessageHeader header = {type, 0, size};
+    bytes.insert(bytes.end(), (const u8*)&header, (const u8*)&header + sizeof(header));
+    bytes.insert(bytes.end(), (const u8*)data, (const u8*)data + size);
+}
+
+// Sends what a non-blocking socket takes of data from offset on and moves offset past it. False once the
+// other side is gone.
+static bool
+sendAvailable(int fd, const std::vector<u8>& data, size_t& offset) {
+    while (offset < data.size()) {
+        ssize_t sent = send(fd, data.data() + offset, data.size() - offset, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        offset += (size_t)sent;
+    }
+    return true;
+}
+
+// Reads whatever is there, blocking until something is unless the socket is non-blocking. False once the
+// other side is gone.
+static bool
+receiveAvailable(NetConnection& connection) {
+    if (connection.readOffset > 0 && connection.readOffset * 2 >= connection.received.size()) {
+        connection.received.erase(connection.received.begin(), connection.received.begin() + connection.readOffset);
+        connection.readOffset = 0;
+    }
+    size_t used = connection.received.size();
+    connection.received.resize(used + 64 * 1024);
+    ssize_t got;
+    do {
+        got = recv(connection.fd, connection.received.data() + used, 64 * 1024, 0);
+    } while (got < 0 && errno == EINTR);
+    connection.received.resize(used + std::max<ssize_t>(got, 0));
+    return got > 0 || (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+// Takes the next whole message out of the buffer if there is one
+static bool
+nextMessage(NetConnection& connection, NetMessageHeader& header, std::vector<u8>& payload) {
+    size_t available = connection.received.size() - connection.readOffset;
+    if (available < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, connection.received.data() + connection.readOffset, sizeof(header));
+    if (header.size > connection.maxMessageSize) {
+        connection.broken = true;
+        return false;
+    }
+    if (available - sizeof(header) < header.size) {
+        return false;
+    }
+    const u8* start = connection.received.data() + connection.readOffset + sizeof(header);
+    payload.assign(start, start + header.size);
+    connection.readOffset += sizeof(header) + header.size;
+    return true;
+}
+
+static bool
+receiveMessage(NetConnection& connection, NetMessageHeader& header, std::vector<u8>& payload) {
+    for (;;) {
+        if (nextMessage(connection, header, payload)) {
+            return true;
+        }
+        if (connection.broken || !receiveAvailable(connection)) {
+            return false;
+        }
+    }
+}
+
+static void
+setNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// address is host:port
+static int
+connectTo(const char* address) {
+    const char* colon = strrchr(address, ':');
+    if (!colon) {
+        return -1;
+    }
+    std::string host(address, colon - address);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), colon + 1, &hints, &addresses) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        setNoDelay(fd);
+    }
+    return fd;
+}
+
+static int
+listenOn(i32 port) {
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    int zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons((u16)port);
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct DistributedTile {
+    NetTile tile;
+    bool done;
+    i32 assignments; // workers currently rendering it
+    std::chrono::steady_clock::time_point firstAssigned;
+};
+
+struct InFlightTile {
+    u32 id;
+    std::chrono::steady_clock::time_point sent;
+};
+
+struct RemoteWorker {
+    NetConnection connection;
+    u32 threads; // 0 until it said hello
+    size_t sceneSent; // bytes of the scene message that went out, tiles only follow once all of it did
+    std::vector<InFlightTile> tiles;
+    u32 tilesDone;
+};
+
+// Whether something still has to go out to the worker, nothing does before its hello
+static bool
+hasUnsent(const RemoteWorker& worker, const std::vector<u8>& sceneMessage) {
+    const NetConnection& connection = worker.connection;
+    return worker.threads > 0 &&
+           (worker.sceneSent < sceneMessage.size() || connection.sendOffset < connection.sending.size());
+}
+
+// Sends what the worker's socket takes, the rest of the scene first. False once the worker is gone.
+static bool
+sendToWorker(RemoteWorker& worker, const std::vector<u8>& sceneMessage) {
+    NetConnection& connection = worker.connection;
+    if (!hasUnsent(worker, sceneMessage)) {
+        return true;
+    }
+    if (!sendAvailable(connection.fd, sceneMessage, worker.sceneSent)) {
+        return false;
+    }
+    if (worker.sceneSent < sceneMessage.size()) {
+        return true;
+    }
+    if (!sendAvailable(connection.fd, connection.sending, connection.sendOffset)) {
+        return false;
+    }
+    if (connection.sendOffset == connection.sending.size()) {
+        connection.sending.clear();
+        connection.sendOffset = 0;
+    }
+    return true;
+}
+
+// Takes a worker's unfinished tiles back, those nobody else is on go to the front of the queue
+static void
+releaseTiles(RemoteWorker& worker, std::vector<DistributedTile>& tiles, std::deque<u32>& queue) {
+    for (const InFlightTile& inFlight : worker.tiles) {
+        DistributedTile& tile = tiles[inFlight.id];
+        tile.assignments--;
+        if (!tile.done && tile.assignments == 0) {
+            queue.push_front(inFlight.id);
+        }
+    }
+    worker.tiles.clear();
+}
+
+// With an empty queue, the longest running tile that's well over the usual time and that this worker isn't
+// already on, or -1
+static i32
+findStraggler(const RemoteWorker& worker, const std::vector<DistributedTile>& tiles, std::vector<f64> tileSeconds) {
+    if (tileSeconds.empty()) {
+        return -1;
+    }
+    std::nth_element(tileSeconds.begin(), tileSeconds.begin() + tileSeconds.size() / 2, tileSeconds.end());
+    f64 threshold = DISTRIBUTED_STRAGGLER_FACTOR * tileSeconds[tileSeconds.size() / 2];
+    auto now = std::chrono::steady_clock::now();
+    i32 result = -1;
+    f64 longest = threshold;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const DistributedTile& tile = tiles[i];
+        if (tile.done || tile.assignments != 1) {
+            continue;
+        }
+        std::chrono::duration<double> running = now - tile.firstAssigned;
+        bool ours = std::any_of(worker.tiles.begin(), worker.tiles.end(),
+                                [&](const InFlightTile& inFlight) { return inFlight.id == i; });
+        if (running.count() > longest && !ours) {
+            longest = running.count();
+            result = (i32)i;
+        }
+    }
+    return result;
+}
+
+static void
+dropWorker(std::vector<RemoteWorker>& workers, size_t index, std::vector<DistributedTile>& tiles,
+           std::deque<u32>& queue, const char* reason) {
+    RemoteWorker& worker = workers[index];
+    size_t requeued = worker.tiles.size();
+    releaseTiles(worker, tiles, queue);
+    close(worker.connection.fd);
+    std::cout << "Worker " << worker.connection.fd << " " << reason << " after " << worker.tilesDone << " tiles, "
+              << requeued << " tiles taken back\n";
+    workers.erase(workers.begin() + index);
+}
+
+// Serves the scene to workers until every tile of the frame has come back, then sends them home.
+// The coordinator doesn't render itself, run a worker on the same machine for that.
+static bool
+runCoordinator(i32 port, const Scene& scene, SampleRange range, Framebuffer* framebuffer) {
+    signal(SIGPIPE, SIG_IGN);
+    int listenFd = listenOn(port);
+    if (listenFd < 0) {
+        printf("Could not listen on port %d: %s\n", port, strerror(errno));
+        return false;
+    }
+    // Every worker is sent the scene from this one copy
+    std::vector<u8> sceneMessage;
+    {
+        std::vector<u8> sceneData = serializeSceneCache(scene, 0);
+        appendMessage(sceneMessage, NET_SCENE, sceneData.data(), sceneData.size());
+    }
+
+    TileGrid grid = makeTileGrid(WIDTH, HEIGHT, 1, DISTRIBUTED_TILE_SIZE, DISTRIBUTED_TILE_SIZE);
+    std::vector<DistributedTile> tiles(grid.columns * grid.rows);
+    std::deque<u32> queue;
+    for (i32 index : makeTileOrder(grid, std::vector<f64>())) {
+        NetTile& tile = tiles[index].tile;
+        tile.id = (u32)index;
+        tile.x = (index % grid.columns) * grid.tileWidth;
+        tile.y = (index / grid.columns) * grid.tileHeight;
+        tile.width = std::min(grid.tileWidth, WIDTH - tile.x);
+        tile.height = std::min(grid.tileHeight, HEIGHT - tile.y);
+        tile.samples = range.samples;
+        tile.firstSample = range.firstSample;
+        queue.push_back((u32)index);
+    }
+    std::cout << "Coordinating " << tiles.size() << " tiles on port " << port << ", waiting for workers\n";
+
+    std::vector<RemoteWorker> workers;
+    std::vector<f64> tileSeconds;
+    size_t tilesDone = 0;
+    u32 tilesRepeated = 0;
+    // Timed from the first worker on, waiting for workers to come up doesn't count
+    bool started = false;
+    std::chrono::steady_clock::time_point start;
+    std::vector<pollfd> pollFds;
+    std::vector<u8> payload;
+    while (tilesDone < tiles.size()) {
+        pollFds.assign(1, {listenFd, POLLIN, 0});
+        for (RemoteWorker& worker : workers) {
+            short events = POLLIN | (hasUnsent(worker, sceneMessage) ? POLLOUT : 0);
+            pollFds.push_back({worker.connection.fd, events, 0});
+        }
+        // Wakes up now and then to look for stragglers even when nothing arrives
+        if (poll(pollFds.data(), pollFds.size(), 100) < 0 && errno != EINTR) {
+            printf("poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (pollFds[0].revents & POLLIN) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd >= 0) {
+                setNoDelay(fd);
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                RemoteWorker worker = {};
+                worker.connection.fd = fd;
+                worker.connection.maxMessageSize = NET_MAX_WORKER_MESSAGE_SIZE;
+                workers.push_back(worker);
+            }
+        }
+
+        // Newly accepted workers weren't polled, they come after the polled ones
+        for (size_t i = pollFds.size() - 1; i-- > 0;) {
+            if (!(pollFds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            RemoteWorker& worker = workers[i];
+            if (!receiveAvailable(worker.connection)) {
+                dropWorker(workers, i, tiles, queue, "disconnected");
+                continue;
+            }
+            const char* error = nullptr;
+            NetMessageHeader header;
+            while (!error && nextMessage(worker.connection, header, payload)) {
+                if (header.type == NET_HELLO && header.size == sizeof(NetHello) && worker.threads == 0) {
+                    NetHello hello;
+                    memcpy(&hello, payload.data(), sizeof(hello));
+                    if (hello.version != NET_PROTOCOL_VERSION || hello.width != WIDTH || hello.height != HEIGHT) {
+                        error = "has a different version or image size";
+                    } else {
+                        // The scene goes out from here on, as fast as the worker takes it
+                        worker.threads = std::max(hello.threads, 1u);
+                        if (!started) {
+                            start = std::chrono::steady_clock::now();
+                            started = true;
+                        }
+                        std::cout << "Worker " << worker.connection.fd << " joined with " << worker.threads
+                                  << " threads\n";
+                    }
+                } else if (header.type == NET_TILE_RESULT && header.size >= sizeof(NetTile)) {
+                    NetTile result;
+                    memcpy(&result, payload.data(), sizeof(result));
+                    auto inFlight = std::find_if(worker.tiles.begin(), worker.tiles.end(),
+                                                 [&](const InFlightTile& t) { return t.id == result.id; });
+                    if (inFlight == worker.tiles.end()) {
+                        error = "sent a tile it wasn't given";
+                        break;
+                    }
+                    DistributedTile& tile = tiles[result.id];
+                    if (header.size != sizeof(NetTile) + (u64)tile.tile.width * tile.tile.height * sizeof(Color)) {
+                        error = "sent a tile of the wrong size";
+                        break;
+                    }
+                    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - inFlight->sent;
+                    worker.tiles.erase(inFlight);
+                    tile.assignments--;
+                    worker.tilesDone++;
+                    if (!tile.done) {
+                        const Color* colors = (const Color*)(payload.data() + sizeof(NetTile));
+                        for (i32 row = 0; row < tile.tile.height; row++) {
+                            memcpy(framebuffer->color + (tile.tile.y + row) * framebuffer->width + tile.tile.x,
+                                   colors + row * tile.tile.width, tile.tile.width * sizeof(Color));
+                        }
+                        tile.done = true;
+                        tilesDone++;
+                        tileSeconds.push_back(seconds.count());
+                    }
+                } else {
+                    error = "sent an unexpected message";
+                }
+            }
+            if (!error && worker.connection.broken) {
+                error = "sent garbage";
+            }
+            if (error) {
+                dropWorker(workers, i, tiles, queue, error);
+            }
+        }
+
+        for (size_t i = 0; i < workers.size(); i++) {
+            RemoteWorker& worker = workers[i];
+            // Tiles only once the worker has all of the scene
+            bool sent = sendToWorker(worker, sceneMessage);
+            while (sent && worker.threads > 0 && worker.sceneSent == sceneMessage.size() &&
+                   worker.tiles.size() < worker.threads * DISTRIBUTED_TILES_PER_THREAD) {
+                i32 id = -1;
+                if (!queue.empty()) {
+                    id = queue.front();
+                    queue.pop_front();
+                } else {
+                    id = findStraggler(worker, tiles, tileSeconds);
+                    tilesRepeated += id >= 0;
+                }
+                if (id < 0) {
+                    break;
+                }
+                DistributedTile& tile = tiles[id];
+                auto now = std::chrono::steady_clock::now();
+                if (tile.assignments == 0) {
+                    tile.firstAssigned = now;
+                }
+                tile.assignments++;
+                worker.tiles.push_back({(u32)id, now});
+                appendMessage(worker.connection.sending, NET_TILE, &tile.tile, sizeof(tile.tile));
+            }
+            if (!sent || !sendToWorker(worker, sceneMessage)) {
+                bool hasScene = worker.sceneSent == sceneMessage.size();
+                dropWorker(workers, i--, tiles, queue, hasScene ? "stopped taking tiles" : "failed to take the scene");
+            }
+        }
+    }
+
+    for (RemoteWorker& worker : workers) {
+        // Not in the middle of a message, a worker that's still behind just sees the connection go away
+        if (!hasUnsent(worker, sceneMessage)) {
+            sendMessage(worker.connection.fd, NET_DONE, nullptr, 0);
+        }
+        close(worker.connection.fd);
+    }
+    close(listenFd);
+    if (tilesDone < tiles.size()) {
+        return false;
+    }
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+    std::cout << "Distributed render: " << diff.count() << " s, " << tilesRepeated << " tiles handed out again\n";
+    return true;
+}
+
+// Connects to the coordinator, retrying for a while so workers can be started first, and renders the tiles
+// it sends until it says the frame is done
+static bool
+runWorker(const char* address, TileRenderFunction renderTile) {
+    signal(SIGPIPE, SIG_IGN);
+    NetConnection connection;
+    for (i32 attempt = 0; attempt < DISTRIBUTED_CONNECT_ATTEMPTS && connection.fd < 0; attempt++) {
+        if (attempt > 0) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        connection.fd = connectTo(address);
+    }
+    if (connection.fd < 0) {
+        printf("Could not connect to coordinator %s\n", address);
+        return false;
+    }
+
+    u32 nThreads = std::max(1u, std::thread::hardware_concurrency());
+    NetHello hello = {NET_PROTOCOL_VERSION, nThreads, WIDTH, HEIGHT};
+    NetMessageHeader header;
+    // The scene points into this, it has to outlive the render threads
+    std::vector<u8> sceneData;
+    Scene scene;
+    // The scene has to fit in memory, after it there are only tiles
+    connection.maxMessageSize = (u64)sysconf(_SC_PHYS_PAGES) * (u64)sysconf(_SC_PAGESIZE);
+    if (!sendMessage(connection.fd, NET_HELLO, &hello, sizeof(hello)) ||
+        !receiveMessage(connection, header, sceneData) || header.type != NET_SCENE ||
+        !useSceneCache(sceneData.data(), sceneData.size(), 0, scene)) {
+        printf("Coordinator %s didn't send a usable scene\n", address);
+        close(connection.fd);
+        return false;
+    }
+    connection.maxMessageSize = sizeof(NetTile);
+    std::cout << "Got " << scene.world.spheres.count << " spheres from " << address << ", rendering with " << nThreads
+              << " threads\n";
+
+    Framebuffer framebuffer;
+    framebuffer.width = WIDTH;
+    framebuffer.height = HEIGHT;
+    framebuffer.color = (Color*)calloc(WIDTH * HEIGHT, sizeof(Color));
+    framebuffer.pixels = nullptr;
+    framebuffer.albedo = nullptr;
+    framebuffer.normal = nullptr;
+    framebuffer.luminanceSquared = nullptr;
+    framebuffer.depth = nullptr;
+    framebuffer.materialId = nullptr;
+    framebuffer.primitiveId = nullptr;
+    Camera camera = cameraFromOrbit(scene.camera, float(WIDTH) / float(HEIGHT));
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::queue<NetTile> queue;
+    bool stopping = false;
+    std::mutex sendMutex;
+    std::atomic<u32> tilesDone(0);
+    auto renderThread = [&]() {
+        std::vector<Color> colors;
+        for (;;) {
+            NetTile tile;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueChanged.wait(lock, [&]() { return stopping || !queue.empty(); });
+                if (stopping) {
+                    return;
+                }
+                tile = queue.front();
+                queue.pop();
+            }
+            renderTile(&framebuffer, &camera, &scene.world, tile);
+            colors.resize(tile.width * tile.height);
+            for (i32 row = 0; row < tile.height; row++) {
+                memcpy(colors.data() + row * tile.width, framebuffer.color + (tile.y + row) * WIDTH + tile.x,
+                       tile.width * sizeof(Color));
+            }
+            std::lock_guard<std::mutex> lockGuard(sendMutex);
+            sendMessage(connection.fd, NET_TILE_RESULT, &tile, sizeof(tile), colors.data(),
+                        colors.size() * sizeof(Color));
+            tilesDone++;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (u32 i = 0; i < nThreads; i++) {
+        threads.emplace_back(renderThread);
+    }
+
+    bool finished = false;
+    std::vector<u8> payload;
+    while (receiveMessage(connection, header, payload)) {
+        if (header.type == NET_TILE && header.size == sizeof(NetTile)) {
+            NetTile tile;
+            memcpy(&tile, payload.data(), sizeof(tile));
+            if (tile.x < 0 || tile.y < 0 || tile.width <= 0 || tile.height <= 0 || tile.x + tile.width > WIDTH ||
+                tile.y + tile.height > HEIGHT) {
+                break;
+            }
+            std::lock_guard<std::mutex> lockGuard(queueMutex);
+            queue.push(tile);
+            queueChanged.notify_one();
+        } else {
+            finished = header.type == NET_DONE;
+            break;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lockGuard(queueMutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    close(connection.fd);
+    std::cout << "Rendered " << tilesDone << " tiles, " << (finished ? "frame done" : "coordinator went away") << "\n";
+    return finished;
+}
+#else
+static bool
+runCoordinator(i32, const Scene&, SampleRange, Framebuffer*) {
+    printf("Distributed rendering is not supported on Windows\n");
+    return false;
+}
+
+static bool
+runWorker(const char*, TileRenderFunction) {
+    printf("Distributed rendering is not supported on Windows\n");
+    return false;
+}
+#endif
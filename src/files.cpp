@@ -0,0 +1,140 @@
+// File helpers shared by the scene and BVH caches
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Stored in file headers so a file from a machine with the other byte order is rejected
+const u32 FILE_ENDIAN_CHECK = 0x01020304;
+// Sections of mapped files start at multiples of this, which covers the alignment of anything stored
+const u64 FILE_SECTION_ALIGNMENT = 64;
+
+// FNV-1a
+static u64
+hashBytes(u64 hash, const void* data, size_t size) {
+    const u8* bytes = (const u8*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+const u64 HASH_SEED = 0xcbf29ce484222325ull;
+
+static bool
+readFile(const char* path, std::string& contents) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    char buffer[64 * 1024];
+    size_t read;
+    contents.clear();
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        contents.append(buffer, read);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+// Goes through a temporary file and a rename, so readers never see half a file even when several
+// processes write the same one
+static bool
+writeFileAtomically(const char* path, const std::vector<u8>& data) {
+    std::string tempPath = std::string(path) + "." + std::to_string(std::random_device()()) + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tempPath.c_str(), path) == 0;
+    if (!ok) {
+        remove(tempPath.c_str());
+    }
+    return ok;
+}
+
+// Reads size bytes, retrying short reads
+static bool
+readAll(int fd, u8* data, size_t size) {
+    while (size > 0) {
+        ssize_t got = read(fd, data, size);
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        size -= (size_t)got;
+    }
+    return true;
+}
+
+// Maps the whole file, copy on write, and leaves it mapped for the rest of the run. With huge pages the file
+// is read into memory instead, mapped files only get normal pages.
+static u8*
+mapFile(const char* path, size_t& size) {
+#ifdef _WIN32
+    std::string contents;
+    if (!readFile(path, contents)) {
+        return nullptr;
+    }
+    size = contents.size();
+    u8* data = new u8[size];
+    memcpy(data, contents.data(), size);
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        size = (size_t)info.st_size;
+        if (gHugePageMode != HUGE_PAGES_OFF && size >= HUGE_PAGE_SIZE) {
+            data = mapPages(size);
+            if (data && !readAll(fd, (u8*)data, size)) {
+                unmapPages(data, size);
+                data = nullptr;
+            }
+            data = data ? data : MAP_FAILED;
+        } else {
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+    }
+    close(fd);
+    return data == MAP_FAILED ? nullptr : (u8*)data;
+#endif
+}
+
+static void
+unmapFile(u8* data, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    delete[] data;
+#else
+    if (gHugePageMode != HUGE_PAGES_OFF && size >= HUGE_PAGE_SIZE) {
+        unmapPages(data, size);
+    } else {
+        munmap(data, size);
+    }
+#endif
+}
+
+// Appends size bytes at the next aligned offset and returns that offset
+static u64
+appendFileSection(std::vector<u8>& out, const void* data, size_t size) {
+    out.resize((out.size() + FILE_SECTION_ALIGNMENT - 1) / FILE_SECTION_ALIGNMENT * FILE_SECTION_ALIGNMENT);
+    u64 offset = out.size();
+    out.insert(out.end(), (const u8*)data, (const u8*)data + size);
+    return offset;
+}
+
+static bool
+fileSectionFits(u64 offset, u64 count, size_t elementSize, size_t fileSize) {
+    return offset % FILE_SECTION_ALIGNMENT == 0 && offset <= fileSize && count <= (fileSize - offset) / elementSize;
+}
@@ -0,0 +1,466 @@
+// Float image output straight from the linear framebuffer: PFM, Radiance HDR and tiled OpenEXR.
+// All writers stream from the framebuffer, the EXR one compresses a row of tiles at a time in parallel.
+// EXRs also record which samples they hold, and can be read back a row of tiles at a time for merging.
+
+static_assert(sizeof(Color) == 3 * sizeof(f32), "Framebuffer colors are written out as packed RGB floats");
+
+enum ExrCompression {
+    EXR_COMPRESSION_NONE = 0,
+    EXR_COMPRESSION_ZIP = 3,
+};
+
+const i32 EXR_TILE_SIZE = 64;
+const i32 EXR_ZIP_LEVEL = 4;
+
+static bool
+writePfm(const char* path, const Framebuffer& framebuffer) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    // Negative scale means little endian, rows go from bottom to top
+    bool ok = fprintf(file, "PF\n%d %d\n-1.0\n", framebuffer.width, framebuffer.height) > 0;
+    for (i32 y = framebuffer.height - 1; y >= 0 && ok; y--) {
+        const Color* row = framebuffer.color + (size_t)y * framebuffer.width;
+        ok = fwrite(row, sizeof(Color), framebuffer.width, file) == (size_t)framebuffer.width;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+static bool
+writeRadianceHdr(const char* path, const Framebuffer& framebuffer) {
+    return stbi_write_hdr(path, framebuffer.width, framebuffer.height, 3, (const float*)framebuffer.color) != 0;
+}
+
+static void
+appendU32LittleEndian(std::vector<u8>& out, u32 value) {
+    out.push_back((u8)(value));
+    out.push_back((u8)(value >> 8));
+    out.push_back((u8)(value >> 16));
+    out.push_back((u8)(value >> 24));
+}
+
+static void
+appendF32LittleEndian(std::vector<u8>& out, f32 value) {
+    u32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    appendU32LittleEndian(out, bits);
+}
+
+static void
+appendExrAttribute(std::vector<u8>& header, const char* name, const char* type, const std::vector<u8>& value) {
+    header.insert(header.end(), name, name + strlen(name) + 1);
+    header.insert(header.end(), type, type + strlen(type) + 1);
+    appendU32LittleEndian(header, (u32)value.size());
+    header.insert(header.end(), value.begin(), value.end());
+}
+
+// Sample indices a render covers, firstSample up to firstSample + samples
+struct SampleRange {
+    i32 firstSample;
+    i32 samples;
+};
+
+static std::vector<u8>
+makeExrHeader(i32 width, i32 height, ExrCompression compression, SampleRange range) {
+    std::vector<u8> header = {0x76, 0x2F, 0x31, 0x01};
+    appendU32LittleEndian(header, 2 | 0x200); // version 2, single part tiled
+
+    std::vector<u8> value;
+    // Channels have to be sorted by name, all 32-bit float
+    const char* channels[3] = {"B", "G", "R"};
+    for (i32 i = 0; i < 3; i++) {
+        value.insert(value.end(), channels[i], channels[i] + 2);
+        appendU32LittleEndian(value, 2);
+        appendU32LittleEndian(value, 0); // pLinear and reserved
+        appendU32LittleEndian(value, 1);
+        appendU32LittleEndian(value, 1);
+    }
+    value.push_back(0);
+    appendExrAttribute(header, "channels", "chlist", value);
+
+    value = {(u8)compression};
+    appendExrAttribute(header, "compression", "compression", value);
+
+    value.clear();
+    appendU32LittleEndian(value, 0);
+    appendU32LittleEndian(value, 0);
+    appendU32LittleEndian(value, (u32)(width - 1));
+    appendU32LittleEndian(value, (u32)(height - 1));
+    appendExrAttribute(header, "dataWindow", "box2i", value);
+    appendExrAttribute(header, "displayWindow", "box2i", value);
+
+    value = {0}; // increasing y
+    appendExrAttribute(header, "lineOrder", "lineOrder", value);
+
+    value.clear();
+    appendF32LittleEndian(value, 1.0f);
+    appendExrAttribute(header, "pixelAspectRatio", "float", value);
+
+    value.clear();
+    appendF32LittleEndian(value, 0.0f);
+    appendF32LittleEndian(value, 0.0f);
+    appendExrAttribute(header, "screenWindowCenter", "v2f", value);
+
+    value.clear();
+    appendF32LittleEndian(value, 1.0f);
+    appendExrAttribute(header, "screenWindowWidth", "float", value);
+
+    value.clear();
+    appendU32LittleEndian(value, EXR_TILE_SIZE);
+    appendU32LittleEndian(value, EXR_TILE_SIZE);
+    value.push_back(0); // one level, round down
+    appendExrAttribute(header, "tiles", "tiledesc", value);
+
+    // Not standard, other readers skip them
+    value.clear();
+    appendU32LittleEndian(value, (u32)range.firstSample);
+    appendExrAttribute(header, "firstSample", "int", value);
+    value.clear();
+    appendU32LittleEndian(value, (u32)range.samples);
+    appendExrAttribute(header, "samples", "int", value);
+
+    header.push_back(0);
+    return header;
+}
+
+// EXR's ZIP compression deflates the tile after splitting even and odd bytes and delta coding them
+static void
+compressExrZip(std::vector<u8>& out, const std::vector<u8>& raw) {
+    size_t size = raw.size();
+    std::vector<u8> shuffled(size);
+    size_t half = (size + 1) / 2;
+    for (size_t i = 0; i < size; i++) {
+        shuffled[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+    }
+    for (size_t i = size - 1; i > 0; i--) {
+        shuffled[i] = (u8)(shuffled[i] - shuffled[i - 1] + 128);
+    }
+    zlibCompress(out, shuffled.data(), size, EXR_ZIP_LEVEL);
+}
+
+// rows starts at the first scanline of the tile's row of tiles
+static void
+encodeExrTile(std::vector<u8>& chunk, const Color* rows, i32 width, i32 height, i32 tileX, i32 tileY,
+              ExrCompression compression) {
+    i32 x0 = tileX * EXR_TILE_SIZE;
+    i32 y0 = tileY * EXR_TILE_SIZE;
+    i32 x1 = std::min(width, x0 + EXR_TILE_SIZE);
+    i32 y1 = std::min(height, y0 + EXR_TILE_SIZE);
+
+    // Each scanline of the tile holds the B, G and R runs one after another
+    std::vector<u8> raw;
+    raw.reserve((size_t)(x1 - x0) * (y1 - y0) * sizeof(Color));
+    for (i32 y = y0; y < y1; y++) {
+        const Color* row = rows + (size_t)(y - y0) * width;
+        for (i32 channel = 2; channel >= 0; channel--) {
+            for (i32 x = x0; x < x1; x++) {
+                appendF32LittleEndian(raw, row[x].Elements[channel]);
+            }
+        }
+    }
+
+    std::vector<u8> compressed;
+    const std::vector<u8>* data = &raw;
+    if (compression == EXR_COMPRESSION_ZIP) {
+        compressExrZip(compressed, raw);
+        // Incompressible tiles are stored as is, readers tell them apart by size
+        if (compressed.size() < raw.size()) {
+            data = &compressed;
+        }
+    }
+
+    chunk.clear();
+    appendU32LittleEndian(chunk, (u32)tileX);
+    appendU32LittleEndian(chunk, (u32)tileY);
+    appendU32LittleEndian(chunk, 0);
+    appendU32LittleEndian(chunk, 0);
+    appendU32LittleEndian(chunk, (u32)data->size());
+    chunk.insert(chunk.end(), data->begin(), data->end());
+}
+
+static bool
+seekFile(FILE* file, u64 offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// Takes the image a row of tiles at a time, so it never has to be in memory all at once
+struct ExrWriter {
+    FILE* file;
+    i32 width, height;
+    i32 tilesX, tilesY;
+    ExrCompression compression;
+    u64 headerSize;
+    u64 position;
+    std::vector<u64> offsets;
+    std::vector<std::vector<u8>> chunks;
+    bool ok;
+};
+
+static bool
+beginExr(ExrWriter& writer, const char* path, i32 width, i32 height, ExrCompression compression,
+         SampleRange range) {
+    writer.file = fopen(path, "wb");
+    if (!writer.file) {
+        return false;
+    }
+    writer.width = width;
+    writer.height = height;
+    writer.tilesX = (width + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+    writer.tilesY = (height + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+    writer.compression = compression;
+
+    std::vector<u8> header = makeExrHeader(width, height, compression, range);
+    writer.offsets.assign(writer.tilesX * writer.tilesY, 0);
+    writer.ok = fwrite(header.data(), 1, header.size(), writer.file) == header.size();
+    writer.ok = writer.ok && fwrite(writer.offsets.data(), sizeof(u64), writer.offsets.size(), writer.file) ==
+                                 writer.offsets.size();
+    writer.headerSize = header.size();
+    writer.position = header.size() + sizeof(u64) * writer.offsets.size();
+    writer.chunks.resize(writer.tilesX);
+    return true;
+}
+
+// rows holds the EXR_TILE_SIZE scanlines of tile row tileY, fewer at the bottom. Rows have to come in order.
+static void
+writeExrTileRow(ExrWriter& writer, const Color* rows, i32 tileY) {
+    parallelFor(writer.tilesX, [&](int tileX) {
+        encodeExrTile(writer.chunks[tileX], rows, writer.width, writer.height, tileX, tileY, writer.compression);
+    });
+    for (i32 tileX = 0; tileX < writer.tilesX && writer.ok; tileX++) {
+        const std::vector<u8>& chunk = writer.chunks[tileX];
+        writer.offsets[tileY * writer.tilesX + tileX] = writer.position;
+        writer.ok = fwrite(chunk.data(), 1, chunk.size(), writer.file) == chunk.size();
+        writer.position += chunk.size();
+    }
+}
+
+static bool
+endExr(ExrWriter& writer) {
+    // Offsets are only known after compressing, so the table is filled in at the end
+    bool ok = writer.ok && seekFile(writer.file, writer.headerSize);
+    for (size_t i = 0; i < writer.offsets.size() && ok; i++) {
+        std::vector<u8> offset;
+        appendU32LittleEndian(offset, (u32)writer.offsets[i]);
+        appendU32LittleEndian(offset, (u32)(writer.offsets[i] >> 32));
+        ok = fwrite(offset.data(), 1, offset.size(), writer.file) == offset.size();
+    }
+    return fclose(writer.file) == 0 && ok;
+}
+
+static bool
+writeExr(const char* path, const Framebuffer& framebuffer, ExrCompression compression, SampleRange range) {
+    ExrWriter writer;
+    if (!beginExr(writer, path, framebuffer.width, framebuffer.height, compression, range)) {
+        return false;
+    }
+    for (i32 tileY = 0; tileY < writer.tilesY && writer.ok; tileY++) {
+        writeExrTileRow(writer, framebuffer.color + (size_t)tileY * EXR_TILE_SIZE * framebuffer.width, tileY);
+    }
+    return endExr(writer);
+}
+
+// Reads back EXRs as written above: tiled, one level of EXR_TILE_SIZE tiles, float B, G and R channels,
+// stored or ZIP compressed
+struct ExrReader {
+    FILE* file;
+    i32 width, height;
+    i32 tilesX, tilesY;
+    ExrCompression compression;
+    SampleRange range; // 0 samples when the file doesn't say
+    std::vector<u64> offsets;
+    std::vector<u8> chunk;
+    std::vector<u8> raw;
+};
+
+static u32
+readU32LittleEndian(const u8* data) {
+    return (u32)data[0] | ((u32)data[1] << 8) | ((u32)data[2] << 16) | ((u32)data[3] << 24);
+}
+
+static bool
+readExrString(FILE* file, std::string& out) {
+    out.clear();
+    for (int c = fgetc(file); c != 0; c = fgetc(file)) {
+        if (c == EOF || out.size() > 255) {
+            return false;
+        }
+        out.push_back((char)c);
+    }
+    return true;
+}
+
+static bool
+parseExrHeader(ExrReader& reader) {
+    u8 start[8];
+    if (fread(start, 1, 8, reader.file) != 8 || readU32LittleEndian(start) != 20000630) {
+        return false;
+    }
+    // Version 2, single part tiled, no deep data
+    u32 version = readU32LittleEndian(start + 4);
+    if ((version & 0xFF) != 2 || !(version & 0x200) || (version & 0x1800)) {
+        return false;
+    }
+    bool channelsOk = false, tilesOk = false, windowOk = false, compressionOk = false;
+    std::string name, type;
+    std::vector<u8> value;
+    while (readExrString(reader.file, name) && !name.empty()) {
+        u8 sizeBytes[4];
+        if (!readExrString(reader.file, type) || fread(sizeBytes, 1, 4, reader.file) != 4) {
+            return false;
+        }
+        value.resize(readU32LittleEndian(sizeBytes));
+        if (value.size() > 1 << 16 || fread(value.data(), 1, value.size(), reader.file) != value.size()) {
+            return false;
+        }
+        if (name == "channels") {
+            // B, G and R in that order, 32-bit float, no subsampling
+            const u8 expected[] = {'B', 0, 2, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0,
+                                   'G', 0, 2, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0,
+                                   'R', 0, 2, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0};
+            channelsOk = value.size() == sizeof(expected) && !memcmp(value.data(), expected, sizeof(expected));
+        } else if (name == "compression" && value.size() == 1) {
+            reader.compression = (ExrCompression)value[0];
+            compressionOk = value[0] == EXR_COMPRESSION_NONE || value[0] == EXR_COMPRESSION_ZIP;
+        } else if (name == "dataWindow" && value.size() == 16) {
+            i32 box[4];
+            for (i32 i = 0; i < 4; i++) {
+                box[i] = (i32)readU32LittleEndian(value.data() + 4 * i);
+            }
+            reader.width = box[2] + 1;
+            reader.height = box[3] + 1;
+            windowOk = box[0] == 0 && box[1] == 0 && reader.width > 0 && reader.height > 0;
+        } else if (name == "tiles" && value.size() == 9) {
+            tilesOk = readU32LittleEndian(value.data()) == EXR_TILE_SIZE &&
+                      readU32LittleEndian(value.data() + 4) == EXR_TILE_SIZE && value[8] == 0;
+        } else if (name == "firstSample" && value.size() == 4) {
+            reader.range.firstSample = (i32)readU32LittleEndian(value.data());
+        } else if (name == "samples" && value.size() == 4) {
+            reader.range.samples = (i32)readU32LittleEndian(value.data());
+        }
+    }
+    return channelsOk && tilesOk && windowOk && compressionOk;
+}
+
+static bool
+openExr(const char* path, ExrReader& reader) {
+    reader.file = fopen(path, "rb");
+    if (!reader.file) {
+        return false;
+    }
+    reader.range = {0, 0};
+    if (!parseExrHeader(reader)) {
+        fclose(reader.file);
+        return false;
+    }
+    reader.tilesX = (reader.width + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+    reader.tilesY = (reader.height + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+    std::vector<u8> table((size_t)reader.tilesX * reader.tilesY * sizeof(u64));
+    if (fread(table.data(), 1, table.size(), reader.file) != table.size()) {
+        fclose(reader.file);
+        return false;
+    }
+    reader.offsets.resize(reader.tilesX * reader.tilesY);
+    for (size_t i = 0; i < reader.offsets.size(); i++) {
+        reader.offsets[i] =
+            readU32LittleEndian(table.data() + 8 * i) | (u64)readU32LittleEndian(table.data() + 8 * i + 4) << 32;
+    }
+    return true;
+}
+
+// Undoes compressExrZip()
+static bool
+decompressExrZip(std::vector<u8>& raw, const u8* data, size_t size) {
+    std::vector<u8> shuffled(raw.size());
+    if (!zlibDecompress(data, size, shuffled.data(), shuffled.size())) {
+        return false;
+    }
+    for (size_t i = 1; i < shuffled.size(); i++) {
+        shuffled[i] = (u8)(shuffled[i - 1] + shuffled[i] - 128);
+    }
+    size_t half = (raw.size() + 1) / 2;
+    for (size_t i = 0; i < raw.size(); i++) {
+        raw[i] = shuffled[(i & 1) ? half + i / 2 : i / 2];
+    }
+    return true;
+}
+
+// Fills rows with the scanlines of tile row tileY, like writeExrTileRow() takes them
+static bool
+readExrTileRow(ExrReader& reader, i32 tileY, Color* rows) {
+    for (i32 tileX = 0; tileX < reader.tilesX; tileX++) {
+        i32 x0 = tileX * EXR_TILE_SIZE;
+        i32 y0 = tileY * EXR_TILE_SIZE;
+        i32 x1 = std::min(reader.width, x0 + EXR_TILE_SIZE);
+        i32 y1 = std::min(reader.height, y0 + EXR_TILE_SIZE);
+        u8 chunkHeader[20];
+        if (!seekFile(reader.file, reader.offsets[tileY * reader.tilesX + tileX]) ||
+            fread(chunkHeader, 1, sizeof(chunkHeader), reader.file) != sizeof(chunkHeader) ||
+            readU32LittleEndian(chunkHeader) != (u32)tileX || readU32LittleEndian(chunkHeader + 4) != (u32)tileY) {
+            return false;
+        }
+        reader.chunk.resize(readU32LittleEndian(chunkHeader + 16));
+        reader.raw.resize((size_t)(x1 - x0) * (y1 - y0) * sizeof(Color));
+        if (reader.chunk.size() > reader.raw.size() ||
+            fread(reader.chunk.data(), 1, reader.chunk.size(), reader.file) != reader.chunk.size()) {
+            return false;
+        }
+        if (reader.chunk.size() == reader.raw.size()) {
+            reader.raw.swap(reader.chunk);
+        } else if (reader.compression != EXR_COMPRESSION_ZIP ||
+                   !decompressExrZip(reader.raw, reader.chunk.data(), reader.chunk.size())) {
+            return false;
+        }
+
+        const u8* data = reader.raw.data();
+        for (i32 y = y0; y < y1; y++) {
+            Color* row = rows + (size_t)(y - y0) * reader.width;
+            for (i32 channel = 2; channel >= 0; channel--) {
+                for (i32 x = x0; x < x1; x++, data += 4) {
+                    u32 bits = readU32LittleEndian(data);
+                    memcpy(&row[x].Elements[channel], &bits, sizeof(bits));
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static void
+closeExr(ExrReader& reader) {
+    fclose(reader.file);
+}
+
+static bool
+hasExtension(const char* path, const char* extension) {
+    size_t pathLength = strlen(path);
+    size_t extensionLength = strlen(extension);
+    if (pathLength < extensionLength) {
+        return false;
+    }
+    const char* tail = path + pathLength - extensionLength;
+    for (size_t i = 0; i < extensionLength; i++) {
+        if (tolower(tail[i]) != extension[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Picks the format from the file extension
+static bool
+writeFloatImage(const char* path, const Framebuffer& framebuffer, ExrCompression compression, SampleRange range) {
+    if (hasExtension(path, ".pfm")) {
+        return writePfm(path, framebuffer);
+    } else if (hasExtension(path, ".hdr")) {
+        return writeRadianceHdr(path, framebuffer);
+    } else if (hasExtension(path, ".exr")) {
+        return writeExr(path, framebuffer, compression, range);
+    }
+    printf("Unknown float image format for %s, use .exr, .pfm or .hdr\n", path);
+    return false;
+}
@@ -1,6 +1,7 @@
 struct Ray {
     Vec3 o;
     Vec3 d;
+    f32 time;
 };
 
 static Vec3
@@ -8,54 +9,447 @@ pointOnRay(const Ray& ray, float t) {
     return ray.o + t * ray.d;
 }
 
-static bool
-hit(const World& world, const Ray& ray, f32 tMin, f32 tMax, HitInfo& info) {
-    HitInfo tempInfo;
-    bool hitSomething = false;
-    f64 closestSoFar = tMax;
-    Array<Sphere> spheres = world.spheres;
-    for (int i = 0; i < spheres.count; i++) {
-        Sphere* sphere = spheres.members + i;
-
-        bool hit = false;
-        tempInfo.material = sphere->material;
-
-        Vec3 oc = ray.o - sphere->center;
-
-        Vec3 rayD = ray.d;
-
-        f32 a = HMM_Dot(rayD, rayD);
-        f32 b = HMM_Dot(oc, rayD);
-        f32 c = HMM_Dot(oc, oc) - sphere->radius * sphere->radius;
-
-        f32 discriminant = b * b - a * c;
-        if (discriminant > 0) {
-            f32 discSqrt = sqrt(discriminant);
-
-            f32 temp = (-b - discSqrt) / a;
-            if (temp < closestSoFar && temp > tMin) {
-                tempInfo.t = temp;
-                tempInfo.point = pointOnRay(ray, tempInfo.t);
-                tempInfo.normal = (tempInfo.point - sphere->center) / sphere->radius;
-                hit = true;
-                goto end;
+// All traversal keeps track of, the rest of the hit is only worked out for the final one
+struct ClosestHit {
+    f32 t;
+    u32 primitive; // index into World::spheres
+};
+
+const u32 NO_PRIMITIVE = 0xffffffff;
+
+// Camera rays of neighbouring pixels are traced through the BVH together, see closestHitPacket()
+const i32 PACKET_SIZE = 8;
+// Subtrees fewer of a packet's rays than this enter are traced by those rays one at a time
+const i32 PACKET_MIN_LANES = 2;
+
+struct RayPacket {
+    Ray rays[PACKET_SIZE];
+    i32 count; // lanes in use, from the first
+};
+
+// The traversals are compiled once per CpuLevel from bodies marked with this, so everything they call has
+// to be inlined into them to be compiled for the same level
+#define TRAVERSAL_BODY __attribute__((always_inline)) inline
+
+// Nearest t of the sphere inside (tMin, tMax)
+TRAVERSAL_BODY static bool
+intersectSphere(const Sphere& sphere, const Ray& ray, f32 tMin, f32 tMax, f32& t) {
+    Vec3 oc = ray.o - sphereCenter(sphere, ray.time);
+    f32 a = HMM_Dot(ray.d, ray.d);
+    f32 b = HMM_Dot(oc, ray.d);
+    f32 c = HMM_Dot(oc, oc) - sphere.radius * sphere.radius;
+    f32 discriminant = b * b - a * c;
+    if (discriminant > 0) {
+        f32 discSqrt = sqrtf(discriminant);
+        t = (-b - discSqrt) / a;
+        if (!(t < tMax && t > tMin)) {
+            t = (-b + discSqrt) / a;
+        }
+        return t < tMax && t > tMin;
+    }
+    return false;
+}
+
+// Works out what the shading needs for the closest hit, once, after traversal found it
+static void
+surfaceInteraction(const World& world, const Ray& ray, const ClosestHit& closest, HitInfo& info) {
+    const Sphere& sphere = world.spheres.members[closest.primitive];
+    info.t = closest.t;
+    info.point = pointOnRay(ray, closest.t);
+    info.normal = (info.point - sphereCenter(sphere, ray.time)) * (1.0f / sphere.radius);
+    info.material = sphere.material;
+}
+
+// Node bounds are interpolated to the ray time, so moving spheres only cost what they cover at that moment
+TRAVERSAL_BODY static bool
+hitNodeBounds(const BvhNode& node, f32 shutterT, const Ray& ray, const Vec3& invDir, f32 tMin, f32 tMax) {
+    Vec3 boxMin = lerpVec3(node.bounds[0].min, shutterT, node.bounds[1].min);
+    Vec3 boxMax = lerpVec3(node.bounds[0].max, shutterT, node.bounds[1].max);
+    for (i32 axis = 0; axis < 3; axis++) {
+        f32 t0 = (boxMin.Elements[axis] - ray.o.Elements[axis]) * invDir.Elements[axis];
+        f32 t1 = (boxMax.Elements[axis] - ray.o.Elements[axis]) * invDir.Elements[axis];
+        if (invDir.Elements[axis] < 0) {
+            std::swap(t0, t1);
+        }
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        if (tMax < tMin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lowers closest to the nearest hit in the subtree under root, adding what it visited to the counts
+TRAVERSAL_BODY static void
+closestHitSubtree(const World& world, const Ray& ray, u32 root, f32 tMin, ClosestHit& closest, u32& nodesVisited,
+                  u32& primitivesTested) {
+    const BvhNode* nodes = world.bvh.nodes.members;
+    const Sphere* spheres = world.spheres.members;
+
+    f32 shutterT = 0;
+    if (SHUTTER_CLOSE > SHUTTER_OPEN) {
+        shutterT = (ray.time - SHUTTER_OPEN) / (SHUTTER_CLOSE - SHUTTER_OPEN);
+    }
+    Vec3 invDir = vec3(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+    f32 closestSoFar = closest.t;
+    u32 primitive = closest.primitive;
+    u32 stack[BVH_MAX_DEPTH]; // trees are built and checked to be no deeper
+    i32 stackSize = 0;
+    u32 nodeIndex = root;
+    for (;;) {
+        const BvhNode& node = nodes[nodeIndex];
+        nodesVisited++;
+        if (hitNodeBounds(node, shutterT, ray, invDir, tMin, closestSoFar)) {
+            if (node.count > 0) {
+                primitivesTested += node.count;
+                for (u32 i = node.offset; i < node.offset + node.count; i++) {
+                    f32 t;
+                    if (intersectSphere(spheres[i], ray, tMin, closestSoFar, t)) {
+                        closestSoFar = t;
+                        primitive = i;
+                    }
+                }
+            } else {
+                // Visit the child on the near side of the split first
+                if (invDir.Elements[node.axis] < 0) {
+                    stack[stackSize++] = nodeIndex + 1;
+                    nodeIndex = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIndex = nodeIndex + 1;
+                }
+                continue;
             }
-            temp = (-b + discSqrt) / a;
-            if (temp < closestSoFar && temp > tMin) {
-                tempInfo.t = temp;
-                tempInfo.point = pointOnRay(ray, tempInfo.t);
-                tempInfo.normal = (tempInfo.point - sphere->center) / sphere->radius;
-                hit = true;
-                goto end;
+        }
+        if (stackSize == 0) {
+            break;
+        }
+        nodeIndex = stack[--stackSize];
+    }
+    closest = {closestSoFar, primitive};
+}
+
+TRAVERSAL_BODY static bool
+closestHitBvhBody(const World& world, const Ray& ray, f32 tMin, f32 tMax, ClosestHit& closest) {
+    closest = {tMax, NO_PRIMITIVE};
+    u32 nodesVisited = 0;
+    u32 primitivesTested = 0;
+    closestHitSubtree(world, ray, 0, tMin, closest, nodesVisited, primitivesTested);
+    countRay(nodesVisited, primitivesTested);
+    return closest.primitive != NO_PRIMITIVE;
+}
+
+static bool
+closestHitFlat(const World& world, const Ray& ray, f32 tMin, f32 tMax, ClosestHit& closest) {
+    f32 closestSoFar = tMax;
+    u32 primitive = NO_PRIMITIVE;
+    const Sphere* spheres = world.spheres.members;
+    u32 count = (u32)world.spheres.count;
+    for (u32 i = 0; i < count; i++) {
+        f32 t;
+        if (intersectSphere(spheres[i], ray, tMin, closestSoFar, t)) {
+            closestSoFar = t;
+            primitive = i;
+        }
+    }
+    countRay(0, count);
+    closest = {closestSoFar, primitive};
+    return primitive != NO_PRIMITIVE;
+}
+
+// Any hit will do, so traversal stops at the first one and nothing about the surface is worked out
+TRAVERSAL_BODY static bool
+occludedBvhBody(const World& world, const Ray& ray, f32 tMin, f32 tMax) {
+    const BvhNode* nodes = world.bvh.nodes.members;
+    const Sphere* spheres = world.spheres.members;
+
+    f32 shutterT = 0;
+    if (SHUTTER_CLOSE > SHUTTER_OPEN) {
+        shutterT = (ray.time - SHUTTER_OPEN) / (SHUTTER_CLOSE - SHUTTER_OPEN);
+    }
+    Vec3 invDir = vec3(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+    bool occluded = false;
+    u32 stack[BVH_MAX_DEPTH]; // trees are built and checked to be no deeper
+    i32 stackSize = 0;
+    u32 nodeIndex = 0;
+    u32 nodesVisited = 0;
+    u32 primitivesTested = 0;
+    for (;;) {
+        const BvhNode& node = nodes[nodeIndex];
+        nodesVisited++;
+        if (hitNodeBounds(node, shutterT, ray, invDir, tMin, tMax)) {
+            if (node.count > 0) {
+                for (u32 i = node.offset; i < node.offset + node.count && !occluded; i++) {
+                    f32 t;
+                    primitivesTested++;
+                    occluded = intersectSphere(spheres[i], ray, tMin, tMax, t);
+                }
+                if (occluded) {
+                    break;
+                }
+            } else {
+                stack[stackSize++] = node.offset;
+                nodeIndex = nodeIndex + 1;
+                continue;
             }
         }
+        if (stackSize == 0) {
+            break;
+        }
+        nodeIndex = stack[--stackSize];
+    }
+    countRay(nodesVisited, primitivesTested);
+    return occluded;
+}
+
+static bool
+occludedFlat(const World& world, const Ray& ray, f32 tMin, f32 tMax) {
+    for (size_t i = 0; i < world.spheres.count; i++) {
+        f32 t;
+        if (intersectSphere(world.spheres.members[i], ray, tMin, tMax, t)) {
+            countRay(0, i + 1);
+            return true;
+        }
+    }
+    countRay(0, world.spheres.count);
+    return false;
+}
+
+static bool
+closestHitBvh(const World& world, const Ray& ray, f32 tMin, f32 tMax, ClosestHit& closest) {
+    return closestHitBvhBody(world, ray, tMin, tMax, closest);
+}
+
+static bool
+occludedBvh(const World& world, const Ray& ray, f32 tMin, f32 tMax) {
+    return occludedBvhBody(world, ray, tMin, tMax);
+}
+
+#if CPU_X86
+CPU_TARGET_AVX2 static bool
+closestHitBvhAvx2(const World& world, const Ray& ray, f32 tMin, f32 tMax, ClosestHit& closest) {
+    return closestHitBvhBody(world, ray, tMin, tMax, closest);
+}
+
+CPU_TARGET_AVX2 static bool
+occludedBvhAvx2(const World& world, const Ray& ray, f32 tMin, f32 tMax) {
+    return occludedBvhBody(world, ray, tMin, tMax);
+}
+
+CPU_TARGET_AVX512 static bool
+closestHitBvhAvx512(const World& world, const Ray& ray, f32 tMin, f32 tMax, ClosestHit& closest) {
+    return closestHitBvhBody(world, ray, tMin, tMax, closest);
+}
+
+CPU_TARGET_AVX512 static bool
+occludedBvhAvx512(const World& world, const Ray& ray, f32 tMin, f32 tMax) {
+    return occludedBvhBody(world, ray, tMin, tMax);
+}
+
+// A packet's rays, one per lane
+struct PacketLanes {
+    __m256 o[3];
+    __m256 d[3];
+    __m256 invDir[3];
+    __m256 time;
+    __m256 shutterT;
+};
+
+// hitNodeBounds() for all lanes, with the same operations so the lanes agree with single rays
+CPU_TARGET_AVX2 TRAVERSAL_BODY static __m256
+hitNodeBoundsPacket(const BvhNode& node, const PacketLanes& lanes, __m256 tMin, __m256 tMax) {
+    for (i32 axis = 0; axis < 3; axis++) {
+        f32 min0 = node.bounds[0].min.Elements[axis];
+        f32 max0 = node.bounds[0].max.Elements[axis];
+        __m256 boxMin = _mm256_add_ps(_mm256_set1_ps(min0),
+                                      _mm256_mul_ps(_mm256_set1_ps(node.bounds[1].min.Elements[axis] - min0), lanes.shutterT));
+        __m256 boxMax = _mm256_add_ps(_mm256_set1_ps(max0),
+                                      _mm256_mul_ps(_mm256_set1_ps(node.bounds[1].max.Elements[axis] - max0), lanes.shutterT));
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(boxMin, lanes.o[axis]), lanes.invDir[axis]);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(boxMax, lanes.o[axis]), lanes.invDir[axis]);
+        __m256 negative = _mm256_cmp_ps(lanes.invDir[axis], _mm256_setzero_ps(), _CMP_LT_OQ);
+        // max and min pick their second operand for NaN, which keeps tMin and tMax like the comparisons do
+        tMin = _mm256_max_ps(_mm256_blendv_ps(t0, t1, negative), tMin);
+        tMax = _mm256_min_ps(_mm256_blendv_ps(t1, t0, negative), tMax);
+    }
+    return _mm256_cmp_ps(tMax, tMin, _CMP_NLT_UQ);
+}
+
+// intersectSphere() for all lanes
+CPU_TARGET_AVX2 TRAVERSAL_BODY static __m256
+intersectSpherePacket(const Sphere& sphere, const PacketLanes& lanes, __m256 tMin, __m256 tMax, __m256& t) {
+    __m256 oc[3];
+    for (i32 k = 0; k < 3; k++) {
+        f32 c0 = sphere.center0.Elements[k];
+        __m256 center =
+            _mm256_add_ps(_mm256_set1_ps(c0), _mm256_mul_ps(_mm256_set1_ps(sphere.center1.Elements[k] - c0), lanes.time));
+        oc[k] = _mm256_sub_ps(lanes.o[k], center);
+    }
+    __m256 a = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(lanes.d[0], lanes.d[0]), _mm256_mul_ps(lanes.d[1], lanes.d[1])),
+        _mm256_mul_ps(lanes.d[2], lanes.d[2]));
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(oc[0], lanes.d[0]), _mm256_mul_ps(oc[1], lanes.d[1])),
+                             _mm256_mul_ps(oc[2], lanes.d[2]));
+    __m256 c = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(oc[0], oc[0]), _mm256_mul_ps(oc[1], oc[1])),
+                      _mm256_mul_ps(oc[2], oc[2])),
+        _mm256_set1_ps(sphere.radius * sphere.radius));
+    __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+    __m256 positive = _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 discSqrt = _mm256_sqrt_ps(discriminant);
+    __m256 minusB = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+    __m256 tNear = _mm256_div_ps(_mm256_sub_ps(minusB, discSqrt), a);
+    __m256 tFar = _mm256_div_ps(_mm256_add_ps(minusB, discSqrt), a);
+    __m256 nearInRange =
+        _mm256_and_ps(_mm256_cmp_ps(tNear, tMax, _CMP_LT_OQ), _mm256_cmp_ps(tNear, tMin, _CMP_GT_OQ));
+    t = _mm256_blendv_ps(tFar, tNear, nearInRange);
+    __m256 inRange = _mm256_and_ps(_mm256_cmp_ps(t, tMax, _CMP_LT_OQ), _mm256_cmp_ps(t, tMin, _CMP_GT_OQ));
+    return _mm256_and_ps(positive, inRange);
+}
+
+// The packet goes down the BVH with one stack, each node's bounds tested for all rays at once and visited
+// when any of them hits it. Where only a few rays are left, they go on one at a time.
+CPU_TARGET_AVX2 TRAVERSAL_BODY static void
+closestHitPacketBody(const World& world, const RayPacket& packet, f32 tMin, f32 tMax, ClosestHit* hits) {
+    const BvhNode* nodes = world.bvh.nodes.members;
+    const Sphere* spheres = world.spheres.members;
+
+    // Unused lanes repeat the first ray and are masked out
+    alignas(32) f32 values[7][PACKET_SIZE];
+    for (i32 k = 0; k < PACKET_SIZE; k++) {
+        const Ray& ray = packet.rays[k < packet.count ? k : 0];
+        for (i32 axis = 0; axis < 3; axis++) {
+            values[axis][k] = ray.o.Elements[axis];
+            values[3 + axis][k] = ray.d.Elements[axis];
+        }
+        values[6][k] = ray.time;
+    }
+    PacketLanes lanes;
+    for (i32 axis = 0; axis < 3; axis++) {
+        lanes.o[axis] = _mm256_load_ps(values[axis]);
+        lanes.d[axis] = _mm256_load_ps(values[3 + axis]);
+        lanes.invDir[axis] = _mm256_div_ps(_mm256_set1_ps(1.0f), lanes.d[axis]);
+    }
+    lanes.time = _mm256_load_ps(values[6]);
+    lanes.shutterT = _mm256_setzero_ps();
+    if (SHUTTER_CLOSE > SHUTTER_OPEN) {
+        lanes.shutterT = _mm256_div_ps(_mm256_sub_ps(lanes.time, _mm256_set1_ps(SHUTTER_OPEN)),
+                                       _mm256_set1_ps(SHUTTER_CLOSE - SHUTTER_OPEN));
+    }
+    __m256 active = _mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(packet.count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
 
-    end:
-        if (hit) {
-            hitSomething = true;
-            closestSoFar = tempInfo.t;
-            info = tempInfo;
+    const __m256 tMinLanes = _mm256_set1_ps(tMin);
+    __m256 closest = _mm256_set1_ps(tMax);
+    __m256i primitive = _mm256_set1_epi32((i32)NO_PRIMITIVE);
+    u32 stack[BVH_MAX_DEPTH]; // trees are built and checked to be no deeper
+    i32 stackSize = 0;
+    u32 nodeIndex = 0;
+    u32 packetNodesVisited = 0;
+    u32 packetPrimitivesTested = 0;
+    u32 nodesVisited = 0; // by rays on their own
+    u32 primitivesTested = 0;
+    for (;;) {
+        const BvhNode& node = nodes[nodeIndex];
+        packetNodesVisited++;
+        __m256 entering = _mm256_and_ps(hitNodeBoundsPacket(node, lanes, tMinLanes, closest), active);
+        i32 enteringLanes = _mm256_movemask_ps(entering);
+        if (enteringLanes && __builtin_popcount(enteringLanes) < PACKET_MIN_LANES) {
+            alignas(32) f32 closestT[PACKET_SIZE];
+            alignas(32) u32 closestPrimitive[PACKET_SIZE];
+            _mm256_store_ps(closestT, closest);
+            _mm256_store_si256((__m256i*)closestPrimitive, primitive);
+            for (i32 k = 0; k < PACKET_SIZE; k++) {
+                if (enteringLanes & (1 << k)) {
+                    ClosestHit hit = {closestT[k], closestPrimitive[k]};
+                    closestHitSubtree(world, packet.rays[k], nodeIndex, tMin, hit, nodesVisited, primitivesTested);
+                    closestT[k] = hit.t;
+                    closestPrimitive[k] = hit.primitive;
+                }
+            }
+            closest = _mm256_load_ps(closestT);
+            primitive = _mm256_load_si256((const __m256i*)closestPrimitive);
+        } else if (enteringLanes) {
+            if (node.count > 0) {
+                packetPrimitivesTested += node.count;
+                for (u32 i = node.offset; i < node.offset + node.count; i++) {
+                    __m256 t;
+                    __m256 hit = _mm256_and_ps(intersectSpherePacket(spheres[i], lanes, tMinLanes, closest, t), entering);
+                    closest = _mm256_blendv_ps(closest, t, hit);
+                    primitive = _mm256_castps_si256(_mm256_blendv_ps(
+                        _mm256_castsi256_ps(primitive), _mm256_castsi256_ps(_mm256_set1_epi32((i32)i)), hit));
+                }
+            } else {
+                // Near side first, as the first ray entering sees it
+                alignas(32) f32 invDir[PACKET_SIZE];
+                _mm256_store_ps(invDir, lanes.invDir[node.axis]);
+                if (invDir[__builtin_ctz(enteringLanes)] < 0) {
+                    stack[stackSize++] = nodeIndex + 1;
+                    nodeIndex = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIndex = nodeIndex + 1;
+                }
+                continue;
+            }
         }
+        if (stackSize == 0) {
+            break;
+        }
+        nodeIndex = stack[--stackSize];
+    }
+    countRays(packet.count, packetNodesVisited * packet.count + nodesVisited,
+              packetPrimitivesTested * packet.count + primitivesTested);
+
+    alignas(32) f32 closestT[PACKET_SIZE];
+    alignas(32) u32 closestPrimitive[PACKET_SIZE];
+    _mm256_store_ps(closestT, closest);
+    _mm256_store_si256((__m256i*)closestPrimitive, primitive);
+    for (i32 k = 0; k < packet.count; k++) {
+        hits[k] = {closestT[k], closestPrimitive[k]};
+    }
+}
+
+CPU_TARGET_AVX2 static void
+closestHitPacketAvx2(const World& world, const RayPacket& packet, f32 tMin, f32 tMax, ClosestHit* hits) {
+    closestHitPacketBody(world, packet, tMin, tMax, hits);
+}
+
+// Still 8 lanes, AVX-512 only brings its encoding and registers
+CPU_TARGET_AVX512 static void
+closestHitPacketAvx512(const World& world, const RayPacket& packet, f32 tMin, f32 tMax, ClosestHit* hits) {
+    closestHitPacketBody(world, packet, tMin, tMax, hits);
+}
+#endif
+
+// Whether anything is between tMin and tMax along the ray, for shadow rays
+static bool
+occluded(const World& world, const Ray& ray, f32 tMin, f32 tMax) {
+    if (world.bvh.nodes.count > 0) {
+        return gKernels.occludedBvh(world, ray, tMin, tMax);
+    }
+    return occludedFlat(world, ray, tMin, tMax);
+}
+
+static bool
+closestHit(const World& world, const Ray& ray, f32 tMin, f32 tMax, ClosestHit& closest) {
+    if (world.bvh.nodes.count > 0) {
+        return gKernels.closestHitBvh(world, ray, tMin, tMax, closest);
     }
-    return hitSomething;
-}
\ No newline at end of file
+    return closestHitFlat(world, ray, tMin, tMax, closest);
+}
+
+// Whether closestHitPacket() can be used, rays are traced one at a time otherwise
+static bool
+canTracePackets(const World& world) {
+    return gKernels.closestHitPacket && world.bvh.nodes.count > 0;
+}
+
+// closestHit() for every ray of the packet, misses get NO_PRIMITIVE. Same results as one ray at a time.
+static void
+closestHitPacket(const World& world, const RayPacket& packet, f32 tMin, f32 tMax, ClosestHit* hits) {
+    gKernels.closestHitPacket(world, packet, tMin, tMax, hits);
+}
@@ -0,0 +1,129 @@
+// 2MB pages for the big arrays, the spheres, the BVH and the framebuffer, so rays jumping around in them miss
+// the TLB less. --huge-pages explicit takes them from the pool set up with vm.nr_hugepages, transparent asks
+// the kernel to use them where it can. What can't get explicit ones tries transparent ones and then normal
+// pages, and allocations smaller than a huge page always get normal pages.
+
+#ifdef __linux__
+#include <sys/mman.h>
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+enum HugePageMode {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT,
+    HUGE_PAGE_MODE_COUNT,
+};
+
+static const char* HUGE_PAGE_MODE_NAMES[HUGE_PAGE_MODE_COUNT] = {"off", "transparent", "explicit"};
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Set from the options before anything big is allocated
+static HugePageMode gHugePageMode;
+// Bytes that got each kind of page, off is what wanted huge pages and didn't get any
+static std::atomic<u64> gHugePageBytes[HUGE_PAGE_MODE_COUNT];
+
+static size_t
+hugePageRoundUp(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// Zeroed anonymous memory, on huge pages when gHugePageMode asks for them. Null when there's no memory.
+// Give unmapPages() the same size.
+static void*
+mapPages(size_t size) {
+#ifdef __linux__
+    if (gHugePageMode == HUGE_PAGES_OFF || size < HUGE_PAGE_SIZE) {
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return data == MAP_FAILED ? nullptr : data;
+    }
+    size_t rounded = hugePageRoundUp(size);
+    if (gHugePageMode == HUGE_PAGES_EXPLICIT) {
+        void* data = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (data != MAP_FAILED) {
+            gHugePageBytes[HUGE_PAGES_EXPLICIT] += rounded;
+            return data;
+        }
+    }
+    // One huge page more than needed, so the start can be moved to a huge page boundary and all of it can be
+    // backed by them
+    u8* mapped = (u8*)mmap(nullptr, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+    if (mapped == MAP_FAILED) {
+        return nullptr;
+    }
+    u8* data = (u8*)hugePageRoundUp((uintptr_t)mapped);
+    if (data > mapped) {
+        munmap(mapped, data - mapped);
+    }
+    munmap(data + rounded, mapped + HUGE_PAGE_SIZE - data);
+    HugePageMode got = madvise(data, rounded, MADV_HUGEPAGE) == 0 ? HUGE_PAGES_TRANSPARENT : HUGE_PAGES_OFF;
+    gHugePageBytes[got] += rounded;
+    return data;
+#else
+    return calloc(size, 1);
+#endif
+}
+
+static void
+unmapPages(void* data, size_t size) {
+#ifdef __linux__
+    munmap(data, gHugePageMode == HUGE_PAGES_OFF || size < HUGE_PAGE_SIZE ? size : hugePageRoundUp(size));
+#else
+    (void)size;
+    free(data);
+#endif
+}
+
+// Zeroed memory for arrays that live for the rest of the run, on huge pages when they're on
+static void*
+allocateLarge(size_t size) {
+    if (gHugePageMode == HUGE_PAGES_OFF) {
+        return calloc(size, 1);
+    }
+    return mapPages(size);
+}
+
+template <typename T>
+static T*
+allocateLargeArray(size_t count) {
+    return (T*)allocateLarge(std::max<size_t>(count, 1) * sizeof(T));
+}
+
+// What the kernel really backs with transparent huge pages, madvise() is only a request. -1 if unknown.
+static i64
+transparentHugePageBytes() {
+    i64 bytes = -1;
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file) {
+        return -1;
+    }
+    char line[256];
+    long long kilobytes;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "AnonHugePages: %lld kB", &kilobytes) == 1) {
+            bytes = kilobytes * 1024;
+            break;
+        }
+    }
+    fclose(file);
+#endif
+    return bytes;
+}
+
+static void
+printHugePageUsage() {
+    const f64 mb = 1024.0 * 1024.0;
+    printf("Huge pages (%s): %.0f MB explicit, %.0f MB transparent", HUGE_PAGE_MODE_NAMES[gHugePageMode],
+           gHugePageBytes[HUGE_PAGES_EXPLICIT] / mb, gHugePageBytes[HUGE_PAGES_TRANSPARENT] / mb);
+    i64 backed = transparentHugePageBytes();
+    if (backed >= 0) {
+        printf(" (%.0f MB backed)", backed / mb);
+    }
+    printf(", %.0f MB fell back to normal pages\n", gHugePageBytes[HUGE_PAGES_OFF] / mb);
+}
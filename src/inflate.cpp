@@ -0,0 +1,239 @@
+// Deflate decoder for reading compressed EXR tiles back in: stored, fixed and dynamic Huffman blocks, so it
+// takes what any zlib writer produces and not only deflate.cpp. Decodes whole buffers of known output size.
+// Huffman codes are decoded a bit at a time, canonical code by canonical code like zlib's puff.
+
+const i32 INFLATE_MAX_BITS = 15;
+
+struct InflateStream {
+    const u8* data;
+    size_t size;
+    size_t position;
+    u64 bitBuffer;
+    u32 bitCount;
+    bool overrun; // read past the end, everything decoded since is garbage
+};
+
+struct InflateHuffman {
+    u16 counts[INFLATE_MAX_BITS + 1]; // codes of each length
+    u16 symbols[288];                 // ordered by code
+};
+
+static u32
+getBits(InflateStream& stream, u32 count) {
+    while (stream.bitCount < count) {
+        u64 byte = 0;
+        if (stream.position < stream.size) {
+            byte = stream.data[stream.position++];
+        } else {
+            stream.overrun = true;
+        }
+        stream.bitBuffer |= byte << stream.bitCount;
+        stream.bitCount += 8;
+    }
+    u32 value = (u32)(stream.bitBuffer & ((1ull << count) - 1));
+    stream.bitBuffer >>= count;
+    stream.bitCount -= count;
+    return value;
+}
+
+// False when the lengths describe more codes than fit
+static bool
+buildInflateHuffman(InflateHuffman& huffman, const u8* lengths, i32 symbolCount) {
+    memset(huffman.counts, 0, sizeof(huffman.counts));
+    for (i32 i = 0; i < symbolCount; i++) {
+        huffman.counts[lengths[i]]++;
+    }
+    huffman.counts[0] = 0;
+    i32 left = 1;
+    for (i32 length = 1; length <= INFLATE_MAX_BITS; length++) {
+        left = left * 2 - huffman.counts[length];
+        if (left < 0) {
+            return false;
+        }
+    }
+    u16 offsets[INFLATE_MAX_BITS + 1];
+    offsets[1] = 0;
+    for (i32 length = 1; length < INFLATE_MAX_BITS; length++) {
+        offsets[length + 1] = offsets[length] + huffman.counts[length];
+    }
+    for (i32 i = 0; i < symbolCount; i++) {
+        if (lengths[i] != 0) {
+            huffman.symbols[offsets[lengths[i]]++] = (u16)i;
+        }
+    }
+    return true;
+}
+
+// -1 for a code that isn't in the table
+static i32
+getSymbol(InflateStream& stream, const InflateHuffman& huffman) {
+    i32 code = 0;
+    i32 first = 0;
+    i32 index = 0;
+    for (i32 length = 1; length <= INFLATE_MAX_BITS; length++) {
+        code |= (i32)getBits(stream, 1);
+        i32 count = huffman.counts[length];
+        if (code - first < count) {
+            return huffman.symbols[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static bool
+inflateCodes(InflateStream& stream, const InflateHuffman& literals, const InflateHuffman& distances, u8* out,
+             size_t outSize, size_t& written) {
+    for (;;) {
+        i32 symbol = getSymbol(stream, literals);
+        if (symbol < 0 || stream.overrun) {
+            return false;
+        }
+        if (symbol < 256) {
+            if (written == outSize) {
+                return false;
+            }
+            out[written++] = (u8)symbol;
+        } else if (symbol == 256) {
+            return true;
+        } else {
+            symbol -= 257;
+            if (symbol >= 29) {
+                return false;
+            }
+            size_t length = DEFLATE_LENGTH_BASE[symbol] + getBits(stream, DEFLATE_LENGTH_EXTRA[symbol]);
+            i32 distanceCode = getSymbol(stream, distances);
+            if (distanceCode < 0 || distanceCode >= 30) {
+                return false;
+            }
+            size_t distance =
+                DEFLATE_DISTANCE_BASE[distanceCode] + getBits(stream, DEFLATE_DISTANCE_EXTRA[distanceCode]);
+            if (distance > written || length > outSize - written) {
+                return false;
+            }
+            // Byte by byte, matches can overlap what they produce
+            for (size_t i = 0; i < length; i++, written++) {
+                out[written] = out[written - distance];
+            }
+        }
+    }
+}
+
+static bool
+inflateStored(InflateStream& stream, u8* out, size_t outSize, size_t& written) {
+    getBits(stream, stream.bitCount % 8);
+    u32 length = getBits(stream, 16);
+    u32 complement = getBits(stream, 16);
+    if ((length ^ 0xFFFF) != complement || length > outSize - written) {
+        return false;
+    }
+    for (u32 i = 0; i < length; i++) {
+        out[written++] = (u8)getBits(stream, 8);
+    }
+    return !stream.overrun;
+}
+
+static bool
+inflateDynamic(InflateStream& stream, u8* out, size_t outSize, size_t& written) {
+    static const u8 ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    i32 literalCount = getBits(stream, 5) + 257;
+    i32 distanceCount = getBits(stream, 5) + 1;
+    i32 lengthCount = getBits(stream, 4) + 4;
+    if (literalCount > 286 || distanceCount > 30) {
+        return false;
+    }
+
+    u8 lengths[286 + 30] = {};
+    for (i32 i = 0; i < lengthCount; i++) {
+        lengths[ORDER[i]] = (u8)getBits(stream, 3);
+    }
+    InflateHuffman lengthCodes;
+    if (!buildInflateHuffman(lengthCodes, lengths, 19)) {
+        return false;
+    }
+
+    i32 count = 0;
+    while (count < literalCount + distanceCount) {
+        i32 symbol = getSymbol(stream, lengthCodes);
+        if (symbol < 0 || stream.overrun) {
+            return false;
+        }
+        if (symbol < 16) {
+            lengths[count++] = (u8)symbol;
+            continue;
+        }
+        u8 value = 0;
+        i32 repeat;
+        if (symbol == 16) {
+            if (count == 0) {
+                return false;
+            }
+            value = lengths[count - 1];
+            repeat = 3 + getBits(stream, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + getBits(stream, 3);
+        } else {
+            repeat = 11 + getBits(stream, 7);
+        }
+        if (count + repeat > literalCount + distanceCount) {
+            return false;
+        }
+        while (repeat-- > 0) {
+            lengths[count++] = value;
+        }
+    }
+    if (lengths[256] == 0) {
+        return false;
+    }
+
+    InflateHuffman literals, distances;
+    return buildInflateHuffman(literals, lengths, literalCount) &&
+           buildInflateHuffman(distances, lengths + literalCount, distanceCount) &&
+           inflateCodes(stream, literals, distances, out, outSize, written);
+}
+
+static bool
+inflateFixed(InflateStream& stream, u8* out, size_t outSize, size_t& written) {
+    static const std::pair<InflateHuffman, InflateHuffman> tables = []() {
+        u8 lengths[288];
+        for (i32 i = 0; i < 288; i++) {
+            lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        }
+        std::pair<InflateHuffman, InflateHuffman> result;
+        buildInflateHuffman(result.first, lengths, 288);
+        memset(lengths, 5, 30);
+        buildInflateHuffman(result.second, lengths, 30);
+        return result;
+    }();
+    return inflateCodes(stream, tables.first, tables.second, out, outSize, written);
+}
+
+// Decodes a complete zlib stream, which has to come out at exactly outSize bytes with a matching checksum
+static bool
+zlibDecompress(const u8* data, size_t size, u8* out, size_t outSize) {
+    if (size < 6 || (data[0] & 0x0F) != 8 || ((data[0] << 8) | data[1]) % 31 != 0 || (data[1] & 0x20)) {
+        return false;
+    }
+    InflateStream stream = {data + 2, size - 6, 0, 0, 0, false};
+    size_t written = 0;
+    bool final = false;
+    while (!final) {
+        final = getBits(stream, 1) != 0;
+        u32 type = getBits(stream, 2);
+        bool ok = false;
+        switch (type) {
+        case 0: ok = inflateStored(stream, out, outSize, written); break;
+        case 1: ok = inflateFixed(stream, out, outSize, written); break;
+        case 2: ok = inflateDynamic(stream, out, outSize, written); break;
+        default: break;
+        }
+        if (!ok || stream.overrun) {
+            return false;
+        }
+    }
+    const u8* checksum = data + size - 4;
+    u32 adler = ((u32)checksum[0] << 24) | ((u32)checksum[1] << 16) | ((u32)checksum[2] << 8) | checksum[3];
+    return written == outSize && adler == adler32Update(1, out, outSize);
+}
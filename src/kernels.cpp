@@ -0,0 +1,24 @@
+// The versions of the hot kernels for each CpuLevel, levels without their own version of a kernel use the
+// next narrower one
+
+static CpuKernels
+cpuKernels(CpuLevel level) {
+    CpuKernels kernels = {CPU_BASELINE, closestHitBvh, occludedBvh, nullptr, tonemapSpanScalar, denoisePixelsScalar};
+#if CPU_X86
+    if (level >= CPU_AVX2) {
+        kernels = {CPU_AVX2, closestHitBvhAvx2, occludedBvhAvx2, closestHitPacketAvx2, tonemapSpanAvx2,
+                   denoisePixelsAvx2};
+    }
+    if (level >= CPU_AVX512) {
+        kernels = {CPU_AVX512, closestHitBvhAvx512, occludedBvhAvx512, closestHitPacketAvx512, tonemapSpanAvx512,
+                   denoisePixelsAvx512};
+    }
+#endif
+    return kernels;
+}
+
+// Called once at startup, before any rendering. Levels above what the CPU has are lowered to it.
+static void
+selectCpuKernels(CpuLevel level) {
+    gKernels = cpuKernels(std::min(level, detectCpuLevel()));
+}
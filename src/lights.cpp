@@ -0,0 +1,63 @@
+// Next event estimation: at every diffuse hit one light is sampled directly with a shadow ray, instead of
+// waiting for a bounce to happen to land on it. Lights are spheres with an emitting material, which makes
+// them area lights with a soft shadow.
+
+// Spheres move around when the BVH is built, so this has to run after that
+static void
+collectLights(World& world) {
+    std::vector<u32> lights;
+    for (size_t i = 0; i < world.spheres.count; i++) {
+        const Material* material = world.materials.members[world.spheres.members[i].material];
+        Color emitted = material->emitted();
+        if (emitted.r > 0 || emitted.g > 0 || emitted.b > 0) {
+            lights.push_back((u32)i);
+        }
+    }
+    world.lights = copyToArray(lights);
+}
+
+// Direct light reaching a diffuse surface from one randomly picked light, divided by the chance of the
+// pick. Directions are sampled uniformly in the cone the light sphere covers as seen from the point.
+static Color
+sampleDirectLight(const World& world, const Ray& ray, const HitInfo& info, const Color& albedo) {
+    u32 lightCount = (u32)world.lights.count;
+    if (lightCount == 0) {
+        return vec3(0, 0, 0);
+    }
+    u32 lightIndex = std::min((u32)(Random.next() * lightCount), lightCount - 1);
+    const Sphere& light = world.spheres.members[world.lights.members[lightIndex]];
+
+    Vec3 toCenter = sphereCenter(light, ray.time) - info.point;
+    f32 distanceSquared = HMM_Dot(toCenter, toCenter);
+    f32 radiusSquared = light.radius * light.radius;
+    if (distanceSquared <= radiusSquared) {
+        return vec3(0, 0, 0);
+    }
+    f32 cosMax = sqrtf(1.0f - radiusSquared / distanceSquared);
+    // Same as 1 - cosMax without the cancellation for small, far away lights
+    f32 oneMinusCosMax = radiusSquared / distanceSquared / (1.0f + cosMax);
+
+    f32 cosTheta = 1.0f - Random.next() * oneMinusCosMax;
+    f32 sinTheta = sqrtf(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+    f32 phi = 2.0f * HMM_PI32 * Random.next();
+    Vec3 w = toCenter * (1.0f / sqrtf(distanceSquared));
+    Vec3 a = fabsf(w.x) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    Vec3 u = HMM_FastNormalize(HMM_Cross(a, w));
+    Vec3 v = HMM_Cross(w, u);
+    Vec3 direction = cosf(phi) * sinTheta * u + sinf(phi) * sinTheta * v + cosTheta * w;
+
+    f32 cosSurface = HMM_Dot(direction, info.normal);
+    if (cosSurface <= 0) {
+        return vec3(0, 0, 0);
+    }
+    Ray shadowRay = {info.point, direction, ray.time};
+    f32 tLight;
+    if (!intersectSphere(light, shadowRay, 0.001f, std::numeric_limits<f32>::max(), tLight) ||
+        occluded(world, shadowRay, 0.001f, tLight * 0.9999f)) {
+        return vec3(0, 0, 0);
+    }
+
+    // Lambertian BRDF albedo / pi over the cone pdf 1 / (2 pi (1 - cosMax))
+    Color emitted = world.materials.members[light.material]->emitted();
+    return (2.0f * oneMinusCosMax * cosSurface * lightCount) * albedo * emitted;
+}
@@ -6,12 +6,14 @@
 #include <cassert>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
 #include <algorithm>
 #include <utility>
 #include <iostream>
 #include <chrono>
 #include <limits>
+#include <string>
 
 #define SDL_MAIN_HANDLED
 #include "SDL.h"
@@ -23,239 +25,1031 @@
 #include "containers.cpp"
 #include "config.cpp"
 #include "types.cpp"
+#include "cpu.cpp"
+#include "hugepages.cpp"
+#include "numa.cpp"
 #include "math.cpp"
+#include "trace.cpp"
+#include "deflate.cpp"
+#include "inflate.cpp"
+#include "png.cpp"
+#include "hdr.cpp"
+#include "tonemap.cpp"
+#include "denoise.cpp"
+#include "stats.cpp"
+#include "perfcounters.cpp"
+#include "bvh.cpp"
 #include "hitdetection.cpp"
+#include "kernels.cpp"
+#include "raysort.cpp"
 #include "materials.cpp"
+#include "camera.cpp"
+#include "scene.cpp"
+#include "lights.cpp"
+#include "files.cpp"
+#include "bvhfile.cpp"
+#include "scenefile.cpp"
+#include "checkpoint.cpp"
+#include "tiles.cpp"
+#include "options.cpp"
+#include "distributed.cpp"
 
-struct Camera {
-    Vec3 lowerLeftCorner;
-    Vec3 horizontal;
-    Vec3 vertical;
-    Vec3 origin;
-    Vec3 u, v, w;
-    f32 lensRadius;
+// The first passes after a camera change take one sample per block of pixels, the rest accumulate at full
+// resolution until SUBSTEPS samples per pixel
+struct RenderPass {
+    i32 blockSize;
+    i32 samples;
+    i32 firstSample; // index of the pass's first sample, what full resolution samples are seeded with
 };
 
-static Camera
-makeCamera(Vec3 lookFrom, Vec3 lookAt, Vec3 vup, f32 vfov, f32 aspect, f32 aperture, f32 focusDist) {
-    Camera result;
-
-    result.lensRadius = aperture / 2;
-    f32 theta = vfov * (f32)M_PI / 180;
-    f32 halfHeight = tan(theta / 2);
-    f32 halfWidth = aspect * halfHeight;
-    result.origin = lookFrom;
-    result.w = HMM_FastNormalize(lookFrom - lookAt);
-    result.u = HMM_FastNormalize(HMM_Cross(vup, result.w));
-    result.v = HMM_Cross(result.w, result.u);
-    result.lowerLeftCorner =
-        result.origin - halfWidth * focusDist * result.u - halfHeight * focusDist * result.v - focusDist * result.w;
-    result.horizontal = 2 * halfWidth * focusDist * result.u;
-    result.vertical = 2 * halfHeight * focusDist * result.v;
-
-    return result;
-}
-
-static Ray
-getScreenRay(const Camera& camera, f32 s, f32 t) {
-    Vec3 rd = camera.lensRadius * randomInUnitDisk();
-    Vec3 offset = camera.u * rd.x + camera.v * rd.y;
-    Ray ray = {camera.origin + offset,
-               camera.lowerLeftCorner + s * camera.horizontal + t * camera.vertical - camera.origin - offset};
-    return ray;
-}
-
 struct RenderJob {
-    Color32* pixels;
+    Framebuffer* framebuffer;
     Camera* camera;
     World* world;
     i32 x, y;
     i32 width, height;
+    u32 generation;
+    RenderPass pass;
+    i32 previousSamples;
+    f64* cost; // seconds the tile took, for ordering the next pass
+    TileStats* stats;
 };
 
-static Color
-calcColor(const Ray& ray, const World& world, const i32 depth) {
-    HitInfo info;
-    if (hit(world, ray, 0.001f, std::numeric_limits<f32>::max(), info)) {
-        Ray scattered;
-        Vec3 attenuation;
-        if (depth < TRACING_MAX_DEPTH && info.material->scatter(ray, info, attenuation, scattered)) {
-            return attenuation * calcColor(scattered, world, depth + 1);
-        } else {
-            return vec3(0, 0, 0);
+// Bumped on every camera change, workers drop what they're doing when it no longer matches their job
+static std::atomic<u32> gRenderGeneration;
+
+// The first hit of a camera ray, for the denoiser and the AOVs
+struct SurfaceFeatures {
+    Color albedo;
+    Vec3 normal;
+    f32 depth;     // distance along the ray, infinite for the sky
+    i32 material;  // -1 for the sky
+    i32 primitive; // sphere id in the scene, -1 for the sky
+};
+
+// What shading one point of a path gives: the light it sends back along the ray without what arrives from
+// further along the path, and the ray the path goes on with when it does
+struct Bounce {
+    Color color;
+    bool scatters;
+    Vec3 attenuation;
+    Ray scattered;
+    bool countEmission; // for the scattered ray
+};
+
+// Diffuse hits sample the lights directly, so a bounce off one that reaches a light must not count the
+// light again. countEmission is false then. closest is null for rays that hit nothing. Camera rays fill in
+// features when given some.
+static Bounce
+shadeBounce(const Ray& ray, const ClosestHit* closest, const World& world, i32 depth, bool countEmission,
+            SurfaceFeatures* features) {
+    Bounce bounce;
+    bounce.scatters = false;
+    if (closest) {
+        HitInfo info;
+        surfaceInteraction(world, ray, *closest, info);
+        const Material* material = world.materials.members[info.material];
+        if (features) {
+            features->albedo = material->surfaceAlbedo();
+            features->normal = info.normal;
+            features->depth = closest->t * HMM_Length(ray.d);
+            features->material = (i32)info.material;
+            features->primitive = (i32)world.sphereIds.members[closest->primitive];
+        }
+        bounce.color = countEmission ? material->emitted() : vec3(0, 0, 0);
+        Color albedo = material->diffuseAlbedo();
+        bool diffuse = albedo.r > 0 || albedo.g > 0 || albedo.b > 0;
+        if (diffuse) {
+            bounce.color += sampleDirectLight(world, ray, info, albedo);
+        }
+        if (depth < TRACING_MAX_DEPTH && material->scatter(ray, info, bounce.attenuation, bounce.scattered)) {
+            bounce.scatters = true;
+            bounce.countEmission = !diffuse || world.lights.count == 0;
         }
     } else {
         Vec3 unitDirection = HMM_FastNormalize(ray.d);
         f32 t = 0.5f * (unitDirection.y + 1.0f);
-        return (1.0f - t) * vec3(1.0f, 1.0f, 1.0f) + t * vec3(0.5f, 0.7f, 1.0f);
+        bounce.color = (1.0f - t) * vec3(1.0f, 1.0f, 1.0f) + t * vec3(0.5f, 0.7f, 1.0f);
+        if (features) {
+            features->albedo = bounce.color;
+            features->normal = vec3(0, 0, 0);
+            features->depth = std::numeric_limits<f32>::infinity();
+            features->material = -1;
+            features->primitive = -1;
+        }
     }
+    return bounce;
 }
 
-static World
-randomScene() {
-    World world;
-
-    size_t n = 500;
-    Sphere* list = new Sphere[n];
-    list[0] = {vec3(0, -1000, 0), 1000, new Lambertian(vec3(0.5, 0.5, 0.5))};
-    size_t i = 1;
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            float chooseMat = Random.next();
-            Vec3 center = vec3(a + 0.9f * Random.next(), 0.2f, b + 0.9f * Random.next());
-            if (HMM_Length(center - vec3(4.f, 0.2f, 0.f)) > 0.9f) {
-                if (chooseMat < 0.8) { // diffuse
-                    list[i++] = {center, 0.2f,
-                                 new Lambertian(vec3(Random.next() * Random.next(), Random.next() * Random.next(),
-                                                     Random.next() * Random.next()))};
-                } else if (chooseMat < 0.95f) { // metal
-                    list[i++] = {
-                        center, 0.2f,
-                        new Metal(vec3(0.5f * (1.f + Random.next()),
-                                       0.5f * (1.f + Random.next()),
-                                       0.5f * (1.f + Random.next())),
-                                  0.5f * Random.next())};
-                } else { // glass
-                    list[i++] = {center, 0.2f, new Dielectric(1.5f)};
-                }
+// One path, depth first. Camera rays come with their closest hit already found when they were traced in a
+// packet.
+static Color
+calcColor(const Ray& ray, const World& world, const i32 depth, bool countEmission = true,
+          SurfaceFeatures* features = nullptr, const ClosestHit* traced = nullptr) {
+    ClosestHit closest;
+    bool found;
+    if (traced) {
+        closest = *traced;
+        found = closest.primitive != NO_PRIMITIVE;
+    } else {
+        found = closestHit(world, ray, 0.001f, std::numeric_limits<f32>::max(), closest);
+    }
+    Bounce bounce = shadeBounce(ray, found ? &closest : nullptr, world, depth, countEmission, features);
+    if (bounce.scatters) {
+        return bounce.color +
+               bounce.attenuation * calcColor(bounce.scattered, world, depth + 1, bounce.countEmission);
+    }
+    return bounce.color;
+}
+
+// One pixel's average over a pass: blended into what the earlier passes accumulated at full resolution, or
+// filling its whole block in the preview passes
+template <typename T>
+static void
+storePassAverage(T* buffer, i32 stride, const RenderJob& job, i32 x, i32 y, T average) {
+    i32 blockSize = job.pass.blockSize;
+    T* pixel = buffer + (size_t)y * stride + x;
+    if (blockSize == 1 && job.previousSamples == 0) {
+        // Not blended, the preview under it would leak into the rounding
+        *pixel = average;
+    } else if (blockSize == 1) {
+        f32 blend = (f32)job.pass.samples / (f32)(job.previousSamples + job.pass.samples);
+        *pixel = *pixel + blend * (average - *pixel);
+    } else {
+        i32 blockHeight = std::min(blockSize, job.y + job.height - y);
+        i32 blockWidth = std::min(blockSize, job.x + job.width - x);
+        for (i32 by = 0; by < blockHeight; by++) {
+            for (i32 bx = 0; bx < blockWidth; bx++) {
+                pixel[by * stride + bx] = average;
             }
         }
     }
+}
 
-    list[i++] = {vec3(0.f, 1.f, 0.f), 1.0f, new Dielectric(1.5f)};
-    list[i++] = {vec3(-4.f, 1.f, 0.f), 1.0f, new Lambertian(vec3(0.4f, 0.2f, 0.1f))};
-    list[i++] = {vec3(4.f, 1.f, 0.f), 1.0f, new Metal(vec3(0.7f, 0.6f, 0.5f), 0.0f)};
+// What one pixel's samples in a pass add up to
+struct PixelSum {
+    Color color;
+    SurfaceFeatures features;
+    f32 luminanceSquared;
+};
+
+static void
+addSample(const RenderJob& job, i32 x, i32 y, i32 s, Color sample, const SurfaceFeatures& features, PixelSum& sum) {
+    Framebuffer& framebuffer = *job.framebuffer;
+    sum.color += sample;
+    if (framebuffer.albedo) {
+        sum.features.albedo += features.albedo;
+        sum.features.normal += features.normal;
+        sum.luminanceSquared += luminance(sample) * luminance(sample);
+    }
+    // What doesn't average comes from the pixel's first sample
+    if (framebuffer.depth && job.pass.blockSize == 1 && job.previousSamples == 0 && s == 0) {
+        size_t pixel = (size_t)y * framebuffer.width + x;
+        framebuffer.depth[pixel] = features.depth;
+        framebuffer.materialId[pixel] = features.material;
+        framebuffer.primitiveId[pixel] = features.primitive;
+    }
+    countSample();
+}
+
+static void
+storePixel(const RenderJob& job, i32 x, i32 y, const PixelSum& sum) {
+    Framebuffer& framebuffer = *job.framebuffer;
+    f32 samples = (f32)job.pass.samples;
+    storePassAverage(framebuffer.color, framebuffer.width, job, x, y, sum.color / samples);
+    if (framebuffer.albedo) {
+        storePassAverage(framebuffer.albedo, framebuffer.width, job, x, y, sum.features.albedo / samples);
+        storePassAverage(framebuffer.normal, framebuffer.width, job, x, y, sum.features.normal / samples);
+        storePassAverage(framebuffer.luminanceSquared, framebuffer.width, job, x, y, sum.luminanceSquared / samples);
+    }
+}
 
-    world.spheres = {list, i};
+static Ray
+pixelRay(const RenderJob& job, i32 x, i32 y) {
+    i32 blockSize = job.pass.blockSize;
+    f32 u = ((f32)x + Random.next() * blockSize) / (f32)WIDTH;
+    f32 v = 1.0f - ((f32)y + Random.next() * blockSize) / (f32)HEIGHT; // Flipping the V so we go from bottom to top
+    return getScreenRay(*job.camera, u, v);
+}
 
-    return world;
+// The camera rays of PACKET_SIZE pixels of a row go through the BVH together, then every pixel's samples are
+// shaded on their own. Each pixel keeps its own random sequence, swapped in while its rays are made and
+// shaded, so the pixels come out the same as when rendered one by one.
+static void
+renderPacketOfPixels(const RenderJob& job, i32 x, i32 y, i32 count) {
+    bool wantFeatures = job.framebuffer->albedo != nullptr;
+    pcg32 generators[PACKET_SIZE];
+    PixelSum sums[PACKET_SIZE] = {};
+    for (i32 k = 0; k < count; k++) {
+        Random.seed(samplerSeed(x + k, y, job.pass.firstSample));
+        generators[k] = Random.rng;
+    }
+    RayPacket packet;
+    packet.count = count;
+    ClosestHit hits[PACKET_SIZE];
+    for (i32 s = 0; s < job.pass.samples; s++) {
+        for (i32 k = 0; k < count; k++) {
+            std::swap(Random.rng, generators[k]);
+            packet.rays[k] = pixelRay(job, x + k, y);
+            std::swap(Random.rng, generators[k]);
+        }
+        closestHitPacket(*job.world, packet, 0.001f, std::numeric_limits<f32>::max(), hits);
+        for (i32 k = 0; k < count; k++) {
+            std::swap(Random.rng, generators[k]);
+            SurfaceFeatures features;
+            Color sample = calcColor(packet.rays[k], *job.world, 0, true, wantFeatures ? &features : nullptr, &hits[k]);
+            std::swap(Random.rng, generators[k]);
+            addSample(job, x + k, y, s, sample, features, sums[k]);
+        }
+    }
+    for (i32 k = 0; k < count; k++) {
+        storePixel(job, x + k, y, sums[k]);
+    }
 }
 
+// Full resolution tiles a worker traces together with --sort-rays, kept per thread so batches don't allocate
+// again. A path only keeps the light it gathered so far and what the light it picks up further on gets
+// multiplied by.
+struct RayBatch {
+    std::vector<RenderJob> jobs;
+    std::vector<pcg32> generators; // each pixel's random sequence
+    std::vector<PixelSum> sums;
+    std::vector<SurfaceFeatures> features;
+    std::vector<Ray> rays;
+    std::vector<ClosestHit> hits;
+    std::vector<Color> colors;
+    std::vector<Vec3> throughputs;
+    std::vector<u8> countEmission;
+    std::vector<u32> active;
+    std::vector<u32> next;
+    std::vector<u64> sortKeys;
+};
+
+static thread_local RayBatch tRayBatch;
+
+// Calls f(job, x, y, p) for every pixel of the batch, tile after tile and row after row, p counting them
+template <typename F>
 static void
+forEachBatchPixel(const RayBatch& batch, F f) {
+    size_t p = 0;
+    for (const RenderJob& job : batch.jobs) {
+        for (i32 y = job.y; y < job.y + job.height; y++) {
+            for (i32 x = job.x; x < job.x + job.width; x++) {
+                f(job, x, y, p++);
+            }
+        }
+    }
+}
+
+// The paths of all tiles of the batch are traced a bounce at a time: the camera rays of a sample, then all
+// the rays they scattered into, sorted first (see raysort.cpp), and so on. Every pixel keeps its own random
+// sequence, swapped in while its rays are made and shaded. A path's light is added up from its first bounce
+// on, which rounds a little differently from calcColor(). The tiles have to be of the same pass and world.
+// Returns false when cancelled partway.
+static bool
+renderRayBatch(RayBatch& batch) {
+    const RenderJob& firstJob = batch.jobs[0];
+    const World& world = *firstJob.world;
+    bool wantFeatures = firstJob.framebuffer->albedo != nullptr;
+    bool packets = canTracePackets(world);
+    bool sorting = world.bvh.nodes.count > 0;
+    RaySortSpace sortSpace = {};
+    if (sorting) {
+        sortSpace = makeRaySortSpace(world);
+    }
+    size_t count = 0;
+    for (const RenderJob& job : batch.jobs) {
+        count += (size_t)job.width * job.height;
+    }
+    batch.generators.resize(count);
+    batch.sums.assign(count, {});
+    batch.features.resize(count);
+    batch.rays.resize(count);
+    batch.hits.resize(count);
+    batch.colors.resize(count);
+    batch.throughputs.resize(count);
+    batch.countEmission.resize(count);
+    forEachBatchPixel(batch, [&](const RenderJob& job, i32 x, i32 y, size_t p) {
+        Random.seed(samplerSeed(x, y, job.pass.firstSample));
+        batch.generators[p] = Random.rng;
+    });
+
+    const f32 tMax = std::numeric_limits<f32>::max();
+    for (i32 s = 0; s < firstJob.pass.samples; s++) {
+        forEachBatchPixel(batch, [&](const RenderJob& job, i32 x, i32 y, size_t p) {
+            std::swap(Random.rng, batch.generators[p]);
+            batch.rays[p] = pixelRay(job, x, y);
+            std::swap(Random.rng, batch.generators[p]);
+            batch.colors[p] = vec3(0, 0, 0);
+            batch.throughputs[p] = vec3(1, 1, 1);
+            batch.countEmission[p] = true;
+        });
+        batch.active.resize(count);
+        for (size_t p = 0; p < count; p++) {
+            batch.active[p] = (u32)p;
+        }
+        for (i32 depth = 0; !batch.active.empty(); depth++) {
+            if (firstJob.generation != gRenderGeneration) {
+                return false;
+            }
+            if (depth == 0 && packets) {
+                // Rows of neighbouring pixels, the pixels of a tile are in batch order
+                RayPacket packet;
+                size_t rowStart = 0;
+                for (const RenderJob& job : batch.jobs) {
+                    for (i32 row = 0; row < job.height; row++, rowStart += job.width) {
+                        for (i32 column = 0; column < job.width; column += PACKET_SIZE) {
+                            packet.count = std::min(PACKET_SIZE, job.width - column);
+                            std::copy_n(&batch.rays[rowStart + column], packet.count, packet.rays);
+                            closestHitPacket(world, packet, 0.001f, tMax, &batch.hits[rowStart + column]);
+                        }
+                    }
+                }
+            } else {
+                if (depth > 0 && sorting) {
+                    sortRays(batch.rays.data(), batch.active, batch.sortKeys, sortSpace);
+                }
+                for (u32 p : batch.active) {
+                    if (!closestHit(world, batch.rays[p], 0.001f, tMax, batch.hits[p])) {
+                        batch.hits[p].primitive = NO_PRIMITIVE;
+                    }
+                }
+            }
+
+            batch.next.clear();
+            for (u32 p : batch.active) {
+                const ClosestHit& hit = batch.hits[p];
+                SurfaceFeatures* features = depth == 0 && wantFeatures ? &batch.features[p] : nullptr;
+                std::swap(Random.rng, batch.generators[p]);
+                Bounce bounce = shadeBounce(batch.rays[p], hit.primitive != NO_PRIMITIVE ? &hit : nullptr, world,
+                                            depth, batch.countEmission[p], features);
+                std::swap(Random.rng, batch.generators[p]);
+                batch.colors[p] += batch.throughputs[p] * bounce.color;
+                if (bounce.scatters) {
+                    batch.throughputs[p] = batch.throughputs[p] * bounce.attenuation;
+                    batch.rays[p] = bounce.scattered;
+                    batch.countEmission[p] = bounce.countEmission;
+                    batch.next.push_back(p);
+                }
+            }
+            std::swap(batch.active, batch.next);
+        }
+
+        forEachBatchPixel(batch, [&](const RenderJob& job, i32 x, i32 y, size_t p) {
+            addSample(job, x, y, s, batch.colors[p], batch.features[p], batch.sums[p]);
+        });
+    }
+    forEachBatchPixel(batch, [&](const RenderJob& job, i32 x, i32 y, size_t p) {
+        storePixel(job, x, y, batch.sums[p]);
+    });
+    return true;
+}
+
+// Whether the job is traced in a batch, with --sort-rays every full resolution tile is, alone or with others,
+// so the image doesn't depend on how the tiles were batched
+static bool
+tracesInBatches(const RenderJob& job) {
+    return gOptions.sortRays && job.pass.blockSize == 1;
+}
+
+// Returns false when the job was cancelled partway
+static bool
 renderPartFromJob(const RenderJob& job) {
+    if (tracesInBatches(job)) {
+        tRayBatch.jobs.assign(1, job);
+        return renderRayBatch(tRayBatch);
+    }
+    i32 blockSize = job.pass.blockSize;
+    bool wantFeatures = job.framebuffer->albedo != nullptr;
+    bool packets = blockSize == 1 && canTracePackets(*job.world);
     auto h = job.y + job.height;
     auto w = job.x + job.width;
-    for (i32 y = job.y; y < h; y++) {
-        for (i32 x = job.x; x < w; x++) {
-            Vec3 color = vec3(0, 0, 0);
-            for (i32 s = 0; s < SUBSTEPS; s++) {
-                f32 u = ((f32)x + Random.next()) / (f32)WIDTH;
-                f32 v = 1.0f - ((f32)y + Random.next()) / (f32)HEIGHT; // Flipping the V so we go from bottom to top
-
-                Ray r = getScreenRay(*job.camera, u, v);
-                color += calcColor(r, *job.world, 0);
+    for (i32 y = job.y; y < h; y += blockSize) {
+        if (job.generation != gRenderGeneration) {
+            return false;
+        }
+        if (packets) {
+            for (i32 x = job.x; x < w; x += PACKET_SIZE) {
+                renderPacketOfPixels(job, x, y, std::min(PACKET_SIZE, w - x));
             }
-            color /= (f32)SUBSTEPS;
-            color = vec3(sqrt(color.r), sqrt(color.g), sqrt(color.b));
-            setPixelColor(job.pixels, x, y, color);
+            continue;
+        }
+        for (i32 x = job.x; x < w; x += blockSize) {
+            if (blockSize == 1) {
+                Random.seed(samplerSeed(x, y, job.pass.firstSample));
+            }
+            PixelSum sum = {};
+            for (i32 s = 0; s < job.pass.samples; s++) {
+                SurfaceFeatures features;
+                Color sample = calcColor(pixelRay(job, x, y), *job.world, 0, true, wantFeatures ? &features : nullptr);
+                addSample(job, x, y, s, sample, features, sum);
+            }
+            storePixel(job, x, y, sum);
+        }
+    }
+    return true;
+}
+
+struct TileRect {
+    i32 x, y;
+    i32 width, height;
+};
+
+// One queue per NUMA node, of the tiles in that node's band of rows
+static SafeQueue<RenderJob> gRenderQueues[NUMA_MAX_NODES];
+// Finished tiles for the window to upload, each one also wakes it up with a gRenderEventType event
+static SafeQueue<TileRect> gCompletedTiles;
+static u32 gRenderEventType = (u32)-1;
+
+static void
+notifyWindow() {
+    if (gRenderEventType != (u32)-1) {
+        SDL_Event event = {};
+        event.type = gRenderEventType;
+        SDL_PushEvent(&event);
+    }
+}
+
+// Hands a finished tile to the window, without one nobody would take them off the queue
+static void
+completeTile(const TileRect& tile) {
+    if (gRenderEventType != (u32)-1) {
+        gCompletedTiles.push(tile);
+        notifyWindow();
+    }
+}
+
+// Takes from the worker's own node first and from the others once that's empty
+static bool
+popRenderJob(i32 node, RenderJob* job) {
+    for (i32 i = 0; i < gNuma.nodeCount; i++) {
+        if (gRenderQueues[(node + i) % gNuma.nodeCount].pop(job)) {
+            return true;
         }
     }
+    return false;
 }
 
-static SafeQueue<RenderJob> gRenderQueue;
+// Pixels a worker gathers into one batch with --sort-rays, set for every pass so the batches are no bigger than
+// a thread's share of the frame
+static i64 gRayBatchPixels = RAY_SORT_BATCH_RAYS;
 
 static void
-jobQueueRenderer() {
-    while (!gRenderQueue.empty()) {
+jobQueueRenderer(i32 worker) {
+    traceThreadName("render worker");
+    i32 node = pinRenderWorker(worker);
+    PerfCounterGroup perfCounters;
+    bool countingPerf = gPerfCountersEnabled;
+    if (countingPerf) {
+        startPerfCounters(perfCounters);
+    }
+    RayBatch& batch = tRayBatch;
+    for (;;) {
         RenderJob job;
-        if (gRenderQueue.pop(&job)) {
-            renderPartFromJob(job);
+        u64 popTrace = traceBegin();
+        bool popped = popRenderJob(node, &job);
+        traceEnd("queue pop", popTrace);
+        if (!popped) {
+            break;
         }
+        job.world = numaLocalWorld(job.world, node);
+        u64 tileTrace = traceBegin();
+        RenderCounters countersBefore = tCounters;
+        auto start = std::chrono::high_resolution_clock::now();
+        bool batched = tracesInBatches(job);
+        batch.jobs.assign(1, job);
+        i64 pixels = (i64)job.width * job.height;
+        // The queue is in Hilbert order, so the tiles of a batch are next to each other
+        while (batched && pixels < gRayBatchPixels && popRenderJob(node, &job)) {
+            job.world = numaLocalWorld(job.world, node);
+            batch.jobs.push_back(job);
+            pixels += (i64)job.width * job.height;
+        }
+        if (batched ? renderRayBatch(batch) : renderPartFromJob(job)) {
+            std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+            RenderCounters counters = subtractCounters(tCounters, countersBefore);
+            // A batch's cost is shared out over its tiles by their pixels
+            for (const RenderJob& done : batch.jobs) {
+                f64 share = (f64)done.width * done.height / (f64)pixels;
+                *done.cost = diff.count() * share;
+                done.stats->seconds += diff.count() * share;
+                addCounters(done.stats->counters, scaleCounters(counters, share));
+                completeTile({done.x, done.y, done.width, done.height});
+            }
+        }
+        traceEnd(batched ? "ray batch" : "tile", tileTrace, batch.jobs[0].x, batch.jobs[0].y);
+    }
+    if (countingPerf) {
+        stopPerfCounters(perfCounters);
+    }
+    mergeThreadCounters();
+}
+
+static std::vector<RenderPass>
+makeRenderPasses(SampleRange range) {
+    std::vector<RenderPass> passes;
+    for (i32 blockSize = PREVIEW_BLOCK_SIZE; blockSize > 1; blockSize /= 2) {
+        passes.push_back({blockSize, 1, 0});
+    }
+    for (i32 samples = 0; samples < range.samples; samples += SAMPLES_PER_PASS) {
+        passes.push_back({1, std::min(SAMPLES_PER_PASS, range.samples - samples), range.firstSample + samples});
     }
+    return passes;
 }
 
+// A tile at its full sample count for distributed workers, in the full resolution passes a render of the
+// tile's samples takes here, so it comes out the same. The previews are left out, the first full resolution
+// pass covers them up anyway.
 static void
-renderPixels(Color32* pixels) {
-    Vec3 lookFrom = vec3(13, 2, 3);
-    Vec3 lookAt = vec3(0, 0, 0);
-    f32 distToFocus = 10;
-    f32 aperture = 0.1f;
-    Camera camera =
-        makeCamera(lookFrom, lookAt, vec3(0, 1, 0), 20, float(WIDTH) / float(HEIGHT), aperture, distToFocus);
+renderTileForCoordinator(Framebuffer* framebuffer, Camera* camera, World* world, const NetTile& tile) {
+    f64 cost;
+    TileStats stats = {};
+    i32 previousSamples = 0;
+    for (const RenderPass& pass : makeRenderPasses({tile.firstSample, tile.samples})) {
+        if (pass.blockSize > 1) {
+            continue;
+        }
+        RenderJob job = {
+            framebuffer, camera, world, tile.x, tile.y, tile.width, tile.height, gRenderGeneration, pass,
+            previousSamples, &cost, &stats,
+        };
+        renderPartFromJob(job);
+        previousSamples += pass.samples;
+    }
+}
 
-    World world = randomScene();
+// Returns false if the camera changed before the pass was done
+static bool
+renderPass(Framebuffer* framebuffer, Camera* camera, World* world, u32 generation, RenderPass pass,
+           i32 previousSamples, const TileGrid& grid, std::vector<f64>& tileCosts,
+           std::vector<TileStats>& tileStats) {
+#if 1 // enable render jobs
+    for (i32 node = 0; node < gNuma.nodeCount; node++) {
+        gRenderQueues[node].clear();
+    }
 
-    const int renderCount = 1;
-    auto start = std::chrono::high_resolution_clock::now();
-    for (int renderIndex = 1; renderIndex <= renderCount; renderIndex++) {
+    // Queue tiles along the Hilbert curve, most expensive ones of the last pass first
+    std::vector<i32> order = makeTileOrder(grid, tileCosts);
+    tileCosts.resize(order.size());
+    for (i32 tile : order) {
+        int x = (tile % grid.columns) * grid.tileWidth;
+        int y = (tile / grid.columns) * grid.tileHeight;
+        int w = std::min(grid.tileWidth, WIDTH - x);
+        int h = std::min(grid.tileHeight, HEIGHT - y);
+        RenderJob job = {
+            framebuffer, camera, world, x, y, w, h, generation, pass, previousSamples,
+            &tileCosts[tile], &tileStats[tile],
+        };
+        gRenderQueues[numaNodeOfRow(y, HEIGHT)].unsafePush(job);
+    }
 
-        memset(pixels, 0, sizeof(Color32) * WIDTH * HEIGHT);
+    u32 nThreads = renderWorkerCount();
+    i64 threadShare = (i64)WIDTH * HEIGHT / nThreads;
+    gRayBatchPixels = std::max<i64>(std::min<i64>(RAY_SORT_BATCH_RAYS, threadShare), 1);
+    auto threads = std::vector<std::thread>();
+    threads.reserve(nThreads);
+    for (size_t i = 0; i < nThreads; i++) {
+        threads.emplace_back(jobQueueRenderer, (i32)i);
+    }
 
-        auto loopStart = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+#else
+    RenderJob job;
+    job.framebuffer = framebuffer;
+    job.camera = camera;
+    job.world = world;
+    job.x = 0;
+    job.y = 0;
+    job.width = WIDTH;
+    job.height = HEIGHT;
+    job.generation = generation;
+    job.pass = pass;
+    job.previousSamples = previousSamples;
+    f64 cost;
+    job.cost = &cost;
+    TileStats stats = {0, 0, WIDTH, HEIGHT};
+    job.stats = &stats;
 
-#if 1 // enable render jobs
-        gRenderQueue.clear();
-
-        int x = 0;
-        int y = 0;
-
-        // Calculate tiles and make them into render jobs
-        while (y < HEIGHT) {
-            int h = TILE_HEIGHT;
-            h = h + y >= HEIGHT ? HEIGHT - y : h;
-            while (x < WIDTH) {
-                int w = TILE_WIDTH;
-                w = w + x >= WIDTH ? WIDTH - x : w;
-                RenderJob job = {
-                    pixels, &camera, &world, x, y, w, h,
-                };
-                gRenderQueue.unsafePush(job);
-                x += TILE_WIDTH;
+    renderPartFromJob(job);
+    mergeThreadCounters();
+    completeTile({0, 0, WIDTH, HEIGHT});
+#endif
+    return generation == gRenderGeneration;
+}
+
+static void
+resetTileStats(std::vector<TileStats>& tileStats, const TileGrid& grid) {
+    tileStats.assign(grid.columns * grid.rows, {});
+    for (i32 tile = 0; tile < grid.columns * grid.rows; tile++) {
+        TileStats& stats = tileStats[tile];
+        stats.x = (tile % grid.columns) * grid.tileWidth;
+        stats.y = (tile / grid.columns) * grid.tileHeight;
+        stats.width = std::min(grid.tileWidth, WIDTH - stats.x);
+        stats.height = std::min(grid.tileHeight, HEIGHT - stats.y);
+    }
+}
+
+// <base>.<name>.<ext> for aovOutputPath = <base>.<ext>
+static std::string
+aovPath(const char* name) {
+    std::string path = gOptions.aovOutputPath;
+    size_t dot = path.rfind('.');
+    return path.substr(0, dot) + "." + name + path.substr(dot);
+}
+
+// Writes the AOVs through the float image writers, which only know colors, so the framebuffer's color is
+// swapped for each AOV in turn and the scalar ones go into all three channels
+static void
+saveAovs(const Framebuffer& framebuffer, SampleRange range) {
+    size_t count = (size_t)framebuffer.width * framebuffer.height;
+    std::vector<Color> scalars(count);
+    Framebuffer aov = framebuffer;
+    struct {
+        const char* name;
+        const Color* colors;
+        const f32* floats;
+        const i32* ints;
+    } aovs[] = {
+        {"depth", nullptr, framebuffer.depth, nullptr},
+        {"normal", framebuffer.normal, nullptr, nullptr},
+        {"albedo", framebuffer.albedo, nullptr, nullptr},
+        {"material", nullptr, nullptr, framebuffer.materialId},
+        {"primitive", nullptr, nullptr, framebuffer.primitiveId},
+    };
+    for (const auto& entry : aovs) {
+        if (entry.colors) {
+            aov.color = (Color*)entry.colors;
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                f32 value = entry.floats ? entry.floats[i] : (f32)entry.ints[i];
+                scalars[i] = vec3(value, value, value);
             }
-            x = 0;
-            y += TILE_HEIGHT;
+            aov.color = scalars.data();
         }
-
-        u32 nThreads = std::thread::hardware_concurrency();
-        auto threads = std::vector<std::thread>();
-        threads.reserve(nThreads);
-        for (size_t i = 0; i < nThreads; i++) {
-            threads.emplace_back(jobQueueRenderer);
+        std::string path = aovPath(entry.name);
+        if (writeFloatImage(path.c_str(), aov, gOptions.exrCompression, range)) {
+            std::cout << "Saved " << path << "\n";
+        } else {
+            std::cout << "Failed to write " << path << "\n";
         }
+    }
+}
 
-        for (size_t i = 0; i < threads.size(); i++) {
-            threads[i].join();
+// With --denoise the framebuffer is denoised in place after the float image is written, so the window shows
+// the denoised image too until the next render overwrites it
+static void
+savePixels(Framebuffer* framebuffer, SampleRange range) {
+    auto start = std::chrono::high_resolution_clock::now();
+    u64 trace;
+    std::chrono::duration<double> diff;
+    if (gOptions.floatOutputPath) {
+        trace = traceBegin();
+        bool saved = writeFloatImage(gOptions.floatOutputPath, *framebuffer, gOptions.exrCompression, range);
+        traceEnd("float image save", trace);
+        diff = std::chrono::high_resolution_clock::now() - start;
+        if (saved) {
+            std::cout << "Saved " << gOptions.floatOutputPath << " in " << diff.count() << " s\n";
+        } else {
+            std::cout << "Failed to write " << gOptions.floatOutputPath << "\n";
         }
-#else
-        RenderJob job;
-        job.pixels = pixels;
-        job.camera = &camera;
-        job.world = &world;
-        job.x = 0;
-        job.y = 0;
-        job.width = WIDTH;
-        job.height = HEIGHT;
+    }
 
-        renderPartFromJob(job);
-#endif
+    if (gOptions.aovOutputPath) {
+        trace = traceBegin();
+        saveAovs(*framebuffer, range);
+        traceEnd("aov save", trace);
+    }
 
-        auto loopEnd = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> loopDiff = loopEnd - loopStart;
-        std::cout << "Time of one render " << renderIndex << ": " << loopDiff.count() << " s\n";
-    } // END for renderCount
+    if (gOptions.denoise) {
+        start = std::chrono::high_resolution_clock::now();
+        trace = traceBegin();
+        denoiseFramebuffer(*framebuffer, range.samples);
+        traceEnd("denoise", trace);
+        diff = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Denoised in " << diff.count() << " s\n";
+        completeTile({0, 0, WIDTH, HEIGHT});
+    }
 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> diff = end - start;
-    auto average = diff.count() / renderCount;
-    std::cout << "Average time of " << renderCount << " render(s): " << average << " s\n";
+    start = std::chrono::high_resolution_clock::now();
+    trace = traceBegin();
+    tonemapFramebuffer(*framebuffer, framebuffer->pixels, WIDTH, gOptions.tonemap);
+    traceEnd("tonemap", trace);
+    if (!writePng(gOptions.outputPath, framebuffer->pixels, WIDTH, HEIGHT, gOptions.pngLevel)) {
+        std::cout << "Failed to write " << gOptions.outputPath << "\n";
+        return;
+    }
+    diff = std::chrono::high_resolution_clock::now() - start;
+    std::cout << "Saved " << gOptions.outputPath << " in " << diff.count() << " s\n";
 }
 
+// The window hands camera changes over through these
+static std::mutex gCameraMutex;
+static std::condition_variable gCameraChanged;
+static OrbitCamera gCamera;
+static bool gQuitRendering;
+
 static void
-savePixels(Color32* pixels) {
-    stbi_write_png("render.png", WIDTH, HEIGHT, 4, pixels, WIDTH * sizeof(Color32));
+setRenderCamera(const OrbitCamera& camera) {
+    {
+        std::lock_guard<std::mutex> lockGuard(gCameraMutex);
+        gCamera = camera;
+        gRenderGeneration++;
+    }
+    gCameraChanged.notify_one();
+}
+
+static void
+stopRendering() {
+    {
+        std::lock_guard<std::mutex> lockGuard(gCameraMutex);
+        gQuitRendering = true;
+        gRenderGeneration++;
+    }
+    gCameraChanged.notify_one();
 }
 
 static std::atomic<bool> gAtomicRenderAndSaveDone;
+
+// With --checkpoint, hash of what the image depends on and the checkpoint found at startup (0 samples if none)
+static u64 gCheckpointSceneHash;
+static Checkpoint gResume;
+
+// Index of the pass after the one that ends at that many samples, -1 when none does
+static i32
+passAfterSamples(const std::vector<RenderPass>& passes, i32 samples) {
+    i32 done = 0;
+    for (size_t i = 0; i < passes.size(); i++) {
+        if (passes[i].blockSize == 1) {
+            done += passes[i].samples;
+            if (done == samples) {
+                return (i32)i + 1;
+            }
+        }
+    }
+    return -1;
+}
+
+// Renders progressively until the image is done and saves it, then waits for the camera to move.
+// A camera change cancels whatever is in flight and starts over from the low resolution passes.
+static void
+renderAndSave(Framebuffer* framebuffer, World* world) {
+    traceThreadName("render loop");
+
+    std::vector<RenderPass> passes = makeRenderPasses(gOptions.sampleRange);
+    TileGrid grid = makeTileGrid(WIDTH, HEIGHT, renderWorkerCount(), TILE_WIDTH, TILE_HEIGHT);
+    std::vector<f64> tileCosts;
+    std::vector<TileStats> tileStats;
+    std::cout << "Tiles of " << grid.tileWidth << "x" << grid.tileHeight << ", " << grid.columns * grid.rows
+              << " in total\n";
+
+    u32 finishedGeneration = gRenderGeneration - 1;
+    for (;;) {
+        OrbitCamera orbit;
+        u32 generation;
+        {
+            std::unique_lock<std::mutex> lock(gCameraMutex);
+            gCameraChanged.wait(lock, [&]() { return gQuitRendering || gRenderGeneration != finishedGeneration; });
+            if (gQuitRendering) {
+                break;
+            }
+            orbit = gCamera;
+            generation = gRenderGeneration;
+        }
+        gAtomicRenderAndSaveDone = false;
+        notifyWindow();
+
+        Camera camera = cameraFromOrbit(orbit, float(WIDTH) / float(HEIGHT));
+        // Stats cover one full render, whatever a cancelled one counted is dropped
+        takeCounterTotals();
+        resetTileStats(tileStats, grid);
+        auto start = std::chrono::high_resolution_clock::now();
+        auto lastCheckpoint = start;
+        i32 samples = 0;
+        size_t firstPass = 0;
+        // Only the view the checkpoint was made of picks up from it, and only once
+        if (gResume.samples > 0 && !memcmp(&orbit, &gResume.camera, sizeof(orbit))) {
+            i32 resumePass = passAfterSamples(passes, gResume.samples);
+            if (resumePass >= 0) {
+                restoreCheckpoint(gResume, *framebuffer);
+                firstPass = resumePass;
+                samples = gResume.samples;
+                completeTile({0, 0, WIDTH, HEIGHT});
+            } else {
+                std::cout << "Checkpoint has " << gResume.samples << " samples per pixel, which doesn't fit the "
+                          << "passes of this build, starting over\n";
+            }
+            gResume = Checkpoint();
+        }
+        bool finished = true;
+        for (size_t i = firstPass; i < passes.size() && finished; i++) {
+            u64 trace = traceBegin();
+            finished = renderPass(framebuffer, &camera, world, generation, passes[i], samples, grid, tileCosts,
+                                  tileStats);
+            traceEnd(finished ? "pass" : "cancelled pass", trace);
+            if (passes[i].blockSize == 1) {
+                samples += passes[i].samples;
+            }
+
+            std::chrono::duration<double> sinceCheckpoint = std::chrono::high_resolution_clock::now() - lastCheckpoint;
+            if (finished && gOptions.checkpointPath && passes[i].blockSize == 1 && i + 1 < passes.size() &&
+                sinceCheckpoint.count() >= gOptions.checkpointInterval) {
+                trace = traceBegin();
+                if (!writeCheckpoint(gOptions.checkpointPath, gCheckpointSceneHash, orbit, *framebuffer, samples)) {
+                    std::cout << "Failed to write checkpoint " << gOptions.checkpointPath << "\n";
+                }
+                traceEnd("checkpoint", trace);
+                lastCheckpoint = std::chrono::high_resolution_clock::now();
+            }
+        }
+        if (!finished) {
+            continue;
+        }
+        finishedGeneration = generation;
+
+        std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Time of one render: " << diff.count() << " s\n";
+        RenderCounters totals = takeCounterTotals();
+        if (RENDER_STATS) {
+            std::cout << "Rays: " << totals.rays << " (" << totals.rays / diff.count() / 1e6 << " Mrays/s), "
+                      << (f64)totals.nodesVisited / std::max<u64>(totals.rays, 1) << " nodes and "
+                      << (f64)totals.primitivesTested / std::max<u64>(totals.rays, 1) << " spheres per ray\n";
+        }
+
+        savePixels(framebuffer, {gOptions.sampleRange.firstSample, samples});
+        if (gOptions.checkpointPath) {
+            // Done, nothing left to resume
+            remove(gOptions.checkpointPath);
+        }
+        if (gOptions.writeStats) {
+            writeRenderStats(gOptions.outputPath, tileStats, totals, WIDTH, HEIGHT, diff.count());
+        }
+        if (gOptions.tracePath) {
+            if (writeTrace(gOptions.tracePath)) {
+                std::cout << "Saved trace to " << gOptions.tracePath << "\n";
+            } else {
+                std::cout << "Failed to write " << gOptions.tracePath << "\n";
+            }
+        }
+        gAtomicRenderAndSaveDone = true;
+        notifyWindow();
+        if (gOptions.headless) {
+            break;
+        }
+    }
+}
+
+// Renders the start view a number of times without a window, for comparing changes to the tracing code
 static void
-renderAndSave(Color32* pixels) {
-    gAtomicRenderAndSaveDone = false;
-    renderPixels(pixels);
-    savePixels(pixels);
-    gAtomicRenderAndSaveDone = true;
+runBenchmark(Framebuffer* framebuffer, Scene* scene, i32 runs) {
+
+    std::vector<RenderPass> passes = makeRenderPasses(gOptions.sampleRange);
+    TileGrid grid = makeTileGrid(WIDTH, HEIGHT, renderWorkerCount(), TILE_WIDTH, TILE_HEIGHT);
+    std::vector<f64> tileCosts;
+    std::vector<TileStats> tileStats;
+    Camera camera = cameraFromOrbit(scene->camera, float(WIDTH) / float(HEIGHT));
+    std::cout << "Benchmark of " << runs << " renders at " << WIDTH << "x" << HEIGHT << ", "
+              << gOptions.sampleRange.samples << " samples per pixel, " << renderWorkerCount() << " threads, "
+              << CPU_LEVEL_NAMES[gKernels.level] << " kernels\n";
+
+    gPerfCountersEnabled = gOptions.perfCounters;
+    takePerfCounterTotals();
+    std::vector<f64> times;
+    u64 rays = 0;
+    for (i32 run = 0; run < runs; run++) {
+        takeCounterTotals();
+        resetTileStats(tileStats, grid);
+        auto start = std::chrono::high_resolution_clock::now();
+        i32 samples = 0;
+        for (size_t i = 0; i < passes.size(); i++) {
+            renderPass(framebuffer, &camera, &scene->world, gRenderGeneration, passes[i], samples, grid, tileCosts,
+                       tileStats);
+            if (passes[i].blockSize == 1) {
+                samples += passes[i].samples;
+            }
+        }
+        std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+        RenderCounters totals = takeCounterTotals();
+        rays += totals.rays;
+        times.push_back(diff.count());
+        std::cout << "Run " << run + 1 << ": " << diff.count() << " s";
+        if (RENDER_STATS) {
+            std::cout << ", " << totals.rays / diff.count() / 1e6 << " Mrays/s";
+        }
+        std::cout << "\n";
+    }
+    gPerfCountersEnabled = false;
+
+    std::sort(times.begin(), times.end());
+    std::cout << "Best " << times.front() << " s, median " << times[times.size() / 2] << " s, worst "
+              << times.back() << " s\n";
+    if (gOptions.perfCounters) {
+        std::cout << "Counters over all runs, summed over the render threads:\n";
+        printPerfCounters(takePerfCounterTotals(), rays);
+    }
+    if (gOptions.hugePages != HUGE_PAGES_OFF) {
+        // Transparent ones are only there once the memory has been used
+        printHugePageUsage();
+    }
+    savePixels(framebuffer, gOptions.sampleRange);
 }
 
 int
 main(int argc, char** argv) {
+    if (!parseOptions(argc, argv, gOptions)) {
+        return -1;
+    }
+    selectCpuKernels(gOptions.cpuLevel);
+    gHugePageMode = gOptions.hugePages;
+    if (gOptions.cpuLevel != CPU_LEVEL_COUNT && gKernels.level != gOptions.cpuLevel) {
+        std::cout << "This CPU only has " << CPU_LEVEL_NAMES[gKernels.level] << "\n";
+    }
+    if (gOptions.tracePath) {
+        enableTracing();
+    }
+    if (gOptions.workerAddress) {
+        return runWorker(gOptions.workerAddress, renderTileForCoordinator) ? 0 : -1;
+    }
+
+    Scene scene;
+    if (!loadScene(gOptions.scenePath, gOptions.sceneSeed, gOptions.bvhCacheDirectory, scene)) {
+        return -1;
+    }
+    if (gOptions.exportScenePath) {
+        if (!writeSceneText(gOptions.exportScenePath, scene)) {
+            std::cout << "Failed to write " << gOptions.exportScenePath << "\n";
+            return -1;
+        }
+        std::cout << "Saved scene to " << gOptions.exportScenePath << "\n";
+    }
+
+    Framebuffer framebuffer;
+    framebuffer.width = WIDTH;
+    framebuffer.height = HEIGHT;
+    framebuffer.color = allocateLargeArray<Color>(WIDTH * HEIGHT);
+    framebuffer.pixels = allocateLargeArray<Color32>(WIDTH * HEIGHT);
+    framebuffer.albedo = nullptr;
+    framebuffer.normal = nullptr;
+    framebuffer.luminanceSquared = nullptr;
+    framebuffer.depth = nullptr;
+    framebuffer.materialId = nullptr;
+    framebuffer.primitiveId = nullptr;
+    if (gOptions.denoise || gOptions.aovOutputPath) {
+        framebuffer.albedo = allocateLargeArray<Color>(WIDTH * HEIGHT);
+        framebuffer.normal = allocateLargeArray<Vec3>(WIDTH * HEIGHT);
+        framebuffer.luminanceSquared = allocateLargeArray<f32>(WIDTH * HEIGHT);
+    }
+    if (gOptions.aovOutputPath) {
+        framebuffer.depth = allocateLargeArray<f32>(WIDTH * HEIGHT);
+        framebuffer.materialId = allocateLargeArray<i32>(WIDTH * HEIGHT);
+        framebuffer.primitiveId = allocateLargeArray<i32>(WIDTH * HEIGHT);
+    }
+
+    if (gOptions.numa) {
+        gNuma = detectNumaTopology();
+        std::cout << "NUMA nodes: " << gNuma.nodeCount << ", CPUs: " << gNuma.cpus.size() << "\n";
+        if (!bindFramebufferToNumaNodes(framebuffer)) {
+            std::cout << "Could not place the framebuffer on the NUMA nodes, it stays where it was\n";
+        }
+        if (gOptions.numaReplicate && !replicateWorldOnNumaNodes(scene.world)) {
+            std::cout << "Could not replicate the scene on the NUMA nodes, they share one copy\n";
+        }
+    }
+    if (gOptions.hugePages != HUGE_PAGES_OFF) {
+        printHugePageUsage();
+    }
+
+    if (gOptions.checkpointPath) {
+        gCheckpointSceneHash = hashRenderInputs(scene.world, gOptions.sampleRange.firstSample);
+        if (loadCheckpoint(gOptions.checkpointPath, gCheckpointSceneHash, framebuffer, gResume)) {
+            // Picks up the view that was being rendered
+            scene.camera = gResume.camera;
+            std::cout << "Resuming from " << gOptions.checkpointPath << " at " << gResume.samples
+                      << " samples per pixel\n";
+        }
+    }
+
+    if (gOptions.coordinatorPort > 0) {
+        if (!runCoordinator(gOptions.coordinatorPort, scene, gOptions.sampleRange, &framebuffer)) {
+            return -1;
+        }
+        savePixels(&framebuffer, gOptions.sampleRange);
+        return 0;
+    }
+    if (gOptions.headless) {
+        setRenderCamera(scene.camera);
+        renderAndSave(&framebuffer, &scene.world);
+        return 0;
+    }
+    if (gOptions.benchmarkRuns > 0) {
+        runBenchmark(&framebuffer, &scene, gOptions.benchmarkRuns);
+        if (gOptions.tracePath && !writeTrace(gOptions.tracePath)) {
+            std::cout << "Failed to write " << gOptions.tracePath << "\n";
+        }
+        return 0;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         const char* error = SDL_GetError();
         assert("SDL_Error" == error);
@@ -268,7 +1062,7 @@ main(int argc, char** argv) {
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_TARGETTEXTURE);
 
     SDL_Texture* texture =
-        SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STATIC, WIDTH, HEIGHT);
+        SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
 
     if (!window || !renderer || !texture) {
         const char* error = SDL_GetError();
@@ -281,22 +1075,51 @@ main(int argc, char** argv) {
     SDL_RenderClear(renderer);
     SDL_RenderPresent(renderer);
 
-    Color32* pixels = (Color32*)calloc(WIDTH * HEIGHT, sizeof(Color32));
+    // The window has its own tonemap settings, so exposure can be tried out without touching the saved image
+    TonemapSettings displayTonemap = gOptions.tonemap;
+    bool displayDirty = true;
+
+    gRenderEventType = SDL_RegisterEvents(1);
+
+    int displayFps = gOptions.displayFps;
+    SDL_DisplayMode displayMode;
+    if (displayFps <= 0) {
+        displayFps = SDL_GetWindowDisplayMode(window, &displayMode) == 0 && displayMode.refresh_rate > 0
+                         ? displayMode.refresh_rate
+                         : 60;
+    }
+    u32 frameInterval = 1000 / displayFps;
+    u32 lastPresent = SDL_GetTicks() - frameInterval;
+    bool needsPresent = true;
 
 #define START_WITH_SPACE 0
 
+    OrbitCamera camera = scene.camera;
+    const OrbitCamera startCamera = camera;
+    bool cameraMoved = false;
+    setRenderCamera(camera);
+
 #if START_WITH_SPACE
     std::thread backgroundThread;
 #else
-    std::thread backgroundThread = std::thread(renderAndSave, pixels);
+    std::thread backgroundThread = std::thread(renderAndSave, &framebuffer, &scene.world);
 #endif
 
     bool expectedRenderAndSaveState = !gAtomicRenderAndSaveDone;
 
     b32 running = true;
     while (running) {
+        // Sleep until there's input or finished tiles, and when something is waiting to be shown, at most
+        // until the next frame is due
         SDL_Event event;
-        while (SDL_PollEvent(&event)) {
+        int gotEvent;
+        if (needsPresent) {
+            i32 untilNextFrame = (i32)(lastPresent + frameInterval - SDL_GetTicks());
+            gotEvent = SDL_WaitEventTimeout(&event, std::max(untilNextFrame, 0));
+        } else {
+            gotEvent = SDL_WaitEvent(&event);
+        }
+        for (; gotEvent; gotEvent = SDL_PollEvent(&event)) {
             switch (event.type) {
             case SDL_QUIT: {
                 running = false;
@@ -309,15 +1132,112 @@ main(int argc, char** argv) {
                     running = false;
                     break;
                 }
+                case SDLK_EQUALS:
+                case SDLK_KP_PLUS: {
+                    displayTonemap.exposure += 0.5f;
+                    displayDirty = true;
+                    break;
+                }
+                case SDLK_MINUS:
+                case SDLK_KP_MINUS: {
+                    displayTonemap.exposure -= 0.5f;
+                    displayDirty = true;
+                    break;
+                }
+                case SDLK_t: {
+                    displayTonemap.curve = (TonemapCurve)((displayTonemap.curve + 1) % TONEMAP_CURVE_COUNT);
+                    displayDirty = true;
+                    break;
+                }
+                case SDLK_LEFT: {
+                    orbitAround(camera, -ORBIT_KEY_STEP, 0);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_RIGHT: {
+                    orbitAround(camera, ORBIT_KEY_STEP, 0);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_UP: {
+                    orbitAround(camera, 0, ORBIT_KEY_STEP);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_DOWN: {
+                    orbitAround(camera, 0, -ORBIT_KEY_STEP);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_w: {
+                    zoomOrbit(camera, 1 / ORBIT_ZOOM_STEP);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_s: {
+                    zoomOrbit(camera, ORBIT_ZOOM_STEP);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_a: {
+                    panOrbit(camera, -PAN_KEY_STEP, 0);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_d: {
+                    panOrbit(camera, PAN_KEY_STEP, 0);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_q: {
+                    panOrbit(camera, 0, -PAN_KEY_STEP);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_e: {
+                    panOrbit(camera, 0, PAN_KEY_STEP);
+                    cameraMoved = true;
+                    break;
+                }
+                case SDLK_r: {
+                    camera = startCamera;
+                    cameraMoved = true;
+                    break;
+                }
+                }
+                break;
+            }
+
+            // Left drag orbits, right or middle drag pans and the wheel zooms
+            case SDL_MOUSEMOTION: {
+                f32 dx = (f32)event.motion.xrel / (HEIGHT * WINDOW_SCALE);
+                f32 dy = (f32)event.motion.yrel / (HEIGHT * WINDOW_SCALE);
+                if (event.motion.state & SDL_BUTTON_LMASK) {
+                    orbitAround(camera, -dx * ORBIT_DRAG_SPEED, dy * ORBIT_DRAG_SPEED);
+                    cameraMoved = true;
+                } else if (event.motion.state & (SDL_BUTTON_RMASK | SDL_BUTTON_MMASK)) {
+                    panOrbit(camera, -dx, dy);
+                    cameraMoved = true;
                 }
                 break;
             }
 
+            case SDL_MOUSEWHEEL: {
+                zoomOrbit(camera, powf(ORBIT_ZOOM_STEP, (f32)-event.wheel.y));
+                cameraMoved = true;
+                break;
+            }
+
+            case SDL_WINDOWEVENT: {
+                needsPresent = true;
+                break;
+            }
+
 #if START_WITH_SPACE
             case SDL_KEYUP: {
                 switch (event.key.keysym.sym) {
                 case SDLK_SPACE: {
-                    backgroundThread = std::thread(renderAndSave, pixels);
+                    backgroundThread = std::thread(renderAndSave, &framebuffer, &scene.world);
                     break;
                 }
                 }
@@ -326,8 +1246,15 @@ main(int argc, char** argv) {
             }
         }
 
+        // All input since the last wake up goes into one restart
+        if (cameraMoved) {
+            cameraMoved = false;
+            setRenderCamera(camera);
+        }
+
         if (expectedRenderAndSaveState != gAtomicRenderAndSaveDone) {
             expectedRenderAndSaveState = gAtomicRenderAndSaveDone;
+            displayDirty = true;
             if (expectedRenderAndSaveState) {
                 SDL_SetWindowTitle(window, "Done rendering");
             } else {
@@ -335,21 +1262,52 @@ main(int argc, char** argv) {
             }
         }
 
-        SDL_UpdateTexture(texture, NULL, pixels, WIDTH * sizeof(Color32));
+        // Only the finished tiles get tonemapped and uploaded, unless the tonemap itself changed
+        void* texturePixels;
+        int texturePitch;
+        if (displayDirty) {
+            displayDirty = false;
+            while (gCompletedTiles.pop()) {
+            }
+            if (SDL_LockTexture(texture, NULL, &texturePixels, &texturePitch) == 0) {
+                tonemapFramebuffer(framebuffer, (Color32*)texturePixels, texturePitch / sizeof(Color32),
+                                   displayTonemap);
+                SDL_UnlockTexture(texture);
+            }
+            needsPresent = true;
+        }
+        TileRect tile;
+        while (gCompletedTiles.pop(&tile)) {
+            SDL_Rect rect = {tile.x, tile.y, tile.width, tile.height};
+            if (SDL_LockTexture(texture, &rect, &texturePixels, &texturePitch) == 0) {
+                tonemapRect(framebuffer, (Color32*)texturePixels, texturePitch / sizeof(Color32), tile.x, tile.y,
+                            tile.width, tile.height, displayTonemap);
+                SDL_UnlockTexture(texture);
+            }
+            needsPresent = true;
+        }
+
+        if (needsPresent && SDL_GetTicks() - lastPresent >= frameInterval) {
+            needsPresent = false;
+            lastPresent = SDL_GetTicks();
 
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
 
-        SDL_RendererFlip renderFlip = SDL_FLIP_NONE;
-        SDL_Rect srcrect = {0, 0, WIDTH, HEIGHT};
-        SDL_Rect dstrect = {0, 0, WIDTH * WINDOW_SCALE, HEIGHT * WINDOW_SCALE};
+            SDL_RendererFlip renderFlip = SDL_FLIP_NONE;
+            SDL_Rect srcrect = {0, 0, WIDTH, HEIGHT};
+            SDL_Rect dstrect = {0, 0, WIDTH * WINDOW_SCALE, HEIGHT * WINDOW_SCALE};
 
-        SDL_RenderCopyEx(renderer, texture, &srcrect, &dstrect, 0, 0, renderFlip);
+            SDL_RenderCopyEx(renderer, texture, &srcrect, &dstrect, 0, 0, renderFlip);
 
-        SDL_RenderPresent(renderer);
+            SDL_RenderPresent(renderer);
+        }
     }
 
-    backgroundThread.join();
+    stopRendering();
+    if (backgroundThread.joinable()) {
+        backgroundThread.join();
+    }
 
     SDL_DestroyWindow(window);
     SDL_Quit();
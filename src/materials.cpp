@@ -1,5 +1,20 @@
 struct Material {
     virtual bool scatter(const Ray& rIn, const HitInfo& info, Vec3& attenuation, Ray& scattered) const = 0;
+
+    // Radiance given off by the surface
+    virtual Color emitted() const {
+        return vec3(0, 0, 0);
+    }
+
+    // Reflectance of surfaces that lights are sampled for directly, black for everything else
+    virtual Color diffuseAlbedo() const {
+        return vec3(0, 0, 0);
+    }
+
+    // Color of the surface itself for the denoiser, white for ones without one like glass
+    virtual Color surfaceAlbedo() const {
+        return vec3(1, 1, 1);
+    }
 };
 
 struct Lambertian : public Material {
@@ -7,12 +22,21 @@ struct Lambertian : public Material {
 
     Lambertian(const Color& albedo) : albedo(albedo) {}
 
+    // Cosine distributed around the normal, which the direct light sampling relies on
     virtual bool scatter(const Ray& rIn, const HitInfo& info, Vec3& attenuation, Ray& scattered) const {
-        Vec3 target = info.point + info.normal + randomInUnitSphere();
-        scattered = {info.point, target - info.point};
+        Vec3 target = info.point + info.normal + randomUnitVector();
+        scattered = {info.point, target - info.point, rIn.time};
         attenuation = albedo;
         return true;
     }
+
+    virtual Color diffuseAlbedo() const {
+        return albedo;
+    }
+
+    virtual Color surfaceAlbedo() const {
+        return albedo;
+    }
 };
 
 struct Metal : public Material {
@@ -28,10 +52,14 @@ struct Metal : public Material {
 
     virtual bool scatter(const Ray& rIn, const HitInfo& info, Vec3& attenuation, Ray& scattered) const {
         Vec3 reflected = reflect(HMM_FastNormalize(rIn.d), info.normal);
-        scattered = {info.point, reflected + fuzz * randomInUnitSphere()};
+        scattered = {info.point, reflected + fuzz * randomInUnitSphere(), rIn.time};
         attenuation = albedo;
         return (HMM_Dot(scattered.d, info.normal) > 0);
     }
+
+    virtual Color surfaceAlbedo() const {
+        return albedo;
+    }
 };
 
 struct Dielectric : public Material {
@@ -62,10 +90,43 @@ struct Dielectric : public Material {
             reflectProb = 1.0;
         }
         if (Random.next() < reflectProb) {
-            scattered = {info.point, reflected};
+            scattered = {info.point, reflected, rIn.time};
         } else {
-            scattered = {info.point, refracted};
+            scattered = {info.point, refracted, rIn.time};
         }
         return true;
     }
-};
\ No newline at end of file
+};
+// Emits light and reflects nothing. Spheres made of it are sampled as area lights.
+struct DiffuseLight : public Material {
+    Color emission;
+
+    DiffuseLight(const Color& emission) : emission(emission) {}
+
+    virtual bool scatter(const Ray&, const HitInfo&, Vec3&, Ray&) const {
+        return false;
+    }
+
+    virtual Color emitted() const {
+        return emission;
+    }
+};
+
+static Material*
+makeMaterial(const MaterialDesc& desc) {
+    switch (desc.type) {
+    case MATERIAL_LIGHT: return new DiffuseLight(desc.albedo);
+    case MATERIAL_METAL: return new Metal(desc.albedo, desc.fuzz);
+    case MATERIAL_DIELECTRIC: return new Dielectric(desc.refIdx);
+    default: return new Lambertian(desc.albedo);
+    }
+}
+
+static void
+createMaterials(World& world) {
+    Material** materials = new Material*[world.materialDescs.count];
+    for (size_t i = 0; i < world.materialDescs.count; i++) {
+        materials[i] = makeMaterial(world.materialDescs.members[i]);
+    }
+    world.materials = {materials, world.materialDescs.count};
+}
@@ -8,11 +8,35 @@ struct _Random {
         dist = std::uniform_real_distribution<f32>(0, 1);
     }
 
+    void seed(u64 value) {
+        rng.seed(value);
+        dist.reset();
+    }
+
     f32 next() {
         return dist(rng);
     }
 };
-static _Random Random;
+// One generator per thread, render workers would otherwise all step the same state without a lock
+static thread_local _Random Random;
+
+const u64 SAMPLER_SEED = 0x726f6a75;
+
+// splitmix64 step
+static u64
+mixBits(u64 z) {
+    z += 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Seed for the samples of one pixel starting at sample index firstSample. Reseeding per pixel makes the image
+// the same no matter which thread rendered which tile, so a resumed render matches one that ran through.
+static u64
+samplerSeed(i32 x, i32 y, i32 firstSample) {
+    return mixBits(mixBits(SAMPLER_SEED ^ ((u64)(u32)y << 32 | (u32)x)) + (u32)firstSample);
+}
 
 static Vec3
 randomInUnitSphere() {
@@ -23,6 +47,11 @@ randomInUnitSphere() {
     return p;
 }
 
+static Vec3
+randomUnitVector() {
+    return HMM_FastNormalize(randomInUnitSphere());
+}
+
 static Vec3
 randomInUnitDisk() {
     Vec3 p;
@@ -56,3 +85,18 @@ schlick(f32 cosine, f32 refIdx) {
     r0 = r0 * r0;
     return r0 * (1 - r0) * pow((1 - cosine), 5);
 }
+
+static Vec3
+minVec3(const Vec3& a, const Vec3& b) {
+    return vec3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+static Vec3
+maxVec3(const Vec3& a, const Vec3& b) {
+    return vec3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+static Vec3
+lerpVec3(const Vec3& a, f32 t, const Vec3& b) {
+    return a + t * (b - a);
+}
@@ -0,0 +1,164 @@
+// Merges renders of the same view that were split up by sample range (--sample-range), each an EXR that
+// says which samples it holds. Every pixel becomes the average of the inputs weighted by their sample
+// counts, which is what one render of all the samples would have come out as. Inputs are streamed a row
+// of tiles at a time, so the frame is never in memory more than once per input.
+
+#include <cstdio>
+#include <cmath>
+#include <atomic>
+#include <cstring>
+#include <cassert>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <algorithm>
+#include <utility>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include "HandmadeMath.cpp"
+#include "stb_image_write.cpp"
+
+#include "containers.cpp"
+#include "config.cpp"
+#include "types.cpp"
+#include "deflate.cpp"
+#include "inflate.cpp"
+#include "hdr.cpp"
+
+static void
+printMergeUsage(const char* program) {
+    printf("Usage: %s -o <out.exr> [--exr-compression none|zip] <in.exr>...\n", program);
+}
+
+static bool
+sortedByFirstSample(const ExrReader* a, const ExrReader* b) {
+    return a->range.firstSample < b->range.firstSample;
+}
+
+int
+main(int argc, char** argv) {
+    const char* outputPath = nullptr;
+    ExrCompression compression = EXR_COMPRESSION_ZIP;
+    std::vector<const char*> inputPaths;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (!strcmp(argv[i], "--exr-compression") && i + 1 < argc) {
+            const char* value = argv[++i];
+            if (!strcmp(value, "none")) {
+                compression = EXR_COMPRESSION_NONE;
+            } else if (!strcmp(value, "zip")) {
+                compression = EXR_COMPRESSION_ZIP;
+            } else {
+                printf("Unknown EXR compression %s\n", value);
+                return -1;
+            }
+        } else if (argv[i][0] == '-') {
+            printMergeUsage(argv[0]);
+            return -1;
+        } else {
+            inputPaths.push_back(argv[i]);
+        }
+    }
+    if (!outputPath || inputPaths.empty()) {
+        printMergeUsage(argv[0]);
+        return -1;
+    }
+
+    std::vector<ExrReader> readers(inputPaths.size());
+    for (size_t i = 0; i < readers.size(); i++) {
+        if (!openExr(inputPaths[i], readers[i])) {
+            printf("Couldn't read %s, only EXRs the tracer wrote can be merged\n", inputPaths[i]);
+            return -1;
+        }
+        if (readers[i].range.samples <= 0) {
+            printf("%s doesn't say how many samples it has\n", inputPaths[i]);
+            return -1;
+        }
+        if (readers[i].width != readers[0].width || readers[i].height != readers[0].height) {
+            printf("%s is %dx%d, %s is %dx%d\n", inputPaths[i], readers[i].width, readers[i].height,
+                   inputPaths[0], readers[0].width, readers[0].height);
+            return -1;
+        }
+    }
+
+    // The same sample twice would count it twice. A missing one can't be left out either, the result says it
+    // has one range of samples and merging it again checks against that. Samples are seeded per pass, so a
+    // range that doesn't start on one has other samples than a render of all of them.
+    std::vector<const ExrReader*> sorted;
+    for (const ExrReader& reader : readers) {
+        sorted.push_back(&reader);
+    }
+    std::sort(sorted.begin(), sorted.end(), sortedByFirstSample);
+    i64 totalSamples = 0;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        SampleRange range = sorted[i]->range;
+        printf("%s: samples %d to %d\n", inputPaths[sorted[i] - readers.data()], range.firstSample,
+               range.firstSample + range.samples - 1);
+        totalSamples += range.samples;
+        if (range.firstSample % SAMPLES_PER_PASS != 0) {
+            printf("Sample ranges have to start at a multiple of %d, the samples per pass\n", SAMPLES_PER_PASS);
+            return -1;
+        }
+        if (i + 1 < sorted.size()) {
+            i32 next = sorted[i + 1]->range.firstSample;
+            if (next < range.firstSample + range.samples) {
+                printf("Sample ranges overlap, those samples would be counted twice\n");
+                return -1;
+            } else if (next > range.firstSample + range.samples) {
+                printf("Samples %d to %d are missing, merge the ranges on both sides separately\n",
+                       range.firstSample + range.samples, next - 1);
+                return -1;
+            }
+        }
+    }
+    if (totalSamples > std::numeric_limits<i32>::max()) {
+        printf("Too many samples\n");
+        return -1;
+    }
+
+    i32 width = readers[0].width;
+    i32 height = readers[0].height;
+    ExrWriter writer;
+    SampleRange merged = {sorted[0]->range.firstSample, (i32)totalSamples};
+    if (!beginExr(writer, outputPath, width, height, compression, merged)) {
+        printf("Couldn't write %s\n", outputPath);
+        return -1;
+    }
+    size_t bandSize = (size_t)EXR_TILE_SIZE * width;
+    std::vector<Color> band(bandSize);
+    std::vector<f64> sums(bandSize * 3); // in doubles, there can be lots of inputs
+    std::vector<Color> result(bandSize);
+    for (i32 tileY = 0; tileY < writer.tilesY && writer.ok; tileY++) {
+        std::fill(sums.begin(), sums.end(), 0.0);
+        for (size_t i = 0; i < readers.size(); i++) {
+            if (!readExrTileRow(readers[i], tileY, band.data())) {
+                printf("%s is damaged\n", inputPaths[i]);
+                return -1;
+            }
+            f64 samples = readers[i].range.samples;
+            for (size_t j = 0; j < bandSize; j++) {
+                sums[3 * j + 0] += samples * band[j].r;
+                sums[3 * j + 1] += samples * band[j].g;
+                sums[3 * j + 2] += samples * band[j].b;
+            }
+        }
+        for (size_t j = 0; j < bandSize; j++) {
+            result[j] = vec3((f32)(sums[3 * j + 0] / totalSamples), (f32)(sums[3 * j + 1] / totalSamples),
+                             (f32)(sums[3 * j + 2] / totalSamples));
+        }
+        writeExrTileRow(writer, result.data(), tileY);
+    }
+    for (ExrReader& reader : readers) {
+        closeExr(reader);
+    }
+    if (!endExr(writer)) {
+        printf("Couldn't write %s\n", outputPath);
+        return -1;
+    }
+    printf("Wrote %s with %d samples per pixel\n", outputPath, merged.samples);
+    return 0;
+}
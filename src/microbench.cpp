@@ -0,0 +1,445 @@
+// Microbenchmarks for the kernels the renderer spends its time in, each on fixed-seed inputs.
+// Prints ns per call on one pinned thread and the combined throughput of all pinned threads. Kernels with
+// a version per CPU level (see cpu.cpp) are listed once for every level the CPU has.
+
+#include <cstdio>
+#include <cmath>
+#include <atomic>
+#include <random>
+#include <cstring>
+#include <cassert>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <algorithm>
+#include <utility>
+#include <iostream>
+#include <chrono>
+#include <limits>
+#include <string>
+
+#include "HandmadeMath.cpp"
+#include "stb_image_write.cpp"
+#include "pcg_random.hpp"
+
+#include "containers.cpp"
+#include "config.cpp"
+#include "types.cpp"
+#include "cpu.cpp"
+#include "hugepages.cpp"
+#include "numa.cpp"
+#include "math.cpp"
+#include "trace.cpp"
+#include "deflate.cpp"
+#include "inflate.cpp"
+#include "png.cpp"
+#include "hdr.cpp"
+#include "tonemap.cpp"
+#include "denoise.cpp"
+#include "stats.cpp"
+#include "bvh.cpp"
+#include "hitdetection.cpp"
+#include "kernels.cpp"
+#include "raysort.cpp"
+#include "materials.cpp"
+#include "camera.cpp"
+#include "scene.cpp"
+#include "lights.cpp"
+
+const u64 MICROBENCH_SEED = 0x5eed;
+// Inputs are cycled through, small enough to stay in L2 so the kernels and not memory are measured
+const i32 MICROBENCH_INPUTS = 4096;
+const f64 MICROBENCH_MIN_SECONDS = 0.1;
+const i32 MICROBENCH_REPEATS = 5;
+// Spheres of the scene for the ray sorting kernels, with the BVH about 130 MB, more than caches hold
+const i32 MICROBENCH_LARGE_SPHERES = 2 * 1024 * 1024;
+
+struct MicrobenchInputs {
+    World world;
+    World flatWorld; // same spheres without the BVH
+    Camera camera;
+    std::vector<Ray> rays;
+    std::vector<RayPacket> packets; // camera rays of PACKET_SIZE neighbouring pixels, like the renderer makes
+    std::vector<HitInfo> hits; // where rays hit something
+    std::vector<Ray> hitRays;
+    std::vector<Vec3> directions;
+    std::vector<Vec3> normals;
+    std::vector<f32> cosines;
+    std::vector<Color> colors;
+};
+
+// Results go here so the compiler can't drop the work, per thread so the threads don't contend on it
+static thread_local u64 tSink;
+static std::atomic<u64> gSink;
+
+static MicrobenchInputs
+makeMicrobenchInputs() {
+    MicrobenchInputs inputs;
+    Random.seed(MICROBENCH_SEED);
+    inputs.world = randomScene().world;
+    buildBvh(inputs.world);
+    inputs.flatWorld = inputs.world;
+    inputs.flatWorld.bvh.nodes.count = 0;
+    inputs.camera = makeCamera(vec3(13, 2, 3), vec3(0, 0, 0), vec3(0, 1, 0), 20, float(WIDTH) / float(HEIGHT), 0.1f,
+                               10);
+
+    for (i32 i = 0; i < MICROBENCH_INPUTS; i++) {
+        Ray ray = getScreenRay(inputs.camera, Random.next(), Random.next());
+        inputs.rays.push_back(ray);
+        ClosestHit closest;
+        if (closestHit(inputs.world, ray, 0.001f, std::numeric_limits<f32>::max(), closest)) {
+            HitInfo info;
+            surfaceInteraction(inputs.world, ray, closest, info);
+            inputs.hits.push_back(info);
+            inputs.hitRays.push_back(ray);
+        }
+        inputs.directions.push_back(HMM_FastNormalize(randomInUnitSphere()));
+        inputs.normals.push_back(HMM_FastNormalize(randomInUnitSphere()));
+        inputs.cosines.push_back(Random.next() * 2 - 1);
+        // Mostly in range with some overexposed values, like a real render
+        inputs.colors.push_back(1.5f * vec3(Random.next(), Random.next(), Random.next()));
+    }
+    for (i32 i = 0; i < MICROBENCH_INPUTS / PACKET_SIZE; i++) {
+        RayPacket packet;
+        packet.count = PACKET_SIZE;
+        i32 x = (i32)(Random.next() * (WIDTH - PACKET_SIZE));
+        i32 y = (i32)(Random.next() * HEIGHT);
+        for (i32 k = 0; k < PACKET_SIZE; k++) {
+            packet.rays[k] = getScreenRay(inputs.camera, (x + k + Random.next()) / WIDTH, 1.0f - (y + Random.next()) / HEIGHT);
+        }
+        inputs.packets.push_back(packet);
+    }
+    return inputs;
+}
+
+// Lots of small spheres, and MICROBENCH_INPUTS rays scattered off them in random directions from the part of
+// the view a 64x64 tile covers, like one bounce of a tile's paths
+static void
+makeLargeWorldInputs(World& world, std::vector<Ray>& scattered) {
+    Random.seed(MICROBENCH_SEED);
+    SceneBuilder builder;
+    u32 material = addMaterial(builder, lambertian(vec3(0.5f, 0.5f, 0.5f)));
+    addSphere(builder, vec3(0, -1000, 0), vec3(0, -1000, 0), 1000, material);
+    for (i32 i = 0; i < MICROBENCH_LARGE_SPHERES; i++) {
+        Vec3 center = vec3(160 * Random.next() - 80, 14 * Random.next(), 100 * Random.next() - 80);
+        addSphere(builder, center, center, 0.02f + 0.08f * Random.next(), material);
+    }
+    world = finishScene(builder).world;
+    buildBvh(world);
+
+    Camera camera = makeCamera(vec3(0, 8, 30), vec3(0, 2, 0), vec3(0, 1, 0), 40, float(WIDTH) / float(HEIGHT), 0, 30);
+    while ((i32)scattered.size() < MICROBENCH_INPUTS) {
+        f32 u = 0.5f + 64 * Random.next() / WIDTH;
+        f32 v = 0.5f + 64 * Random.next() / HEIGHT;
+        Ray ray = getScreenRay(camera, u, v);
+        ClosestHit closest;
+        if (closestHit(world, ray, 0.001f, std::numeric_limits<f32>::max(), closest)) {
+            HitInfo info;
+            surfaceInteraction(world, ray, closest, info);
+            scattered.push_back({info.point, info.normal + randomUnitVector(), ray.time});
+        }
+    }
+}
+
+// Runs kernel(threadIndex, iteration) until it took long enough and returns seconds per call, the best
+// of a few repeats. All threads start together and the slowest one counts.
+template <typename F>
+static f64
+measureKernel(i32 nThreads, F kernel) {
+    f64 best = std::numeric_limits<f64>::max();
+    for (i32 repeat = 0; repeat < MICROBENCH_REPEATS; repeat++) {
+        std::vector<f64> seconds(nThreads);
+        std::atomic<i32> ready(0);
+        auto run = [&](i32 threadIndex) {
+            pinThreadToCpu(threadIndex);
+            Random.seed(MICROBENCH_SEED + threadIndex);
+            ready++;
+            while (ready < nThreads) {
+            }
+            u64 calls = 0;
+            u64 batch = 1024;
+            auto start = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> diff;
+            do {
+                for (u64 i = 0; i < batch; i++) {
+                    kernel(threadIndex, (i32)((calls + i) % MICROBENCH_INPUTS));
+                }
+                calls += batch;
+                diff = std::chrono::high_resolution_clock::now() - start;
+            } while (diff.count() < MICROBENCH_MIN_SECONDS);
+            seconds[threadIndex] = diff.count() / calls;
+            gSink += tSink;
+        };
+
+        std::vector<std::thread> threads;
+        for (i32 i = 1; i < nThreads; i++) {
+            threads.emplace_back(run, i);
+        }
+        run(0);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        best = std::min(best, *std::max_element(seconds.begin(), seconds.end()));
+    }
+    return best;
+}
+
+// opsPerCall is for kernels that do a batch of work per call, results are per single op
+template <typename F>
+static void
+runMicrobench(const char* name, i32 nThreads, i32 opsPerCall, F kernel) {
+    f64 single = measureKernel(1, kernel) / opsPerCall;
+    printf("%-28s %10.2f ns %10.2f M/s", name, single * 1e9, 1e-6 / single);
+    if (nThreads > 1) {
+        f64 parallel = measureKernel(nThreads, kernel) / opsPerCall;
+        printf(" %10.2f M/s", nThreads * 1e-6 / parallel);
+    }
+    printf("\n");
+}
+
+static u64
+sinkBits(f32 value) {
+    u32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static u64
+sinkVec3(const Vec3& v) {
+    return sinkBits(v.x) ^ sinkBits(v.y) ^ sinkBits(v.z);
+}
+
+int
+main(int argc, char** argv) {
+    i32 nThreads = (i32)std::max(1u, std::thread::hardware_concurrency());
+    const char* filter = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            nThreads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            printf("Usage: %s [--threads <n>] [--filter <kernel name part>]\n", argv[0]);
+            return -1;
+        }
+    }
+
+#ifndef __OPTIMIZE__
+    printf("Warning: built without optimizations, use CMAKE_BUILD_TYPE=Release for real numbers\n");
+#endif
+    selectCpuKernels(detectCpuLevel());
+    MicrobenchInputs inputs = makeMicrobenchInputs();
+    printf("%d spheres, %d inputs (%d hitting), %d threads, seed %#llx\n", (i32)inputs.world.spheres.count,
+           MICROBENCH_INPUTS, (i32)inputs.hits.size(), nThreads, (unsigned long long)MICROBENCH_SEED);
+    printf("%-28s %13s %12s", "kernel", "1 thread", "");
+    if (nThreads > 1) {
+        printf(" %8s %d threads", "", nThreads);
+    }
+    printf("\n");
+
+    auto wanted = [&](const char* name) { return !filter || strstr(name, filter); };
+    const f32 tMax = std::numeric_limits<f32>::max();
+    i32 hitCount = (i32)inputs.hits.size();
+
+    // The closest hit without the BVH and the surface at it, what a bounce needs
+    if (wanted("hit flat")) {
+        runMicrobench("hit flat", nThreads, 1, [&](i32, i32 i) {
+            ClosestHit closest;
+            if (closestHit(inputs.flatWorld, inputs.rays[i], 0.001f, tMax, closest)) {
+                HitInfo info;
+                surfaceInteraction(inputs.flatWorld, inputs.rays[i], closest, info);
+                tSink += sinkVec3(info.normal);
+            }
+        });
+    }
+    // Kernels with a version per CpuLevel are run at every level this CPU has
+    CpuKernels levelKernels[CPU_LEVEL_COUNT];
+    i32 levelCount = detectCpuLevel() + 1;
+    for (i32 level = 0; level < levelCount; level++) {
+        levelKernels[level] = cpuKernels((CpuLevel)level);
+    }
+    char name[64];
+    for (i32 level = 0; level < levelCount; level++) {
+        snprintf(name, sizeof(name), "hit bvh %s", CPU_LEVEL_NAMES[level]);
+        if (wanted(name)) {
+            runMicrobench(name, nThreads, 1, [&](i32, i32 i) {
+                ClosestHit closest;
+                tSink += levelKernels[level].closestHitBvh(inputs.world, inputs.rays[i], 0.001f, tMax, closest);
+            });
+        }
+    }
+    // Per ray, the packets' rays one at a time and then as packets
+    i32 packetCount = (i32)inputs.packets.size();
+    for (i32 level = 0; level < levelCount; level++) {
+        snprintf(name, sizeof(name), "camera rays single %s", CPU_LEVEL_NAMES[level]);
+        if (wanted(name)) {
+            runMicrobench(name, nThreads, PACKET_SIZE, [&](i32, i32 i) {
+                const RayPacket& packet = inputs.packets[i % packetCount];
+                for (i32 k = 0; k < PACKET_SIZE; k++) {
+                    ClosestHit closest;
+                    tSink += levelKernels[level].closestHitBvh(inputs.world, packet.rays[k], 0.001f, tMax, closest);
+                }
+            });
+        }
+        snprintf(name, sizeof(name), "camera rays packet %s", CPU_LEVEL_NAMES[level]);
+        if (levelKernels[level].closestHitPacket && wanted(name)) {
+            runMicrobench(name, nThreads, PACKET_SIZE, [&](i32, i32 i) {
+                ClosestHit hits[PACKET_SIZE];
+                levelKernels[level].closestHitPacket(inputs.world, inputs.packets[i % packetCount], 0.001f, tMax, hits);
+                tSink += hits[0].primitive;
+            });
+        }
+    }
+    for (i32 level = 0; level < levelCount; level++) {
+        snprintf(name, sizeof(name), "occluded bvh %s", CPU_LEVEL_NAMES[level]);
+        if (wanted(name)) {
+            runMicrobench(name, nThreads, 1, [&](i32, i32 i) {
+                tSink += levelKernels[level].occludedBvh(inputs.world, inputs.rays[i], 0.001f, tMax);
+            });
+        }
+    }
+
+    // The same scattered rays traced in the order they were made and sorted by raysort.cpp, per ray. Sorting
+    // is per ray of a batch of MICROBENCH_INPUTS.
+    if (wanted("scattered rays") || wanted("sort rays")) {
+        World largeWorld;
+        std::vector<Ray> scattered;
+        makeLargeWorldInputs(largeWorld, scattered);
+        RaySortSpace space = makeRaySortSpace(largeWorld);
+        std::vector<u32> order(scattered.size());
+        std::vector<u64> keys;
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = (u32)i;
+        }
+        sortRays(scattered.data(), order, keys, space);
+        std::vector<Ray> sorted;
+        for (u32 index : order) {
+            sorted.push_back(scattered[index]);
+        }
+        printf("%d spheres for the scattered rays\n", (i32)largeWorld.spheres.count);
+        if (wanted("scattered rays unsorted")) {
+            runMicrobench("scattered rays unsorted", nThreads, 1, [&](i32, i32 i) {
+                ClosestHit closest;
+                tSink += closestHit(largeWorld, scattered[i], 0.001f, tMax, closest);
+            });
+        }
+        if (wanted("scattered rays sorted")) {
+            runMicrobench("scattered rays sorted", nThreads, 1, [&](i32, i32 i) {
+                ClosestHit closest;
+                tSink += closestHit(largeWorld, sorted[i], 0.001f, tMax, closest);
+            });
+        }
+        std::vector<std::vector<u32>> sortOrders(nThreads, order);
+        std::vector<std::vector<u64>> sortKeys(nThreads);
+        if (wanted("sort rays")) {
+            runMicrobench("sort rays", nThreads, 1, [&](i32 thread, i32 i) {
+                if (i == 0) {
+                    sortRays(scattered.data(), sortOrders[thread], sortKeys[thread], space);
+                }
+                tSink += sortOrders[thread][i];
+            });
+        }
+    }
+
+    Lambertian lambertian(vec3(0.5f, 0.5f, 0.5f));
+    Metal metal(vec3(0.7f, 0.6f, 0.5f), 0.3f);
+    Dielectric dielectric(1.5f);
+    const char* scatterNames[3] = {"scatter lambertian", "scatter metal", "scatter dielectric"};
+    const Material* materials[3] = {&lambertian, &metal, &dielectric};
+    for (i32 m = 0; m < 3 && hitCount > 0; m++) {
+        if (wanted(scatterNames[m])) {
+            runMicrobench(scatterNames[m], nThreads, 1, [&](i32, i32 i) {
+                i %= hitCount;
+                Vec3 attenuation;
+                Ray scattered;
+                materials[m]->scatter(inputs.hitRays[i], inputs.hits[i], attenuation, scattered);
+                tSink += sinkVec3(scattered.d);
+            });
+        }
+    }
+
+    if (wanted("randomInUnitSphere")) {
+        runMicrobench("randomInUnitSphere", nThreads, 1, [&](i32, i32) { tSink += sinkVec3(randomInUnitSphere()); });
+    }
+    if (wanted("refract")) {
+        runMicrobench("refract", nThreads, 1, [&](i32, i32 i) {
+            Vec3 refracted = vec3(0, 0, 0);
+            refract(inputs.directions[i], inputs.normals[i], 1.0f / 1.5f, refracted);
+            tSink += sinkVec3(refracted);
+        });
+    }
+    if (wanted("schlick")) {
+        runMicrobench("schlick", nThreads, 1, [&](i32, i32 i) {
+            tSink += sinkBits(schlick(fabsf(inputs.cosines[i]), 1.5f));
+        });
+    }
+    if (wanted("getScreenRay")) {
+        runMicrobench("getScreenRay", nThreads, 1, [&](i32, i32 i) {
+            Ray ray = getScreenRay(inputs.camera, inputs.cosines[i], inputs.cosines[(i + 1) % MICROBENCH_INPUTS]);
+            tSink += sinkVec3(ray.d);
+        });
+    }
+    if (wanted("makeColor32")) {
+        runMicrobench("makeColor32", nThreads, 1, [&](i32, i32 i) {
+            tSink += makeColor32(inputs.colors[i]).value;
+        });
+    }
+
+    // Tonemapping works on spans, reported per pixel over rows of 64 pixels
+    const i32 span = 64;
+    std::vector<std::vector<Color32>> spanOutputs(nThreads, std::vector<Color32>(span));
+    TonemapSettings settings;
+    settings.curve = TONEMAP_ACES;
+    auto runTonemap = [&](const char* name, void (*spanFunction)(const Color*, Color32*, i32, const TonemapSettings&)) {
+        if (wanted(name)) {
+            runMicrobench(name, nThreads, span, [&](i32 thread, i32 i) {
+                i32 first = (i * span) % (MICROBENCH_INPUTS - span);
+                spanFunction(inputs.colors.data() + first, spanOutputs[thread].data(), span, settings);
+                tSink += spanOutputs[thread][0].value;
+            });
+        }
+    };
+    for (i32 level = 0; level < levelCount; level++) {
+        snprintf(name, sizeof(name), "tonemap aces %s", CPU_LEVEL_NAMES[level]);
+        runTonemap(name, levelKernels[level].tonemapSpan);
+    }
+
+    // One pass of the denoiser over rows of a 128x128 image with noisy colors, per pixel
+    const i32 denoiseSize = 128;
+    std::vector<f32> denoisePlanes[11];
+    for (std::vector<f32>& plane : denoisePlanes) {
+        for (i32 i = 0; i < denoiseSize * denoiseSize; i++) {
+            plane.push_back(Random.next());
+        }
+    }
+    std::vector<std::vector<f32>> denoiseOutputs(nThreads, std::vector<f32>(4 * denoiseSize * denoiseSize));
+    auto runDenoise = [&](const char* name, void (*rowFunction)(const DenoisePass&, i32, i32, i32)) {
+        if (wanted(name)) {
+            runMicrobench(name, nThreads, denoiseSize, [&](i32 thread, i32 i) {
+                DenoisePass pass = {denoiseSize, denoiseSize, 4};
+                for (i32 k = 0; k < 3; k++) {
+                    pass.color[k] = denoisePlanes[k].data();
+                    pass.normal[k] = denoisePlanes[3 + k].data();
+                    pass.albedo[k] = denoisePlanes[6 + k].data();
+                    pass.outColor[k] = denoiseOutputs[thread].data() + k * denoiseSize * denoiseSize;
+                }
+                pass.variance = denoisePlanes[9].data();
+                pass.outVariance = denoiseOutputs[thread].data() + 3 * denoiseSize * denoiseSize;
+                pass.normalWeight = DENOISE_NORMAL_WEIGHT;
+                for (i32 j = 0; j < 25; j++) {
+                    pass.kernel[j] = 1.0f / 25;
+                }
+                i32 y = i % denoiseSize;
+                rowFunction(pass, y, 0, denoiseSize);
+                tSink += sinkBits(pass.outColor[0][y * denoiseSize]);
+            });
+        }
+    };
+    for (i32 level = 0; level < levelCount; level++) {
+        snprintf(name, sizeof(name), "denoise pass %s", CPU_LEVEL_NAMES[level]);
+        runDenoise(name, levelKernels[level].denoisePixels);
+    }
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+// Placement of the render workers and their memory on machines with more than one NUMA node. With --numa
+// every worker is pinned to a CPU of its own, every node gets a band of framebuffer rows in its own memory
+// and its workers take the tiles of that band first. --numa-replicate also gives every node its own copy of
+// the spheres and the BVH, which every ray reads. The topology comes from sysfs and memory is placed with
+// mbind, so there's no libnuma to link. Anywhere else it's all one node and nothing is pinned.
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const i32 NUMA_MAX_NODES = 64;
+// Highest node number the kernel's mask can hold, what mbind gets its mask sized for
+const i32 NUMA_MAX_NODE_ID = 1024;
+
+struct NumaTopology {
+    i32 nodeCount = 1;
+    bool knowsNodes = false; // false where there's no sysfs, memory isn't placed then
+    i32 nodeIds[NUMA_MAX_NODES] = {}; // the kernel's number of each node, those can have gaps
+    // CPUs this process may run on, node after node, and the node of each
+    std::vector<i32> cpus;
+    std::vector<i32> cpuNodes;
+};
+
+// Filled by detectNumaTopology() with --numa, the default is one node and no pinning
+static NumaTopology gNuma;
+
+// Parses sysfs lists like 0-3,8,10-11
+static std::vector<i32>
+parseIdList(const char* text) {
+    std::vector<i32> ids;
+    const char* p = text;
+    for (;;) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long id = first; id <= last; id++) {
+            ids.push_back((i32)id);
+        }
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+    return ids;
+}
+
+#ifdef __linux__
+static std::vector<i32>
+readIdList(const char* path) {
+    char text[4096] = {};
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return {};
+    }
+    size_t size = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[size] = 0;
+    return parseIdList(text);
+}
+#endif
+
+// Nodes with CPUs this process may run on, numactl --cpunodebind and taskset are respected
+static NumaTopology
+detectNumaTopology() {
+    NumaTopology topology;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return topology;
+    }
+    i32 nodeCount = 0;
+    for (i32 id : readIdList("/sys/devices/system/node/online")) {
+        if (nodeCount == NUMA_MAX_NODES || id >= NUMA_MAX_NODE_ID) {
+            break;
+        }
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        bool used = false;
+        for (i32 cpu : readIdList(path)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                topology.cpus.push_back(cpu);
+                topology.cpuNodes.push_back(nodeCount);
+                used = true;
+            }
+        }
+        // Nodes with only memory or none of our CPUs get no workers
+        if (used) {
+            topology.nodeIds[nodeCount++] = id;
+        }
+    }
+    if (nodeCount > 0) {
+        topology.nodeCount = nodeCount;
+        topology.knowsNodes = true;
+        return topology;
+    }
+    // No sysfs, one node of all allowed CPUs
+    topology.cpus.clear();
+    topology.cpuNodes.clear();
+    for (i32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            topology.cpus.push_back(cpu);
+            topology.cpuNodes.push_back(0);
+        }
+    }
+#endif
+    return topology;
+}
+
+static void
+pinThreadToCpu(i32 cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+// Pins render worker number worker to a CPU of its own and returns the node it's on. Workers go through the
+// CPUs node after node, without --numa they stay unpinned on node 0.
+static i32
+pinRenderWorker(i32 worker) {
+    if (gNuma.cpus.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)worker % gNuma.cpus.size();
+    pinThreadToCpu(gNuma.cpus[i]);
+    return gNuma.cpuNodes[i];
+}
+
+// Render workers to start, with --numa one for every CPU pinRenderWorker() pins them to so no two share one.
+// hardware_concurrency() doesn't know about numactl or taskset.
+static u32
+renderWorkerCount() {
+    if (!gNuma.cpus.empty()) {
+        return (u32)gNuma.cpus.size();
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Node whose band of framebuffer rows y is in
+static i32
+numaNodeOfRow(i32 y, i32 height) {
+    return (i32)((i64)y * gNuma.nodeCount / height);
+}
+
+// Moves the pages of [data, data + size) to the node and keeps new ones there while it has memory. Pages only
+// partly in the range are left alone, they belong to the neighbours as much as to this.
+static bool
+bindToNumaNode(void* data, size_t size, i32 node) {
+#ifdef __linux__
+    if (!gNuma.knowsNodes) {
+        return false;
+    }
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)data + page - 1) / page * page;
+    uintptr_t end = ((uintptr_t)data + size) / page * page;
+    if (end <= begin) {
+        return true;
+    }
+    const i32 maskBits = 8 * sizeof(unsigned long);
+    unsigned long mask[NUMA_MAX_NODE_ID / maskBits] = {};
+    i32 id = gNuma.nodeIds[node];
+    mask[id / maskBits] = 1ul << (id % maskBits);
+    // The kernel takes one bit less than maxnode
+    return syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, mask, NUMA_MAX_NODE_ID + 1, MPOL_MF_MOVE) == 0;
+#else
+    (void)data;
+    (void)size;
+    (void)node;
+    return false;
+#endif
+}
+
+// Every node's band of rows of an image with rowBytes per row
+static bool
+bindRowsToNumaNodes(void* data, size_t rowBytes, i32 height) {
+    if (!data) {
+        return true;
+    }
+    bool bound = true;
+    for (i32 node = 0; node < gNuma.nodeCount; node++) {
+        // First and one past the last row numaNodeOfRow() puts on this node
+        i64 first = ((i64)node * height + gNuma.nodeCount - 1) / gNuma.nodeCount;
+        i64 last = ((i64)(node + 1) * height + gNuma.nodeCount - 1) / gNuma.nodeCount;
+        bound &= bindToNumaNode((u8*)data + first * rowBytes, (last - first) * rowBytes, node);
+    }
+    return bound;
+}
+
+static bool
+bindFramebufferToNumaNodes(const Framebuffer& framebuffer) {
+    i32 width = framebuffer.width;
+    i32 height = framebuffer.height;
+    bool bound = bindRowsToNumaNodes(framebuffer.color, width * sizeof(Color), height);
+    bound &= bindRowsToNumaNodes(framebuffer.pixels, width * sizeof(Color32), height);
+    bound &= bindRowsToNumaNodes(framebuffer.albedo, width * sizeof(Color), height);
+    bound &= bindRowsToNumaNodes(framebuffer.normal, width * sizeof(Vec3), height);
+    bound &= bindRowsToNumaNodes(framebuffer.luminanceSquared, width * sizeof(f32), height);
+    bound &= bindRowsToNumaNodes(framebuffer.depth, width * sizeof(f32), height);
+    bound &= bindRowsToNumaNodes(framebuffer.materialId, width * sizeof(i32), height);
+    bound &= bindRowsToNumaNodes(framebuffer.primitiveId, width * sizeof(i32), height);
+    return bound;
+}
+
+// Memory on the node, on huge pages when they're on, left allocated for the rest of the run. Where memory
+// can't be placed it's wherever the first write puts it.
+static void*
+allocateOnNumaNode(size_t size, i32 node) {
+    void* data = mapPages(std::max<size_t>(size, 1));
+    if (data) {
+        // Before anything touches it, so the pages are made on the node right away
+        bindToNumaNode(data, size, node);
+    }
+    return data;
+}
+
+// Copies of the world with node local spheres and BVH, the rest of them points to the original
+static World gNumaWorlds[NUMA_MAX_NODES];
+static const World* gNumaSourceWorld;
+
+static bool
+replicateWorldOnNumaNodes(const World& world) {
+    for (i32 node = 0; node < gNuma.nodeCount; node++) {
+        World replica = world;
+        size_t sphereBytes = world.spheres.count * sizeof(Sphere);
+        size_t nodeBytes = world.bvh.nodes.count * sizeof(BvhNode);
+        replica.spheres.members = (Sphere*)allocateOnNumaNode(sphereBytes, node);
+        replica.bvh.nodes.members = (BvhNode*)allocateOnNumaNode(nodeBytes, node);
+        if (!replica.spheres.members || !replica.bvh.nodes.members) {
+            return false;
+        }
+        memcpy(replica.spheres.members, world.spheres.members, sphereBytes);
+        memcpy(replica.bvh.nodes.members, world.bvh.nodes.members, nodeBytes);
+        gNumaWorlds[node] = replica;
+    }
+    gNumaSourceWorld = &world;
+    return true;
+}
+
+// The node's copy of world when it was replicated
+static World*
+numaLocalWorld(World* world, i32 node) {
+    return world == gNumaSourceWorld ? &gNumaWorlds[node] : world;
+}
@@ -0,0 +1,238 @@
+// Command line options, defaults come from config.cpp
+struct Options {
+    const char* outputPath = "render.png";
+    int pngLevel = PNG_COMPRESSION_LEVEL;
+    const char* floatOutputPath = nullptr;
+    ExrCompression exrCompression = EXR_COMPRESSION_ZIP;
+    TonemapSettings tonemap;
+    bool denoise = false;
+    CpuLevel cpuLevel = CPU_LEVEL_COUNT; // this for the widest the CPU has
+    bool sortRays = false;
+    bool numa = false;
+    bool numaReplicate = false;
+    HugePageMode hugePages = HUGE_PAGES_OFF;
+    const char* aovOutputPath = nullptr;
+    int displayFps = DISPLAY_FPS;
+    bool writeStats = false;
+    const char* tracePath = nullptr;
+    int benchmarkRuns = 0;
+    bool perfCounters = false;
+    const char* scenePath = nullptr;
+    const char* exportScenePath = nullptr;
+    u64 sceneSeed = 0;
+    const char* bvhCacheDirectory = nullptr;
+    SampleRange sampleRange = {0, SUBSTEPS};
+    bool headless = false;
+    const char* checkpointPath = nullptr;
+    f64 checkpointInterval = CHECKPOINT_INTERVAL;
+    int coordinatorPort = 0;
+    const char* workerAddress = nullptr;
+};
+
+static void
+printUsage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --scene <path>         Scene text file or scene cache, without one it's the random scene\n");
+    printf("  --export-scene <path>  Write the loaded scene out in the text format\n");
+    printf("  --seed <n>             Seed for the random scene, 0 makes a new one every run (default 0)\n");
+    printf("  --bvh-cache <dir>      Keep built BVHs in this directory and reuse them for the same scene\n");
+    printf("  -o, --output <path>    PNG output path (default render.png)\n");
+    printf("  --png-level <0-9>      PNG compression, 0 stores, 1 is fast (default %d)\n", PNG_COMPRESSION_LEVEL);
+    printf("  --float-output <path>  Also write the linear float image, .exr, .pfm or .hdr\n");
+    printf("  --exr-compression <c>  none or zip (default zip)\n");
+    printf("  --exposure <stops>     Exposure applied before tonemapping (default 0)\n");
+    printf("  --tonemap <curve>      gamma2, srgb or aces (default gamma2)\n");
+    printf("  --denoise              Denoise the PNG, the float image stays as rendered\n");
+    printf("  --aov-output <path>    Also write depth, normal, albedo, material and primitive id images,\n"
+           "                         <path> with the AOV's name before the .exr or .pfm\n");
+    printf("  --fps <n>              Window frame rate limit, 0 follows the display (default %d)\n", DISPLAY_FPS);
+    printf("  --stats                Write per tile cost as a heatmap, CSV and JSON next to the output\n");
+    printf("  --trace <path>         Write a Chrome trace_event timeline of all threads, for Perfetto\n");
+    printf("  --benchmark <runs>     Render the start view this many times without a window and report timings\n");
+    printf("  --perf                 With --benchmark, also count cycles, cache, TLB and branch misses (Linux)\n");
+    printf("  --cpu <level>          Widest kernels, baseline, avx2 or avx512 (default what the CPU has)\n");
+    printf("  --sort-rays            Trace tiles in batches and sort their bounces by direction and origin\n");
+    printf("  --numa                 Pin the render threads and keep every NUMA node's tiles in its own memory\n");
+    printf("  --numa-replicate       Like --numa, and give every node its own copy of the scene and BVH\n");
+    printf("  --huge-pages <kind>    Scene, BVH and framebuffer on 2MB pages, transparent or explicit (Linux)\n");
+    printf("  --headless             Render the start view once without a window, save it and quit\n");
+    printf("  --sample-range <f:n>   Render the n samples per pixel from index f on (default 0:%d)\n", SUBSTEPS);
+    printf("  --checkpoint <path>    Save progress there now and then and resume from it when it's there\n");
+    printf("  --checkpoint-interval <s>  Seconds between checkpoints (default %.0f)\n", CHECKPOINT_INTERVAL);
+    printf("  --coordinator <port>   Render one frame on the workers that connect to this port and save it\n");
+    printf("  --worker <host:port>   Render tiles for the coordinator there, the scene comes from it\n");
+}
+
+static bool
+parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && value) {
+            options.outputPath = value;
+            i++;
+        } else if (!strcmp(arg, "--scene") && value) {
+            options.scenePath = value;
+            i++;
+        } else if (!strcmp(arg, "--export-scene") && value) {
+            options.exportScenePath = value;
+            i++;
+        } else if (!strcmp(arg, "--seed") && value) {
+            options.sceneSeed = strtoull(value, nullptr, 0);
+            i++;
+        } else if (!strcmp(arg, "--bvh-cache") && value) {
+            options.bvhCacheDirectory = value;
+            i++;
+        } else if (!strcmp(arg, "--png-level") && value) {
+            options.pngLevel = atoi(value);
+            i++;
+            if (options.pngLevel < 0 || options.pngLevel > 9) {
+                printf("PNG level has to be between 0 and 9\n");
+                return false;
+            }
+        } else if (!strcmp(arg, "--float-output") && value) {
+            options.floatOutputPath = value;
+            i++;
+        } else if (!strcmp(arg, "--exr-compression") && value) {
+            if (!strcmp(value, "none")) {
+                options.exrCompression = EXR_COMPRESSION_NONE;
+            } else if (!strcmp(value, "zip")) {
+                options.exrCompression = EXR_COMPRESSION_ZIP;
+            } else {
+                printf("Unknown EXR compression %s\n", value);
+                return false;
+            }
+            i++;
+        } else if (!strcmp(arg, "--exposure") && value) {
+            options.tonemap.exposure = (f32)atof(value);
+            i++;
+        } else if (!strcmp(arg, "--tonemap") && value) {
+            i32 curve = 0;
+            while (curve < TONEMAP_CURVE_COUNT && strcmp(value, TONEMAP_CURVE_NAMES[curve])) {
+                curve++;
+            }
+            if (curve == TONEMAP_CURVE_COUNT) {
+                printf("Unknown tonemap curve %s\n", value);
+                return false;
+            }
+            options.tonemap.curve = (TonemapCurve)curve;
+            i++;
+        } else if (!strcmp(arg, "--fps") && value) {
+            options.displayFps = std::max(0, atoi(value));
+            i++;
+        } else if (!strcmp(arg, "--stats")) {
+            if (!RENDER_STATS) {
+                printf("Render stats are disabled in config.cpp\n");
+                return false;
+            }
+            options.writeStats = true;
+        } else if (!strcmp(arg, "--trace") && value) {
+            options.tracePath = value;
+            i++;
+        } else if (!strcmp(arg, "--benchmark") && value) {
+            options.benchmarkRuns = atoi(value);
+            i++;
+            if (options.benchmarkRuns < 1) {
+                printf("Benchmark needs at least one run\n");
+                return false;
+            }
+        } else if (!strcmp(arg, "--perf")) {
+            options.perfCounters = true;
+        } else if (!strcmp(arg, "--denoise")) {
+            options.denoise = true;
+        } else if (!strcmp(arg, "--aov-output") && value) {
+            options.aovOutputPath = value;
+            i++;
+            if (!hasExtension(value, ".exr") && !hasExtension(value, ".pfm")) {
+                printf("AOVs can only be written as .exr or .pfm\n");
+                return false;
+            }
+        } else if (!strcmp(arg, "--cpu") && value) {
+            if (!parseCpuLevel(value, options.cpuLevel)) {
+                printf("Unknown CPU level %s, use baseline, avx2 or avx512\n", value);
+                return false;
+            }
+            i++;
+        } else if (!strcmp(arg, "--sort-rays")) {
+            options.sortRays = true;
+        } else if (!strcmp(arg, "--numa")) {
+            options.numa = true;
+        } else if (!strcmp(arg, "--numa-replicate")) {
+            options.numa = true;
+            options.numaReplicate = true;
+        } else if (!strcmp(arg, "--huge-pages") && value) {
+            if (!strcmp(value, "transparent")) {
+                options.hugePages = HUGE_PAGES_TRANSPARENT;
+            } else if (!strcmp(value, "explicit")) {
+                options.hugePages = HUGE_PAGES_EXPLICIT;
+            } else {
+                printf("Unknown huge page kind %s, use transparent or explicit\n", value);
+                return false;
+            }
+            i++;
+        } else if (!strcmp(arg, "--headless")) {
+            options.headless = true;
+        } else if (!strcmp(arg, "--sample-range") && value) {
+            if (sscanf(value, "%d:%d", &options.sampleRange.firstSample, &options.sampleRange.samples) != 2 ||
+                options.sampleRange.firstSample < 0 || options.sampleRange.samples < 1) {
+                printf("Sample range has to be <first sample>:<count>, like 0:%d\n", SUBSTEPS);
+                return false;
+            }
+            // Samples are seeded per pass, a range starting elsewhere wouldn't have the samples of the same
+            // range in a render of more
+            if (options.sampleRange.firstSample % SAMPLES_PER_PASS != 0) {
+                printf("Sample ranges have to start at a multiple of %d, the samples per pass\n", SAMPLES_PER_PASS);
+                return false;
+            }
+            i++;
+        } else if (!strcmp(arg, "--checkpoint") && value) {
+            options.checkpointPath = value;
+            i++;
+        } else if (!strcmp(arg, "--checkpoint-interval") && value) {
+            options.checkpointInterval = atof(value);
+            i++;
+        } else if (!strcmp(arg, "--coordinator") && value) {
+            options.coordinatorPort = atoi(value);
+            i++;
+            if (options.coordinatorPort <= 0 || options.coordinatorPort > 65535) {
+                printf("Coordinator port has to be between 1 and 65535\n");
+                return false;
+            }
+        } else if (!strcmp(arg, "--worker") && value) {
+            options.workerAddress = value;
+            i++;
+        } else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    if (options.perfCounters && options.benchmarkRuns == 0) {
+        printf("--perf only works together with --benchmark\n");
+        return false;
+    }
+    if ((options.coordinatorPort > 0) + (options.workerAddress != nullptr) + (options.benchmarkRuns > 0) +
+            options.headless >
+        1) {
+        printf("--coordinator, --worker, --benchmark and --headless don't go together\n");
+        return false;
+    }
+    if (options.denoise && options.coordinatorPort > 0) {
+        printf("--denoise doesn't work with --coordinator, workers only send back colors\n");
+        return false;
+    }
+    if (options.aovOutputPath && options.coordinatorPort > 0) {
+        printf("--aov-output doesn't work with --coordinator, workers only send back colors\n");
+        return false;
+    }
+    if (options.numa && (options.coordinatorPort > 0 || options.workerAddress)) {
+        printf("--numa only works for renders on this machine\n");
+        return false;
+    }
+    if (options.checkpointPath && (options.coordinatorPort > 0 || options.workerAddress || options.benchmarkRuns > 0)) {
+        printf("--checkpoint only works for renders in the window or --headless\n");
+        return false;
+    }
+    return true;
+}
+
+static Options gOptions;
@@ -0,0 +1,159 @@
+// Hardware performance counters for benchmark mode through Linux perf_event_open, no profiler needed.
+// Every render worker counts its own thread in user space and adds the result to the totals when it's
+// done. Counters the CPU, the VM or perf_event_paranoid don't allow are reported as unavailable.
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_TASK_CLOCK,
+    PERF_COUNTER_COUNT,
+};
+
+static const char* PERF_COUNTER_NAMES[PERF_COUNTER_COUNT] = {
+    "cycles", "instructions", "L1D misses", "LLC misses", "dTLB misses", "branch misses", "task clock ns",
+};
+
+struct PerfCounterValues {
+    u64 values[PERF_COUNTER_COUNT];
+    u32 threads[PERF_COUNTER_COUNT]; // how many threads managed to count each one
+};
+
+struct PerfCounterGroup {
+    int fds[PERF_COUNTER_COUNT];
+};
+
+static std::atomic<bool> gPerfCountersEnabled;
+static std::mutex gPerfTotalsMutex;
+static PerfCounterValues gPerfTotals;
+
+#ifdef __linux__
+static void
+perfEventAttr(perf_event_attr& attr, PerfCounter counter) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (counter) {
+    case PERF_CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+    case PERF_INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+    case PERF_L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case PERF_LLC_MISSES: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+    case PERF_DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case PERF_BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+    case PERF_TASK_CLOCK:
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_TASK_CLOCK;
+        break;
+    default: break;
+    }
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Scaled by enabled / running time when the PMU has to multiplex
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+}
+#endif
+
+// Starts counting the calling thread. The first counter that opens leads the group so they all run together.
+static void
+startPerfCounters(PerfCounterGroup& group) {
+    int leader = -1;
+    for (i32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        group.fds[i] = -1;
+#ifdef __linux__
+        perf_event_attr attr;
+        perfEventAttr(attr, (PerfCounter)i);
+        group.fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (group.fds[i] < 0 && leader >= 0) {
+            // Some PMUs can't schedule everything at once, count it on its own then
+            group.fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        if (leader < 0) {
+            leader = group.fds[i];
+        }
+#endif
+    }
+#ifdef __linux__
+    for (i32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (group.fds[i] >= 0) {
+            ioctl(group.fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(group.fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+// Stops counting and adds what the thread counted to the totals
+static void
+stopPerfCounters(PerfCounterGroup& group) {
+    PerfCounterValues values = {};
+#ifdef __linux__
+    for (i32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (group.fds[i] >= 0) {
+            ioctl(group.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (i32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (group.fds[i] < 0) {
+            continue;
+        }
+        u64 data[3]; // value, time enabled, time running
+        if (read(group.fds[i], data, sizeof(data)) == (ssize_t)sizeof(data) && data[2] > 0) {
+            values.values[i] = data[2] < data[1] ? (u64)((f64)data[0] * data[1] / data[2]) : data[0];
+            values.threads[i] = 1;
+        }
+        close(group.fds[i]);
+        group.fds[i] = -1;
+    }
+#endif
+
+    std::lock_guard<std::mutex> lockGuard(gPerfTotalsMutex);
+    for (i32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        gPerfTotals.values[i] += values.values[i];
+        gPerfTotals.threads[i] += values.threads[i];
+    }
+}
+
+static PerfCounterValues
+takePerfCounterTotals() {
+    std::lock_guard<std::mutex> lockGuard(gPerfTotalsMutex);
+    PerfCounterValues result = gPerfTotals;
+    gPerfTotals = {};
+    return result;
+}
+
+static void
+printPerfCounters(const PerfCounterValues& counters, u64 rays) {
+    for (i32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters.threads[i] == 0) {
+            printf("  %-14s unavailable\n", PERF_COUNTER_NAMES[i]);
+        } else if (rays > 0) {
+            printf("  %-14s %16llu  %10.2f per ray\n", PERF_COUNTER_NAMES[i], (unsigned long long)counters.values[i],
+                   (f64)counters.values[i] / rays);
+        } else {
+            printf("  %-14s %16llu\n", PERF_COUNTER_NAMES[i], (unsigned long long)counters.values[i]);
+        }
+    }
+    if (counters.threads[PERF_CYCLES] > 0 && counters.threads[PERF_INSTRUCTIONS] > 0 &&
+        counters.values[PERF_CYCLES] > 0) {
+        printf("  IPC            %16.2f\n", (f64)counters.values[PERF_INSTRUCTIONS] / counters.values[PERF_CYCLES]);
+    }
+}
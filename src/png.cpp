@@ -0,0 +1,181 @@
+// Parallel PNG writer. The image is cut into horizontal strips that are filtered and deflated on their own
+// threads, each strip becoming one IDAT chunk. The zlib header goes in front of the first strip and the
+// combined adler32 in a last small IDAT chunk, so the chunks together form a single valid zlib stream.
+
+const i32 PNG_BYTES_PER_PIXEL = 3;
+const i32 PNG_MIN_STRIP_BYTES = 128 * 1024;
+
+struct PngStrip {
+    std::vector<u8> chunk;
+    u32 adler;
+    size_t filteredSize;
+};
+
+static u8
+paethPredictor(i32 a, i32 b, i32 c) {
+    i32 p = a + b - c;
+    i32 pa = abs(p - a);
+    i32 pb = abs(p - b);
+    i32 pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return (u8)a;
+    }
+    return (u8)(pb <= pc ? b : c);
+}
+
+static void
+filterPngRow(u8* out, const u8* row, const u8* prevRow, i32 rowBytes, i32 filter) {
+    const i32 bpp = PNG_BYTES_PER_PIXEL;
+    for (i32 i = 0; i < rowBytes; i++) {
+        i32 a = i >= bpp ? row[i - bpp] : 0;
+        i32 b = prevRow[i];
+        i32 c = i >= bpp ? prevRow[i - bpp] : 0;
+        switch (filter) {
+        case 0: out[i] = row[i]; break;
+        case 1: out[i] = (u8)(row[i] - a); break;
+        case 2: out[i] = (u8)(row[i] - b); break;
+        case 3: out[i] = (u8)(row[i] - ((a + b) >> 1)); break;
+        case 4: out[i] = (u8)(row[i] - paethPredictor(a, b, c)); break;
+        }
+    }
+}
+
+// Picks the filter with the smallest sum of absolute values, same heuristic as libpng and stb
+static void
+filterPngRowAdaptive(u8* out, u8* scratch, const u8* row, const u8* prevRow, i32 rowBytes) {
+    i32 bestSum = std::numeric_limits<i32>::max();
+    for (i32 filter = 0; filter < 5; filter++) {
+        filterPngRow(scratch, row, prevRow, rowBytes, filter);
+        i32 sum = 0;
+        for (i32 i = 0; i < rowBytes; i++) {
+            sum += abs((i8)scratch[i]);
+        }
+        if (sum < bestSum) {
+            bestSum = sum;
+            out[0] = (u8)filter;
+            memcpy(out + 1, scratch, rowBytes);
+        }
+    }
+}
+
+static void
+packPngRow(u8* out, const Color32* pixels, i32 width) {
+    for (i32 x = 0; x < width; x++) {
+        u32 value = pixels[x].value;
+        out[x * 3 + 0] = (u8)(value);
+        out[x * 3 + 1] = (u8)(value >> 8);
+        out[x * 3 + 2] = (u8)(value >> 16);
+    }
+}
+
+static void
+appendU32BigEndian(std::vector<u8>& out, u32 value) {
+    out.push_back((u8)(value >> 24));
+    out.push_back((u8)(value >> 16));
+    out.push_back((u8)(value >> 8));
+    out.push_back((u8)(value));
+}
+
+static void
+appendPngChunk(std::vector<u8>& out, const char* type, const u8* data, size_t size) {
+    appendU32BigEndian(out, (u32)size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    appendU32BigEndian(out, crc32Update(0, out.data() + start, size + 4));
+}
+
+static void
+encodePngStrip(PngStrip& strip, const Color32* pixels, i32 width, i32 y0, i32 y1, i32 level, bool first, bool last) {
+    i32 rowBytes = width * PNG_BYTES_PER_PIXEL;
+    std::vector<u8> filtered((size_t)(rowBytes + 1) * (y1 - y0));
+    std::vector<u8> row(rowBytes);
+    std::vector<u8> prevRow(rowBytes, 0);
+    std::vector<u8> scratch(rowBytes);
+
+    // The first row of a strip still predicts from the row above it, filtering doesn't care about strips
+    if (y0 > 0) {
+        packPngRow(prevRow.data(), pixels + (size_t)(y0 - 1) * width, width);
+    }
+    for (i32 y = y0; y < y1; y++) {
+        u8* out = filtered.data() + (size_t)(y - y0) * (rowBytes + 1);
+        packPngRow(row.data(), pixels + (size_t)y * width, width);
+        if (level == 0) {
+            out[0] = 0;
+            memcpy(out + 1, row.data(), rowBytes);
+        } else if (level == 1) {
+            out[0] = 4;
+            filterPngRow(out + 1, row.data(), prevRow.data(), rowBytes, 4);
+        } else {
+            filterPngRowAdaptive(out, scratch.data(), row.data(), prevRow.data(), rowBytes);
+        }
+        std::swap(row, prevRow);
+    }
+
+    DeflateStream stream;
+    if (first) {
+        // CMF/FLG for a 32K window deflate stream, no preset dictionary
+        stream.bytes.push_back(0x78);
+        stream.bytes.push_back(0x01);
+    }
+    deflatePiece(stream, filtered.data(), filtered.size(), level, last);
+
+    strip.adler = adler32Update(1, filtered.data(), filtered.size());
+    strip.filteredSize = filtered.size();
+    strip.chunk.clear();
+    appendPngChunk(strip.chunk, "IDAT", stream.bytes.data(), stream.bytes.size());
+}
+
+// Writes 8-bit RGB, the alpha channel of the pixels is dropped since renders are always opaque.
+// Level 0 stores without compression, 1 is the fast mode and 2-9 trade time for size.
+static bool
+writePng(const char* path, const Color32* pixels, i32 width, i32 height, i32 level) {
+    i32 rowBytes = width * PNG_BYTES_PER_PIXEL + 1;
+    i32 nThreads = (i32)std::max(1u, std::thread::hardware_concurrency());
+    i32 rowsPerStrip = std::max((height + nThreads * 2 - 1) / (nThreads * 2),
+                                (PNG_MIN_STRIP_BYTES + rowBytes - 1) / rowBytes);
+    i32 stripCount = (height + rowsPerStrip - 1) / rowsPerStrip;
+
+    std::vector<PngStrip> strips(stripCount);
+    parallelFor(stripCount, [&](int index) {
+        u64 trace = traceBegin();
+        i32 y0 = index * rowsPerStrip;
+        i32 y1 = std::min(height, y0 + rowsPerStrip);
+        encodePngStrip(strips[index], pixels, width, y0, y1, level, index == 0, index == stripCount - 1);
+        traceEnd("png strip", trace, 0, y0);
+    });
+
+    u64 trace = traceBegin();
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    std::vector<u8> header;
+    const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    header.insert(header.end(), signature, signature + 8);
+    std::vector<u8> ihdr;
+    appendU32BigEndian(ihdr, (u32)width);
+    appendU32BigEndian(ihdr, (u32)height);
+    const u8 format[5] = {8, 2, 0, 0, 0}; // 8-bit RGB, deflate, adaptive filtering, no interlace
+    ihdr.insert(ihdr.end(), format, format + 5);
+    appendPngChunk(header, "IHDR", ihdr.data(), ihdr.size());
+    bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+
+    u32 adler = 1;
+    for (i32 i = 0; i < stripCount && ok; i++) {
+        adler = adler32Combine(adler, strips[i].adler, strips[i].filteredSize);
+        ok = fwrite(strips[i].chunk.data(), 1, strips[i].chunk.size(), file) == strips[i].chunk.size();
+    }
+
+    std::vector<u8> trailer;
+    std::vector<u8> adlerBytes;
+    appendU32BigEndian(adlerBytes, adler);
+    appendPngChunk(trailer, "IDAT", adlerBytes.data(), adlerBytes.size());
+    appendPngChunk(trailer, "IEND", nullptr, 0);
+    ok = ok && fwrite(trailer.data(), 1, trailer.size(), file) == trailer.size();
+
+    ok = fclose(file) == 0 && ok;
+    traceEnd("png write", trace);
+    return ok;
+}
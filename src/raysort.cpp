@@ -0,0 +1,75 @@
+// Sorting of scattered rays before they are traced, so rays that go through the same parts of the BVH and
+// touch the same spheres follow each other instead of each one pulling in its own nodes. The key is the
+// octant of the direction and then the Morton code of the origin, which puts rays leaving from nearby
+// points in the same general direction next to each other. Off unless asked for with --sort-rays, render
+// workers then trace neighbouring tiles together in batches of up to RAY_SORT_BATCH_RAYS paths. Batches of
+// one tile were measured no faster sorted than not, there are too few rays for neighbours to share nodes.
+
+// Paths traced together, each bounce sorts the ones still going
+const i32 RAY_SORT_BATCH_RAYS = 64 * 1024;
+
+// Bits of every origin coordinate in the Morton code, with the 3 octant bits above them the key fits the
+// 32 bits sortRays() keeps it in
+const i32 RAY_SORT_MORTON_BITS = 9;
+static_assert(3 * RAY_SORT_MORTON_BITS + 3 <= 32, "ray sort key doesn't fit in 32 bits");
+
+// Spreads the low 10 bits of v out to every third bit
+static u32
+spreadBits3(u32 v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+static u32
+mortonCode3(u32 x, u32 y, u32 z) {
+    return (spreadBits3(x) << 2) | (spreadBits3(y) << 1) | spreadBits3(z);
+}
+
+// Space the Morton codes are made in, the scene's bounds over the whole shutter time
+struct RaySortSpace {
+    Vec3 min;
+    Vec3 scale; // to [0, 2^RAY_SORT_MORTON_BITS)
+};
+
+static RaySortSpace
+makeRaySortSpace(const World& world) {
+    const BvhNode& root = world.bvh.nodes.members[0];
+    Aabb bounds = {minVec3(root.bounds[0].min, root.bounds[1].min), maxVec3(root.bounds[0].max, root.bounds[1].max)};
+    RaySortSpace space;
+    space.min = bounds.min;
+    f32 cells = (f32)(1 << RAY_SORT_MORTON_BITS);
+    for (i32 axis = 0; axis < 3; axis++) {
+        f32 extent = bounds.max.Elements[axis] - bounds.min.Elements[axis];
+        space.scale.Elements[axis] = extent > 0 ? cells / extent : 0;
+    }
+    return space;
+}
+
+static u32
+raySortKey(const Ray& ray, const RaySortSpace& space) {
+    u32 cell[3];
+    u32 maxCell = (1 << RAY_SORT_MORTON_BITS) - 1;
+    for (i32 axis = 0; axis < 3; axis++) {
+        f32 position = (ray.o.Elements[axis] - space.min.Elements[axis]) * space.scale.Elements[axis];
+        cell[axis] = position > 0 ? std::min((u32)position, maxCell) : 0;
+    }
+    u32 octant = (ray.d.x < 0) << 2 | (ray.d.y < 0) << 1 | (ray.d.z < 0);
+    return octant << (3 * RAY_SORT_MORTON_BITS) | mortonCode3(cell[0], cell[1], cell[2]);
+}
+
+// Puts the indices of rays into key order. keys is scratch space.
+static void
+sortRays(const Ray* rays, std::vector<u32>& indices, std::vector<u64>& keys, const RaySortSpace& space) {
+    keys.resize(indices.size());
+    for (size_t i = 0; i < indices.size(); i++) {
+        keys[i] = (u64)raySortKey(rays[indices[i]], space) << 32 | indices[i];
+    }
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < indices.size(); i++) {
+        indices[i] = (u32)keys[i];
+    }
+}
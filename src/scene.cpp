@@ -0,0 +1,117 @@
+// Scenes in memory and the book cover scene. Scene files and caches are in scenefile.cpp.
+
+struct Scene {
+    World world;
+    OrbitCamera camera;
+};
+
+// Collects spheres and materials while a scene is being made
+struct SceneBuilder {
+    std::vector<Sphere> spheres;
+    std::vector<MaterialDesc> materials;
+    OrbitCamera camera;
+};
+
+static MaterialDesc
+lambertian(const Color& albedo) {
+    MaterialDesc result = {MATERIAL_LAMBERTIAN, albedo, 0, 0};
+    return result;
+}
+
+static MaterialDesc
+metal(const Color& albedo, f32 fuzz) {
+    MaterialDesc result = {MATERIAL_METAL, albedo, fuzz, 0};
+    return result;
+}
+
+static MaterialDesc
+dielectric(f32 refIdx) {
+    MaterialDesc result = {MATERIAL_DIELECTRIC, vec3(1, 1, 1), 0, refIdx};
+    return result;
+}
+
+static MaterialDesc
+diffuseLight(const Color& emission) {
+    MaterialDesc result = {MATERIAL_LIGHT, emission, 0, 0};
+    return result;
+}
+
+static u32
+addMaterial(SceneBuilder& builder, const MaterialDesc& material) {
+    builder.materials.push_back(material);
+    return (u32)builder.materials.size() - 1;
+}
+
+static void
+addSphere(SceneBuilder& builder, Vec3 center0, Vec3 center1, f32 radius, u32 material) {
+    Sphere sphere = {center0, center1, radius, material};
+    builder.spheres.push_back(sphere);
+}
+
+template <typename T>
+static Array<T>
+copyToArray(const std::vector<T>& values) {
+    T* members = allocateLargeArray<T>(values.size());
+    std::copy(values.begin(), values.end(), members);
+    return {members, values.size()};
+}
+
+// The BVH and the light list are left to the caller
+static Scene
+finishScene(const SceneBuilder& builder) {
+    Scene scene;
+    scene.world.spheres = copyToArray(builder.spheres);
+    std::vector<u32> sphereIds(builder.spheres.size());
+    for (size_t i = 0; i < sphereIds.size(); i++) {
+        sphereIds[i] = (u32)i;
+    }
+    scene.world.sphereIds = copyToArray(sphereIds);
+    scene.world.materialDescs = copyToArray(builder.materials);
+    scene.world.lights = {nullptr, 0};
+    scene.world.bvh.nodes = {nullptr, 0};
+    createMaterials(scene.world);
+    scene.camera = builder.camera;
+    return scene;
+}
+
+// The book cover scene: a big ground sphere, three large ones and a grid of small random spheres
+static Scene
+randomScene() {
+    SceneBuilder builder;
+    builder.camera = makeOrbitCamera(vec3(13, 2, 3), vec3(0, 0, 0), 20, 0.1f, 10);
+
+    u32 ground = addMaterial(builder, lambertian(vec3(0.5, 0.5, 0.5)));
+    addSphere(builder, vec3(0, -1000, 0), vec3(0, -1000, 0), 1000, ground);
+    u32 glass = addMaterial(builder, dielectric(1.5f));
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            float chooseMat = Random.next();
+            Vec3 center = vec3(a + 0.9f * Random.next(), 0.2f, b + 0.9f * Random.next());
+            if (HMM_Length(center - vec3(4.f, 0.2f, 0.f)) > 0.9f) {
+                if (chooseMat < 0.8) { // diffuse, bouncing up during the shutter
+                    Vec3 center1 = center + vec3(0, 0.5f * Random.next(), 0);
+                    MaterialDesc material = lambertian(vec3(Random.next() * Random.next(),
+                                                            Random.next() * Random.next(),
+                                                            Random.next() * Random.next()));
+                    addSphere(builder, center, center1, 0.2f, addMaterial(builder, material));
+                } else if (chooseMat < 0.95f) { // metal
+                    MaterialDesc material = metal(vec3(0.5f * (1.f + Random.next()),
+                                                       0.5f * (1.f + Random.next()),
+                                                       0.5f * (1.f + Random.next())),
+                                                  0.5f * Random.next());
+                    addSphere(builder, center, center, 0.2f, addMaterial(builder, material));
+                } else { // glass
+                    addSphere(builder, center, center, 0.2f, glass);
+                }
+            }
+        }
+    }
+
+    addSphere(builder, vec3(0.f, 1.f, 0.f), vec3(0.f, 1.f, 0.f), 1.0f, glass);
+    addSphere(builder, vec3(-4.f, 1.f, 0.f), vec3(-4.f, 1.f, 0.f), 1.0f,
+              addMaterial(builder, lambertian(vec3(0.4f, 0.2f, 0.1f))));
+    addSphere(builder, vec3(4.f, 1.f, 0.f), vec3(4.f, 1.f, 0.f), 1.0f,
+              addMaterial(builder, metal(vec3(0.7f, 0.6f, 0.5f), 0.0f)));
+
+    return finishScene(builder);
+}
@@ -0,0 +1,482 @@
+// Scene files. The text format is line based, # starts a comment:
+//
+//   camera <from x y z> <at x y z> <vfov> <aperture> <focus distance>
+//   material <name> lambertian <r g b>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <refraction index>
+//   material <name> light <r g b>                         emitted radiance, spheres of it are sampled as lights
+//   sphere <x y z> <radius> <material>
+//   sphere <x0 y0 z0> <x1 y1 z1> <radius> <material>     moving from the first to the second center
+//   group <name>                                          spheres until "end" make up a group
+//   instance <group> <x y z> [scale]                      copy of a group, scaled and moved there
+//
+// Parsing and building the BVH is only done once. The result goes into a binary cache next to the text
+// file, which later runs map into memory and use as is. A cache can also be given as the scene directly.
+
+const char SCENE_CACHE_MAGIC[8] = {'R', 'O', 'J', 'U', 'S', 'C', 'N', 0};
+// Bump when anything the cache stores changes layout
+const u32 SCENE_CACHE_VERSION = 2;
+
+static_assert(sizeof(Sphere) == 32, "Sphere layout changed, bump SCENE_CACHE_VERSION");
+static_assert(sizeof(BvhNode) == 56, "BvhNode layout changed, bump SCENE_CACHE_VERSION");
+static_assert(sizeof(MaterialDesc) == 24, "MaterialDesc layout changed, bump SCENE_CACHE_VERSION");
+
+// Offsets are from the start of the file, so the whole file can be mapped anywhere
+struct SceneCacheSection {
+    u64 offset;
+    u64 count;
+};
+
+struct SceneCacheHeader {
+    char magic[8];
+    u32 version;
+    u32 endianCheck;
+    u64 sourceHash; // of the text file the cache was made from
+    u64 fileSize;
+    // The BVH depends on these too
+    f32 shutterOpen;
+    f32 shutterClose;
+    u32 bvhMaxLeafSize;
+    u32 reserved;
+    OrbitCamera camera;
+    SceneCacheSection materials;
+    SceneCacheSection spheres;
+    SceneCacheSection sphereIds;
+    SceneCacheSection nodes;
+};
+
+struct SceneParser {
+    const char* path;
+    i32 line;
+    std::vector<char*> tokens;
+    size_t next; // first token not consumed yet
+};
+
+static bool
+parseError(const SceneParser& parser, const char* message, const char* detail = "") {
+    printf("%s:%d: %s%s\n", parser.path, parser.line, message, detail);
+    return false;
+}
+
+static bool
+parseFloats(SceneParser& parser, f32* out, i32 count) {
+    for (i32 i = 0; i < count; i++) {
+        if (parser.next >= parser.tokens.size()) {
+            return parseError(parser, "expected a number");
+        }
+        char* end;
+        out[i] = strtof(parser.tokens[parser.next], &end);
+        if (*end != 0) {
+            return parseError(parser, "not a number: ", parser.tokens[parser.next]);
+        }
+        parser.next++;
+    }
+    return true;
+}
+
+static bool
+parseVec3(SceneParser& parser, Vec3& out) {
+    return parseFloats(parser, out.Elements, 3);
+}
+
+// Numbers left on the line before the next word or the end
+static i32
+countNumbers(const SceneParser& parser) {
+    i32 count = 0;
+    for (size_t i = parser.next; i < parser.tokens.size(); i++) {
+        char* end;
+        strtof(parser.tokens[i], &end);
+        if (*end != 0) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+struct SceneGroup {
+    std::string name;
+    std::vector<Sphere> spheres;
+};
+
+static bool
+parseSceneText(const char* path, std::string text, Scene& scene) {
+    SceneBuilder builder;
+    builder.camera = makeOrbitCamera(vec3(13, 2, 3), vec3(0, 0, 0), 20, 0.1f, 10);
+    std::vector<std::string> materialNames;
+    std::vector<SceneGroup> groups;
+    SceneGroup* currentGroup = nullptr;
+
+    SceneParser parser = {path, 0, {}, 0};
+    char* cursor = &text[0];
+    while (*cursor) {
+        char* lineEnd = cursor + strcspn(cursor, "\n");
+        bool last = *lineEnd == 0;
+        *lineEnd = 0;
+        char* comment = strchr(cursor, '#');
+        if (comment) {
+            *comment = 0;
+        }
+        parser.line++;
+        parser.tokens.clear();
+        parser.next = 1;
+        for (char* token = strtok(cursor, " \t\r"); token; token = strtok(nullptr, " \t\r")) {
+            parser.tokens.push_back(token);
+        }
+        cursor = last ? lineEnd : lineEnd + 1;
+        if (parser.tokens.empty()) {
+            continue;
+        }
+
+        const char* keyword = parser.tokens[0];
+        if (!strcmp(keyword, "camera")) {
+            Vec3 from, at;
+            f32 lens[3];
+            if (!parseVec3(parser, from) || !parseVec3(parser, at) || !parseFloats(parser, lens, 3)) {
+                return false;
+            }
+            builder.camera = makeOrbitCamera(from, at, lens[0], lens[1], lens[2]);
+        } else if (!strcmp(keyword, "material")) {
+            if (parser.tokens.size() < 3) {
+                return parseError(parser, "material needs a name and a type");
+            }
+            const char* type = parser.tokens[2];
+            parser.next = 3;
+            MaterialDesc material;
+            f32 value = 0;
+            if (!strcmp(type, "lambertian")) {
+                if (!parseVec3(parser, material.albedo)) {
+                    return false;
+                }
+                material = lambertian(material.albedo);
+            } else if (!strcmp(type, "metal")) {
+                if (!parseVec3(parser, material.albedo) || !parseFloats(parser, &value, 1)) {
+                    return false;
+                }
+                material = metal(material.albedo, value);
+            } else if (!strcmp(type, "dielectric")) {
+                if (!parseFloats(parser, &value, 1)) {
+                    return false;
+                }
+                material = dielectric(value);
+            } else if (!strcmp(type, "light")) {
+                if (!parseVec3(parser, material.albedo)) {
+                    return false;
+                }
+                material = diffuseLight(material.albedo);
+            } else {
+                return parseError(parser, "unknown material type ", type);
+            }
+            materialNames.push_back(parser.tokens[1]);
+            addMaterial(builder, material);
+        } else if (!strcmp(keyword, "sphere")) {
+            i32 numbers = countNumbers(parser);
+            if (numbers != 4 && numbers != 7) {
+                return parseError(parser, "sphere needs a center, an optional second center and a radius");
+            }
+            Vec3 center0, center1;
+            f32 radius;
+            parseVec3(parser, center0);
+            center1 = center0;
+            if (numbers == 7) {
+                parseVec3(parser, center1);
+            }
+            parseFloats(parser, &radius, 1);
+            if (parser.next >= parser.tokens.size()) {
+                return parseError(parser, "sphere needs a material");
+            }
+            const char* materialName = parser.tokens[parser.next++];
+            auto material = std::find(materialNames.begin(), materialNames.end(), materialName);
+            if (material == materialNames.end()) {
+                return parseError(parser, "unknown material ", materialName);
+            }
+            Sphere sphere = {center0, center1, radius, (u32)(material - materialNames.begin())};
+            if (currentGroup) {
+                currentGroup->spheres.push_back(sphere);
+            } else {
+                builder.spheres.push_back(sphere);
+            }
+        } else if (!strcmp(keyword, "group")) {
+            if (currentGroup || parser.tokens.size() < 2) {
+                return parseError(parser, "group needs a name and can't be inside another group");
+            }
+            groups.push_back({parser.tokens[1], {}});
+            currentGroup = &groups.back();
+            parser.next = 2;
+        } else if (!strcmp(keyword, "end")) {
+            if (!currentGroup) {
+                return parseError(parser, "end without a group");
+            }
+            currentGroup = nullptr;
+        } else if (!strcmp(keyword, "instance")) {
+            if (currentGroup || parser.tokens.size() < 2) {
+                return parseError(parser, "instance needs a group name and can't be inside a group");
+            }
+            auto group = std::find_if(groups.begin(), groups.end(),
+                                      [&](const SceneGroup& g) { return g.name == parser.tokens[1]; });
+            if (group == groups.end()) {
+                return parseError(parser, "unknown group ", parser.tokens[1]);
+            }
+            parser.next = 2;
+            Vec3 position;
+            f32 scale = 1;
+            if (!parseVec3(parser, position)) {
+                return false;
+            }
+            if (parser.next < parser.tokens.size() && !parseFloats(parser, &scale, 1)) {
+                return false;
+            }
+            // Spheres only need moving and scaling, so instances are flattened into the sphere list
+            for (const Sphere& sphere : group->spheres) {
+                addSphere(builder, scale * sphere.center0 + position, scale * sphere.center1 + position,
+                          scale * sphere.radius, sphere.material);
+            }
+        } else {
+            return parseError(parser, "unknown keyword ", keyword);
+        }
+        if (parser.next < parser.tokens.size()) {
+            return parseError(parser, "unexpected ", parser.tokens[parser.next]);
+        }
+    }
+    if (currentGroup) {
+        return parseError(parser, "missing end of group ", currentGroup->name.c_str());
+    }
+
+    scene = finishScene(builder);
+    return true;
+}
+
+// Writes the scene in the text format, for starting a scene file from a generated scene
+static bool
+writeSceneText(const char* path, const Scene& scene) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    const World& world = scene.world;
+    const OrbitCamera& camera = scene.camera;
+    Vec3 from = orbitPosition(camera);
+    fprintf(file, "camera %.9g %.9g %.9g  %.9g %.9g %.9g", from.x, from.y, from.z, camera.target.x, camera.target.y,
+            camera.target.z);
+    fprintf(file, "  %.9g %.9g %.9g\n", camera.vfov, camera.aperture, camera.focusDist);
+    for (size_t i = 0; i < world.materialDescs.count; i++) {
+        const MaterialDesc& material = world.materialDescs.members[i];
+        const Color& c = material.albedo;
+        switch (material.type) {
+        case MATERIAL_METAL:
+            fprintf(file, "material m%zu metal %.9g %.9g %.9g %.9g\n", i, c.r, c.g, c.b, material.fuzz);
+            break;
+        case MATERIAL_DIELECTRIC: fprintf(file, "material m%zu dielectric %.9g\n", i, material.refIdx); break;
+        case MATERIAL_LIGHT: fprintf(file, "material m%zu light %.9g %.9g %.9g\n", i, c.r, c.g, c.b); break;
+        default: fprintf(file, "material m%zu lambertian %.9g %.9g %.9g\n", i, c.r, c.g, c.b); break;
+        }
+    }
+    // In the order of the scene and not the BVH, so primitive ids stay the same when the export is loaded
+    std::vector<const Sphere*> sceneOrder(world.spheres.count);
+    for (size_t i = 0; i < world.spheres.count; i++) {
+        sceneOrder[world.sphereIds.members[i]] = &world.spheres.members[i];
+    }
+    for (const Sphere* spherePointer : sceneOrder) {
+        const Sphere& sphere = *spherePointer;
+        fprintf(file, "sphere %.9g %.9g %.9g", sphere.center0.x, sphere.center0.y, sphere.center0.z);
+        if (HMM_LengthSquared(sphere.center1 - sphere.center0) > 0) {
+            fprintf(file, "  %.9g %.9g %.9g", sphere.center1.x, sphere.center1.y, sphere.center1.z);
+        }
+        fprintf(file, "  %.9g m%u\n", sphere.radius, sphere.material);
+    }
+    return fclose(file) == 0;
+}
+
+static void
+appendSection(std::vector<u8>& out, SceneCacheSection& section, const void* data, size_t size, size_t count) {
+    section.offset = appendFileSection(out, data, size * count);
+    section.count = count;
+}
+
+// The cache file contents, also what the coordinator sends its workers
+static std::vector<u8>
+serializeSceneCache(const Scene& scene, u64 sourceHash) {
+    const World& world = scene.world;
+    SceneCacheHeader header = {};
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_CACHE_VERSION;
+    header.endianCheck = FILE_ENDIAN_CHECK;
+    header.sourceHash = sourceHash;
+    header.shutterOpen = SHUTTER_OPEN;
+    header.shutterClose = SHUTTER_CLOSE;
+    header.bvhMaxLeafSize = BVH_MAX_LEAF_SIZE;
+    header.camera = scene.camera;
+
+    std::vector<u8> data(sizeof(header));
+    appendSection(data, header.materials, world.materialDescs.members, sizeof(MaterialDesc), world.materialDescs.count);
+    appendSection(data, header.spheres, world.spheres.members, sizeof(Sphere), world.spheres.count);
+    appendSection(data, header.sphereIds, world.sphereIds.members, sizeof(u32), world.sphereIds.count);
+    appendSection(data, header.nodes, world.bvh.nodes.members, sizeof(BvhNode), world.bvh.nodes.count);
+    header.fileSize = data.size();
+    memcpy(data.data(), &header, sizeof(header));
+    return data;
+}
+
+static bool
+writeSceneCache(const char* path, const Scene& scene, u64 sourceHash) {
+    return writeFileAtomically(path, serializeSceneCache(scene, sourceHash));
+}
+
+static bool
+sectionFits(const SceneCacheSection& section, size_t elementSize, size_t fileSize) {
+    return fileSectionFits(section.offset, section.count, elementSize, fileSize);
+}
+
+// What the sections hold has to be usable as is, like a BVH file's nodes: materials of known types, spheres
+// pointing at them, ids that are a permutation and a BVH that stays inside the arrays
+static bool
+sceneCacheContentsValid(const World& world) {
+    for (size_t i = 0; i < world.materialDescs.count; i++) {
+        if (world.materialDescs.members[i].type >= MATERIAL_TYPE_COUNT) {
+            return false;
+        }
+    }
+    std::vector<bool> used(world.spheres.count, false);
+    for (size_t i = 0; i < world.spheres.count; i++) {
+        u32 id = world.sphereIds.members[i];
+        if (world.spheres.members[i].material >= world.materialDescs.count || id >= world.spheres.count ||
+            used[id]) {
+            return false;
+        }
+        used[id] = true;
+    }
+    return bvhNodesValid(world.bvh.nodes.members, world.bvh.nodes.count, world.spheres.count);
+}
+
+// Points the scene into cache contents, which have to stay around as long as the scene.
+// sourceHash 0 accepts any cache, otherwise it has to be made from text with that hash.
+static bool
+useSceneCache(u8* data, size_t size, u64 sourceHash, Scene& scene) {
+    SceneCacheHeader header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    bool valid = !memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) &&
+                 header.version == SCENE_CACHE_VERSION && header.endianCheck == FILE_ENDIAN_CHECK &&
+                 header.fileSize == size && (sourceHash == 0 || header.sourceHash == sourceHash) &&
+                 header.shutterOpen == SHUTTER_OPEN && header.shutterClose == SHUTTER_CLOSE &&
+                 header.bvhMaxLeafSize == (u32)BVH_MAX_LEAF_SIZE &&
+                 sectionFits(header.materials, sizeof(MaterialDesc), size) &&
+                 sectionFits(header.spheres, sizeof(Sphere), size) &&
+                 sectionFits(header.sphereIds, sizeof(u32), size) && header.sphereIds.count == header.spheres.count &&
+                 sectionFits(header.nodes, sizeof(BvhNode), size);
+    if (!valid) {
+        return false;
+    }
+
+    World world = {};
+    world.materialDescs = {(MaterialDesc*)(data + header.materials.offset), header.materials.count};
+    world.spheres = {(Sphere*)(data + header.spheres.offset), header.spheres.count};
+    world.sphereIds = {(u32*)(data + header.sphereIds.offset), header.sphereIds.count};
+    world.bvh.nodes = {(BvhNode*)(data + header.nodes.offset), header.nodes.count};
+    if (!sceneCacheContentsValid(world)) {
+        return false;
+    }
+    createMaterials(world);
+    collectLights(world);
+    scene.world = world;
+    scene.camera = header.camera;
+    return true;
+}
+
+static bool
+loadSceneCache(const char* path, u64 sourceHash, Scene& scene) {
+    size_t size = 0;
+    u8* data = mapFile(path, size);
+    if (!data) {
+        return false;
+    }
+    if (!useSceneCache(data, size, sourceHash, scene)) {
+        unmapFile(data, size);
+        return false;
+    }
+    return true;
+}
+
+static bool
+isSceneCache(const char* path) {
+    char magic[sizeof(SCENE_CACHE_MAGIC)] = {};
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    bool result = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !memcmp(magic, SCENE_CACHE_MAGIC, 8);
+    fclose(file);
+    return result;
+}
+
+// With a BVH directory the build is only done once per distinct scene
+static void
+buildSceneBvh(Scene& scene, const char* bvhDirectory) {
+    u64 trace = traceBegin();
+    if (bvhDirectory) {
+        buildBvhCached(scene.world, bvhDirectory);
+    } else {
+        auto start = std::chrono::high_resolution_clock::now();
+        buildBvh(scene.world);
+        std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "BVH build of " << scene.world.spheres.count << " spheres: " << diff.count() << " s\n";
+    }
+    collectLights(scene.world);
+    traceEnd("bvh build", trace);
+}
+
+// Loads a text scene, through its cache when that's still up to date, or a cache directly.
+// Without a path it's the random book cover scene, the same one every time for the same non-zero seed.
+static bool
+loadScene(const char* path, u64 seed, const char* bvhDirectory, Scene& scene) {
+    auto start = std::chrono::high_resolution_clock::now();
+    u64 trace = traceBegin();
+    if (!path) {
+        if (seed != 0) {
+            Random.seed(seed);
+        }
+        scene = randomScene();
+        traceEnd("scene build", trace);
+        buildSceneBvh(scene, bvhDirectory);
+        return true;
+    }
+
+    const char* cachePath = path;
+    std::string textCachePath;
+    if (isSceneCache(path)) {
+        if (!loadSceneCache(path, 0, scene)) {
+            printf("%s is not a valid scene cache for this build\n", path);
+            return false;
+        }
+    } else {
+        std::string text;
+        if (!readFile(path, text)) {
+            printf("Could not read scene %s\n", path);
+            return false;
+        }
+        u64 hash = hashBytes(HASH_SEED, text.data(), text.size());
+        textCachePath = std::string(path) + ".cache";
+        cachePath = textCachePath.c_str();
+        if (!loadSceneCache(cachePath, hash, scene)) {
+            if (!parseSceneText(path, text, scene)) {
+                return false;
+            }
+            traceEnd("scene parse", trace);
+            std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+            std::cout << "Parsed " << scene.world.spheres.count << " spheres from " << path << " in " << diff.count()
+                      << " s\n";
+            buildSceneBvh(scene, bvhDirectory);
+            if (!writeSceneCache(cachePath, scene, hash)) {
+                std::cout << "Could not write scene cache " << cachePath << "\n";
+            }
+            return true;
+        }
+    }
+    traceEnd("scene cache load", trace);
+    std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - start;
+    std::cout << "Loaded " << scene.world.spheres.count << " spheres from " << cachePath << " in " << diff.count()
+              << " s\n";
+    return true;
+}
@@ -0,0 +1,189 @@
+// Render cost instrumentation. Counters live per thread and are only summed up per tile and when a worker
+// thread finishes, so the hot loops just bump a thread local. RENDER_STATS = false compiles them out.
+
+struct RenderCounters {
+    u64 samples;
+    u64 rays;
+    u64 nodesVisited;
+    u64 primitivesTested;
+};
+
+static thread_local RenderCounters tCounters;
+
+static void
+addCounters(RenderCounters& to, const RenderCounters& from) {
+    to.samples += from.samples;
+    to.rays += from.rays;
+    to.nodesVisited += from.nodesVisited;
+    to.primitivesTested += from.primitivesTested;
+}
+
+static RenderCounters
+subtractCounters(const RenderCounters& a, const RenderCounters& b) {
+    RenderCounters result;
+    result.samples = a.samples - b.samples;
+    result.rays = a.rays - b.rays;
+    result.nodesVisited = a.nodesVisited - b.nodesVisited;
+    result.primitivesTested = a.primitivesTested - b.primitivesTested;
+    return result;
+}
+
+// Part of the counters, for work that was counted together
+static RenderCounters
+scaleCounters(const RenderCounters& counters, f64 share) {
+    RenderCounters result;
+    result.samples = (u64)(counters.samples * share + 0.5);
+    result.rays = (u64)(counters.rays * share + 0.5);
+    result.nodesVisited = (u64)(counters.nodesVisited * share + 0.5);
+    result.primitivesTested = (u64)(counters.primitivesTested * share + 0.5);
+    return result;
+}
+
+static void
+countSample() {
+    if (RENDER_STATS) {
+        tCounters.samples++;
+    }
+}
+
+static void
+countRays(u64 rays, u64 nodesVisited, u64 primitivesTested) {
+    if (RENDER_STATS) {
+        tCounters.rays += rays;
+        tCounters.nodesVisited += nodesVisited;
+        tCounters.primitivesTested += primitivesTested;
+    }
+}
+
+static void
+countRay(u64 nodesVisited, u64 primitivesTested) {
+    countRays(1, nodesVisited, primitivesTested);
+}
+
+// Totals of all worker threads that have finished since the last reset
+static std::mutex gCounterTotalsMutex;
+static RenderCounters gCounterTotals;
+
+static void
+mergeThreadCounters() {
+    std::lock_guard<std::mutex> lockGuard(gCounterTotalsMutex);
+    addCounters(gCounterTotals, tCounters);
+    tCounters = {};
+}
+
+static RenderCounters
+takeCounterTotals() {
+    std::lock_guard<std::mutex> lockGuard(gCounterTotalsMutex);
+    RenderCounters result = gCounterTotals;
+    gCounterTotals = {};
+    return result;
+}
+
+// Everything one tile cost over all the passes of a render
+struct TileStats {
+    i32 x, y;
+    i32 width, height;
+    f64 seconds;
+    RenderCounters counters;
+};
+
+static Color
+heatmapColor(f32 t) {
+    // black -> blue -> red -> yellow -> white
+    const Color stops[5] = {vec3(0, 0, 0), vec3(0, 0, 1), vec3(1, 0, 0), vec3(1, 1, 0), vec3(1, 1, 1)};
+    t = HMM_Clamp(0.0f, t, 1.0f) * 4;
+    i32 i = std::min((i32)t, 3);
+    return lerpVec3(stops[i], t - i, stops[i + 1]);
+}
+
+static f64
+secondsPerPixel(const TileStats& tile) {
+    return tile.seconds / ((f64)tile.width * tile.height);
+}
+
+// Time per pixel rather than per tile, so the smaller tiles along the right and bottom edge compare fairly
+static bool
+writeStatsHeatmap(const char* path, const std::vector<TileStats>& tiles, i32 width, i32 height) {
+    f64 maxCost = 0;
+    for (const TileStats& tile : tiles) {
+        maxCost = std::max(maxCost, secondsPerPixel(tile));
+    }
+    std::vector<Color32> pixels((size_t)width * height);
+    for (const TileStats& tile : tiles) {
+        Color32 color = makeColor32(heatmapColor(maxCost > 0 ? (f32)(secondsPerPixel(tile) / maxCost) : 0));
+        for (i32 y = tile.y; y < tile.y + tile.height; y++) {
+            for (i32 x = tile.x; x < tile.x + tile.width; x++) {
+                pixels[(size_t)y * width + x] = color;
+            }
+        }
+    }
+    return writePng(path, pixels.data(), width, height, PNG_COMPRESSION_LEVEL);
+}
+
+static bool
+writeStatsCsv(const char* path, const std::vector<TileStats>& tiles) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "x,y,width,height,seconds,samples,rays,nodes_visited,primitives_tested\n");
+    for (const TileStats& tile : tiles) {
+        fprintf(file, "%d,%d,%d,%d,%.9f,%llu,%llu,%llu,%llu\n", tile.x, tile.y, tile.width, tile.height,
+                tile.seconds, (unsigned long long)tile.counters.samples, (unsigned long long)tile.counters.rays,
+                (unsigned long long)tile.counters.nodesVisited, (unsigned long long)tile.counters.primitivesTested);
+    }
+    return fclose(file) == 0;
+}
+
+static void
+printCountersJson(FILE* file, const RenderCounters& counters) {
+    fprintf(file, "\"samples\": %llu, \"rays\": %llu, \"nodesVisited\": %llu, \"primitivesTested\": %llu",
+            (unsigned long long)counters.samples, (unsigned long long)counters.rays,
+            (unsigned long long)counters.nodesVisited, (unsigned long long)counters.primitivesTested);
+}
+
+static bool
+writeStatsJson(const char* path, const std::vector<TileStats>& tiles, const RenderCounters& totals, i32 width,
+               i32 height, f64 renderSeconds) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"renderSeconds\": %.9f,\n  \"totals\": {", width,
+            height, renderSeconds);
+    printCountersJson(file, totals);
+    fprintf(file, "},\n  \"tiles\": [\n");
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const TileStats& tile = tiles[i];
+        fprintf(file, "    {\"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d, \"seconds\": %.9f, ", tile.x, tile.y,
+                tile.width, tile.height, tile.seconds);
+        printCountersJson(file, tile.counters);
+        fprintf(file, "}%s\n", i + 1 < tiles.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+// Writes <base>.stats.csv, <base>.stats.json and <base>.heatmap.png, base being the render path without extension
+static void
+writeRenderStats(const char* renderPath, const std::vector<TileStats>& tiles, const RenderCounters& totals,
+                 i32 width, i32 height, f64 renderSeconds) {
+    std::string base = renderPath;
+    size_t dot = base.find_last_of('.');
+    size_t slash = base.find_last_of("/\\");
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+        base.resize(dot);
+    }
+
+    std::string csvPath = base + ".stats.csv";
+    std::string jsonPath = base + ".stats.json";
+    std::string heatmapPath = base + ".heatmap.png";
+    bool ok = writeStatsCsv(csvPath.c_str(), tiles);
+    ok = writeStatsJson(jsonPath.c_str(), tiles, totals, width, height, renderSeconds) && ok;
+    ok = writeStatsHeatmap(heatmapPath.c_str(), tiles, width, height) && ok;
+    if (!ok) {
+        std::cout << "Failed to write render stats next to " << renderPath << "\n";
+        return;
+    }
+    std::cout << "Saved render stats to " << jsonPath << "\n";
+}
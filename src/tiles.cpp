@@ -0,0 +1,98 @@
+// Tile layout and dispatch order for the render queue.
+// Tiles are walked along a Hilbert curve so workers that start close in time also work close together in the
+// image (and in the BVH). Once tile costs have been measured, the expensive ones are moved to the front so the
+// last tiles of a pass are cheap ones and no core sits idle waiting on a slow one.
+
+struct TileGrid {
+    i32 tileWidth, tileHeight;
+    i32 columns, rows;
+};
+
+// Float color of a tile should stay well inside L2 while its samples are being accumulated
+const i32 TILE_CACHE_BYTES = 64 * 1024;
+const i32 TILE_MAX_SIZE = 64;
+const i32 TILE_MIN_SIZE = 8;
+// Enough tiles per thread that the uneven ones even out at the end of a pass
+const i32 TILES_PER_THREAD = 8;
+// Tiles within a factor of two of each other in cost count as equally expensive, up to this many classes
+const i32 TILE_COST_CLASSES = 4;
+
+static TileGrid
+makeTileGrid(i32 width, i32 height, i32 nThreads, i32 tileWidth, i32 tileHeight) {
+    if (tileWidth <= 0 || tileHeight <= 0) {
+        // Square tiles in multiples of 8, so SIMD rows and preview blocks line up with tile edges
+        i32 size = TILE_MAX_SIZE;
+        while (size > TILE_MIN_SIZE && size * size * (i32)sizeof(Color) > TILE_CACHE_BYTES) {
+            size -= TILE_MIN_SIZE;
+        }
+        i64 wantedTiles = (i64)std::max(nThreads, 1) * TILES_PER_THREAD;
+        while (size > TILE_MIN_SIZE &&
+               (i64)((width + size - 1) / size) * ((height + size - 1) / size) < wantedTiles) {
+            size -= TILE_MIN_SIZE;
+        }
+        tileWidth = size;
+        tileHeight = size;
+    }
+
+    TileGrid grid;
+    grid.tileWidth = tileWidth;
+    grid.tileHeight = tileHeight;
+    grid.columns = (width + tileWidth - 1) / tileWidth;
+    grid.rows = (height + tileHeight - 1) / tileHeight;
+    return grid;
+}
+
+// Position of (x, y) along the Hilbert curve filling a size * size grid, size being a power of two
+static u32
+hilbertIndex(u32 size, u32 x, u32 y) {
+    u32 index = 0;
+    for (u32 s = size / 2; s > 0; s /= 2) {
+        u32 rx = (x & s) > 0;
+        u32 ry = (y & s) > 0;
+        index += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = size - 1 - x;
+                y = size - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return index;
+}
+
+// Tile indices (row * columns + column) in the order they should be queued.
+// Costs are the measured seconds per tile from the previous pass, or empty before there are any.
+static std::vector<i32>
+makeTileOrder(const TileGrid& grid, const std::vector<f64>& costs) {
+    u32 curveSize = 1;
+    while (curveSize < (u32)std::max(grid.columns, grid.rows)) {
+        curveSize *= 2;
+    }
+
+    i32 tileCount = grid.columns * grid.rows;
+    std::vector<std::pair<u32, i32>> keyed(tileCount);
+    for (i32 i = 0; i < tileCount; i++) {
+        keyed[i] = {hilbertIndex(curveSize, i % grid.columns, i / grid.columns), i};
+    }
+    std::sort(keyed.begin(), keyed.end());
+
+    if ((i32)costs.size() == tileCount) {
+        f64 maxCost = *std::max_element(costs.begin(), costs.end());
+        std::vector<i32> costClass(tileCount, 0);
+        for (i32 i = 0; i < tileCount; i++) {
+            for (f64 cost = costs[i] * 2; cost < maxCost && costClass[i] < TILE_COST_CLASSES - 1; cost *= 2) {
+                costClass[i]++;
+            }
+        }
+        std::stable_sort(keyed.begin(), keyed.end(), [&](const std::pair<u32, i32>& a, const std::pair<u32, i32>& b) {
+            return costClass[a.second] < costClass[b.second];
+        });
+    }
+
+    std::vector<i32> order(tileCount);
+    for (i32 i = 0; i < tileCount; i++) {
+        order[i] = keyed[i].second;
+    }
+    return order;
+}
@@ -0,0 +1,212 @@
+// Post-process from the linear float framebuffer to 8-bit sRGB-ish pixels: exposure, tonemap curve,
+// clamping and packing. The AVX2 and AVX-512 kernels are picked at runtime when the CPU has them.
+
+enum TonemapCurve {
+    TONEMAP_GAMMA2,
+    TONEMAP_SRGB,
+    TONEMAP_ACES,
+    TONEMAP_CURVE_COUNT,
+};
+
+static const char* TONEMAP_CURVE_NAMES[TONEMAP_CURVE_COUNT] = {"gamma2", "srgb", "aces"};
+
+struct TonemapSettings {
+    f32 exposure = 0; // in stops
+    TonemapCurve curve = TONEMAP_GAMMA2;
+};
+
+const i32 TONEMAP_ROWS_PER_JOB = 16;
+// Inputs are clamped to this before the curves, which also keeps ACES away from inf / inf
+const f32 TONEMAP_MAX_INPUT = 65504.0f;
+
+// Below this sRGB is linear, the fit would go negative near 0 and crush the shadows
+const f32 SRGB_LINEAR_TOE = 0.0031308f;
+const f32 SRGB_TOE_SLOPE = 12.92f;
+
+// Linear to sRGB without pow, fitted on [SRGB_LINEAR_TOE, 1] from three nested square roots, within a code
+// of the exact curve there
+static f32
+linearToSrgb(f32 x) {
+    if (x < SRGB_LINEAR_TOE) {
+        return SRGB_TOE_SLOPE * x;
+    }
+    f32 s1 = sqrtf(x);
+    f32 s2 = sqrtf(s1);
+    f32 s3 = sqrtf(s2);
+    return 0.662002687f * s1 + 0.684122060f * s2 - 0.323583601f * s3 - 0.0225411470f * x;
+}
+
+// Narkowicz's fit of the ACES filmic curve
+static f32
+acesFilm(f32 x) {
+    return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+}
+
+static f32
+tonemapChannel(f32 x, f32 scale, TonemapCurve curve) {
+    x *= scale;
+    x = x > 0 ? std::min(x, TONEMAP_MAX_INPUT) : 0; // NaN ends up as 0 too
+    switch (curve) {
+    case TONEMAP_GAMMA2: x = sqrtf(std::min(x, 1.0f)); break;
+    case TONEMAP_SRGB: x = linearToSrgb(std::min(x, 1.0f)); break;
+    case TONEMAP_ACES: x = linearToSrgb(std::min(acesFilm(x), 1.0f)); break;
+    default: break;
+    }
+    return x;
+}
+
+static void
+tonemapSpanScalar(const Color* in, Color32* out, i32 count, const TonemapSettings& settings) {
+    f32 scale = exp2f(settings.exposure);
+    for (i32 i = 0; i < count; i++) {
+        Color c = in[i];
+        out[i] = makeColor32(vec3(tonemapChannel(c.r, scale, settings.curve),
+                                  tonemapChannel(c.g, scale, settings.curve),
+                                  tonemapChannel(c.b, scale, settings.curve)));
+    }
+}
+
+#if CPU_X86
+CPU_TARGET_AVX2 static __m256
+tonemapChannelsAvx2(__m256 x, __m256 scale, TonemapCurve curve) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    x = _mm256_max_ps(_mm256_mul_ps(x, scale), zero);
+    x = _mm256_min_ps(x, _mm256_set1_ps(TONEMAP_MAX_INPUT));
+    if (curve == TONEMAP_ACES) {
+        __m256 num = _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.51f)), _mm256_set1_ps(0.03f)));
+        __m256 den = _mm256_add_ps(
+            _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.43f)), _mm256_set1_ps(0.59f))),
+            _mm256_set1_ps(0.14f));
+        x = _mm256_div_ps(num, den);
+    }
+    x = _mm256_min_ps(x, one);
+    __m256 s1 = _mm256_sqrt_ps(x);
+    if (curve == TONEMAP_GAMMA2) {
+        return s1;
+    }
+    __m256 s2 = _mm256_sqrt_ps(s1);
+    __m256 s3 = _mm256_sqrt_ps(s2);
+    __m256 result = _mm256_mul_ps(s1, _mm256_set1_ps(0.662002687f));
+    result = _mm256_add_ps(result, _mm256_mul_ps(s2, _mm256_set1_ps(0.684122060f)));
+    result = _mm256_sub_ps(result, _mm256_mul_ps(s3, _mm256_set1_ps(0.323583601f)));
+    result = _mm256_sub_ps(result, _mm256_mul_ps(x, _mm256_set1_ps(0.0225411470f)));
+    __m256 toe = _mm256_cmp_ps(x, _mm256_set1_ps(SRGB_LINEAR_TOE), _CMP_LT_OQ);
+    return _mm256_blendv_ps(result, _mm256_mul_ps(x, _mm256_set1_ps(SRGB_TOE_SLOPE)), toe);
+}
+
+// 8 pixels per iteration. The 24 interleaved RGB floats are mapped the same way per channel, packed down
+// to bytes and then spread out to RGBA with the alpha set.
+CPU_TARGET_AVX2 static void
+tonemapSpanAvx2(const Color* in, Color32* out, i32 count, const TonemapSettings& settings) {
+    const __m256 scale = _mm256_set1_ps(exp2f(settings.exposure));
+    const __m256 quantize = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256i laneOrder = _mm256_setr_epi32(0, 4, 1, 0, 5, 2, 6, 0);
+    const __m256i spread =
+        _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1,
+                         9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((i32)0xFF000000);
+
+    i32 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const f32* src = (const f32*)(in + i);
+        __m256i v[3];
+        for (i32 k = 0; k < 3; k++) {
+            __m256 x = tonemapChannelsAvx2(_mm256_loadu_ps(src + k * 8), scale, settings.curve);
+            v[k] = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, quantize), half));
+        }
+        // Packing works per 128-bit lane, leaving 4 byte groups in the order v0lo v1lo v2lo v2lo v0hi v1hi ...
+        __m256i words01 = _mm256_packus_epi32(v[0], v[1]);
+        __m256i words22 = _mm256_packus_epi32(v[2], v[2]);
+        __m256i bytes = _mm256_packus_epi16(words01, words22);
+        // Put 4 RGB pixels (12 bytes) in each lane and give every pixel its alpha
+        bytes = _mm256_permutevar8x32_epi32(bytes, laneOrder);
+        bytes = _mm256_or_si256(_mm256_shuffle_epi8(bytes, spread), alpha);
+        _mm256_storeu_si256((__m256i*)(out + i), bytes);
+    }
+    tonemapSpanScalar(in + i, out + i, count - i, settings);
+}
+
+CPU_TARGET_AVX512 static __m512
+tonemapChannelsAvx512(__m512 x, __m512 scale, TonemapCurve curve) {
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    x = _mm512_max_ps(_mm512_mul_ps(x, scale), zero);
+    x = _mm512_min_ps(x, _mm512_set1_ps(TONEMAP_MAX_INPUT));
+    if (curve == TONEMAP_ACES) {
+        __m512 num = _mm512_mul_ps(x, _mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(2.51f)), _mm512_set1_ps(0.03f)));
+        __m512 den = _mm512_add_ps(
+            _mm512_mul_ps(x, _mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(2.43f)), _mm512_set1_ps(0.59f))),
+            _mm512_set1_ps(0.14f));
+        x = _mm512_div_ps(num, den);
+    }
+    x = _mm512_min_ps(x, one);
+    __m512 s1 = _mm512_sqrt_ps(x);
+    if (curve == TONEMAP_GAMMA2) {
+        return s1;
+    }
+    __m512 s2 = _mm512_sqrt_ps(s1);
+    __m512 s3 = _mm512_sqrt_ps(s2);
+    __m512 result = _mm512_mul_ps(s1, _mm512_set1_ps(0.662002687f));
+    result = _mm512_add_ps(result, _mm512_mul_ps(s2, _mm512_set1_ps(0.684122060f)));
+    result = _mm512_sub_ps(result, _mm512_mul_ps(s3, _mm512_set1_ps(0.323583601f)));
+    result = _mm512_sub_ps(result, _mm512_mul_ps(x, _mm512_set1_ps(0.0225411470f)));
+    __mmask16 toe = _mm512_cmp_ps_mask(x, _mm512_set1_ps(SRGB_LINEAR_TOE), _CMP_LT_OQ);
+    return _mm512_mask_blend_ps(toe, result, _mm512_mul_ps(x, _mm512_set1_ps(SRGB_TOE_SLOPE)));
+}
+
+// 16 pixels per iteration. Narrowing to bytes keeps the interleaved RGB order, so the 48 bytes only need
+// spreading out to RGBA, 4 pixels per 128-bit lane like in the AVX2 kernel.
+CPU_TARGET_AVX512 static void
+tonemapSpanAvx512(const Color* in, Color32* out, i32 count, const TonemapSettings& settings) {
+    const __m512 scale = _mm512_set1_ps(exp2f(settings.exposure));
+    const __m512 quantize = _mm512_set1_ps(255.0f);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512i laneOrder = _mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0);
+    const __m512i spread = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+    const __m512i alpha = _mm512_set1_epi32((i32)0xFF000000);
+
+    i32 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const f32* src = (const f32*)(in + i);
+        __m128i v[3];
+        for (i32 k = 0; k < 3; k++) {
+            __m512 x = tonemapChannelsAvx512(_mm512_loadu_ps(src + k * 16), scale, settings.curve);
+            v[k] = _mm512_cvtusepi32_epi8(_mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(x, quantize), half)));
+        }
+        __m512i bytes = _mm512_inserti32x4(_mm512_castsi128_si512(v[0]), v[1], 1);
+        bytes = _mm512_inserti32x4(bytes, v[2], 2);
+        bytes = _mm512_permutexvar_epi32(laneOrder, bytes);
+        bytes = _mm512_or_si512(_mm512_shuffle_epi8(bytes, spread), alpha);
+        _mm512_storeu_si512(out + i, bytes);
+    }
+    tonemapSpanAvx2(in + i, out + i, count - i, settings);
+}
+#endif
+
+static void
+tonemapSpan(const Color* in, Color32* out, i32 count, const TonemapSettings& settings) {
+    gKernels.tonemapSpan(in, out, count, settings);
+}
+
+static void
+tonemapRect(const Framebuffer& framebuffer, Color32* out, i32 outStride, i32 x, i32 y, i32 width, i32 height,
+            const TonemapSettings& settings) {
+    for (i32 row = 0; row < height; row++) {
+        const Color* in = framebuffer.color + (size_t)(y + row) * framebuffer.width + x;
+        tonemapSpan(in, out + (size_t)row * outStride, width, settings);
+    }
+}
+
+// Whole frame into out, split by rows over all threads
+static void
+tonemapFramebuffer(const Framebuffer& framebuffer, Color32* out, i32 outStride, const TonemapSettings& settings) {
+    i32 jobCount = (framebuffer.height + TONEMAP_ROWS_PER_JOB - 1) / TONEMAP_ROWS_PER_JOB;
+    parallelFor(jobCount, [&](int job) {
+        i32 y0 = job * TONEMAP_ROWS_PER_JOB;
+        i32 y1 = std::min(framebuffer.height, y0 + TONEMAP_ROWS_PER_JOB);
+        tonemapRect(framebuffer, out + (size_t)y0 * outStride, outStride, 0, y0, framebuffer.width, y1 - y0,
+                    settings);
+    });
+}
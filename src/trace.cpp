@@ -0,0 +1,124 @@
+// Timeline of what every thread was doing, written in Chrome's trace_event format for Perfetto or
+// chrome://tracing. Each thread records into its own ring buffer without locks. When tracing is off,
+// traceBegin() is a single relaxed load and traceEnd() returns right away.
+
+struct TraceEvent {
+    const char* name;
+    u64 start; // ns since tracing started
+    u64 duration;
+    i32 args[2]; // x and y of tiles, -1 when unused
+};
+
+// Per thread, the oldest events get overwritten once it's full
+const i32 TRACE_RING_SIZE = 16 * 1024;
+
+struct TraceBuffer {
+    TraceEvent events[TRACE_RING_SIZE];
+    std::atomic<u64> count; // only the owning thread writes this
+    const char* threadName;
+    u32 id;
+};
+
+static std::atomic<bool> gTraceEnabled;
+static std::chrono::steady_clock::time_point gTraceStart;
+
+// Worker threads come and go with every pass, so a finished thread hands its buffer on to the next one
+// and the trace shows one lane per concurrently running thread
+static std::mutex gTraceBuffersMutex;
+static std::vector<TraceBuffer*> gTraceBuffers;
+static std::vector<TraceBuffer*> gFreeTraceBuffers;
+
+struct TraceThread {
+    TraceBuffer* buffer = nullptr;
+
+    ~TraceThread() {
+        if (buffer) {
+            std::lock_guard<std::mutex> lockGuard(gTraceBuffersMutex);
+            gFreeTraceBuffers.push_back(buffer);
+        }
+    }
+};
+
+static thread_local TraceThread tTraceThread;
+
+static void
+enableTracing() {
+    gTraceStart = std::chrono::steady_clock::now();
+    gTraceEnabled = true;
+}
+
+static TraceBuffer*
+traceBuffer() {
+    if (!tTraceThread.buffer) {
+        std::lock_guard<std::mutex> lockGuard(gTraceBuffersMutex);
+        if (gFreeTraceBuffers.empty()) {
+            TraceBuffer* buffer = new TraceBuffer();
+            buffer->id = (u32)gTraceBuffers.size() + 1;
+            buffer->threadName = "thread";
+            gTraceBuffers.push_back(buffer);
+            gFreeTraceBuffers.push_back(buffer);
+        }
+        tTraceThread.buffer = gFreeTraceBuffers.back();
+        gFreeTraceBuffers.pop_back();
+    }
+    return tTraceThread.buffer;
+}
+
+static void
+traceThreadName(const char* name) {
+    if (gTraceEnabled.load(std::memory_order_relaxed)) {
+        traceBuffer()->threadName = name;
+    }
+}
+
+// Returns 0 when tracing is off, traceEnd() then does nothing
+static u64
+traceBegin() {
+    if (!gTraceEnabled.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    std::chrono::nanoseconds sinceStart = std::chrono::steady_clock::now() - gTraceStart;
+    return (u64)sinceStart.count() + 1;
+}
+
+static void
+traceEnd(const char* name, u64 start, i32 arg0 = -1, i32 arg1 = -1) {
+    if (start == 0) {
+        return;
+    }
+    u64 end = traceBegin();
+    TraceBuffer* buffer = traceBuffer();
+    u64 count = buffer->count.load(std::memory_order_relaxed);
+    buffer->events[count % TRACE_RING_SIZE] = {name, start - 1, end - start, {arg0, arg1}};
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+// Meant to be called while the traced threads are idle, anything recorded meanwhile may come out torn
+static bool
+writeTrace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lockGuard(gTraceBuffersMutex);
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    const char* separator = "";
+    for (TraceBuffer* buffer : gTraceBuffers) {
+        fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, ", separator, buffer->id);
+        fprintf(file, "\"args\": {\"name\": \"%s\"}}", buffer->threadName);
+        separator = ",\n";
+        u64 count = buffer->count.load(std::memory_order_acquire);
+        u64 first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+        for (u64 i = first; i < count; i++) {
+            const TraceEvent& event = buffer->events[i % TRACE_RING_SIZE];
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+                    separator, event.name, buffer->id, event.start / 1000.0, event.duration / 1000.0);
+            if (event.args[0] >= 0) {
+                fprintf(file, ", \"args\": {\"x\": %d, \"y\": %d}", event.args[0], event.args[1]);
+            }
+            fprintf(file, "}");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
@@ -26,22 +26,82 @@ struct Color32 {
 
 typedef Vec3 Color;
 
+// Linear float color is what the renderer accumulates into, pixels is the 8-bit copy for display and PNG
+struct Framebuffer {
+    i32 width;
+    i32 height;
+    Color* color;
+    Color32* pixels;
+    // What the camera rays hit first, averaged over the samples like color. Null unless something uses them.
+    Color* albedo;
+    Vec3* normal;
+    // Mean of the samples' squared luminance, which gives their variance, to tell noise from detail
+    f32* luminanceSquared;
+    // From the first sample of every pixel, these don't average. Null unless AOVs are written.
+    f32* depth;
+    i32* materialId;
+    i32* primitiveId;
+};
+
 struct Material;
 
+enum MaterialType {
+    MATERIAL_LAMBERTIAN,
+    MATERIAL_METAL,
+    MATERIAL_DIELECTRIC,
+    MATERIAL_LIGHT,
+    MATERIAL_TYPE_COUNT,
+};
+
+// Plain description a Material is made from, this is what scene files and caches store
+struct MaterialDesc {
+    u32 type;
+    Color albedo; // emitted radiance for lights
+    f32 fuzz;
+    f32 refIdx;
+};
+
+// Spheres move linearly from center0 at shutter open to center1 at shutter close.
+// Plain data, so sphere arrays can be used straight from a mapped scene cache.
 struct Sphere {
-    Vec3 center;
+    Vec3 center0;
+    Vec3 center1;
     f32 radius;
-    Material* material;
+    u32 material; // index into World::materials
+};
+
+struct Aabb {
+    Vec3 min;
+    Vec3 max;
+};
+
+// Interior nodes keep their first child right after them and the second one at offset.
+// Leaves reference count spheres starting at offset.
+struct BvhNode {
+    Aabb bounds[2]; // at shutter open and close
+    u32 offset;
+    u16 count;
+    u16 axis;
 };
+
+struct Bvh {
+    Array<BvhNode> nodes;
+};
+
 struct World {
     Array<Sphere> spheres;
+    Array<u32> sphereIds; // index each sphere had in the scene before the BVH build reordered them
+    Array<MaterialDesc> materialDescs;
+    Array<Material*> materials; // made from materialDescs, same order
+    Array<u32> lights;          // spheres with an emitting material
+    Bvh bvh;
 };
 
 struct HitInfo {
     f32 t;
     Vec3 point;
     Vec3 normal;
-    Material* material;
+    u32 material;
 };
 
 static Vec3
@@ -67,15 +127,19 @@ makeColor32(u8 r, u8 g, u8 b, u8 a = 255) {
     return result;
 }
 
+static u8
+quantizeChannel(f32 value) {
+    return u8(HMM_Clamp(0.0f, value, 1.0f) * 255 + 0.5f);
+}
+
+static f32
+luminance(Color color) {
+    return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
 static Color32
 makeColor32(Color color) {
     Color32 result;
-    result = makeColor32(u8(color.r * 255), u8(color.g * 255), u8(color.b * 255));
+    result = makeColor32(quantizeChannel(color.r), quantizeChannel(color.g), quantizeChannel(color.b));
     return result;
 }
-
-static void
-setPixelColor(Color32* pixels, i32 x, i32 y, Color color) {
-    Color32 color32 = makeColor32(color);
-    pixels[y * WIDTH + x] = color32;
-}